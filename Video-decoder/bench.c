@@ -0,0 +1,589 @@
+/*
+ * File:
+ *  bench.c
+ *
+ * Description:
+ *  Standalone benchmark of the hot paths of libvideo_decoder, built by make bench
+ *  without Lua and Torch: test streams are synthesized in memory with libavcodec
+ *  (MPEG-4, H.264 if the encoder is available, MJPEG) and decoded, then the frame
+ *  conversions, the JPEG codec, the encoder path and the motion detector are timed
+ *  on the synthetic frames; the results are written to stdout as CSV, with the
+ *  throughput in frames per second and in MB/s of RGB24 frames
+ *  The functions of video_decoder.c need a Lua state and TH tensors, so the kernels
+ *  they call (yuvlut.c, yuvrgb.c, mpjpeg.c, motion.c) and libav are timed directly,
+ *  on one thread
+ *
+ *  Usage: video_bench [-n frames] [-t decoder_threads] [WxH ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libswscale/swscale.h>
+#include "yuvrgb.h"
+#include "yuvlut.h"
+#include "motion.h"
+#include "stats.h"
+
+#ifdef NEWFFMPEG
+#define av_free_packet(a) av_packet_unref(a)
+#endif
+
+// Defined in mpjpeg.c
+int jpeg_create_buf_planes(unsigned char **dest, unsigned long *destsize, const unsigned char *const planes[3],
+	const int strides[3], int width, int height, int vshift, int quality);
+int jpeg_create_buf_yuyv(unsigned char **dest, unsigned long *destsize, const void *buf, int width, int height, int quality);
+int jpeg_decode_scaled(const void *buf, unsigned len, int denom, unsigned char *const planes[3],
+	const int strides[3], int *width, int *height);
+
+#define JPEG_QUALITY 75
+#define NPATTERNS 2	// Synthetic frames, alternated so that the motion detector sees changes
+
+static int nframes = 100, decoder_threads = 1;
+
+// yuv420p frame with contiguous planes
+typedef struct {
+	int w, h;
+	uint8_t *data[3];
+	int linesize[3];
+} YUVFRAME;
+
+static void report(const char *kernel, const char *impl, const char *codec, int w, int h, int n, uint64_t us)
+{
+	double s = us * 1e-6, fps = s > 0 ? n / s : 0;
+
+	printf("%s,%s,%s,%d,%d,%d,%.6f,%.2f,%.2f\n", kernel, impl, codec, w, h, n, s, fps, fps * w * h * 3 / 1e6);
+	fflush(stdout);
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if(!p)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+// Moving diagonal bands with a square moving the other way and some noise
+static void yuvframe_fill(YUVFRAME *f, int t)
+{
+	int i, j;
+	unsigned seed = 12345 + t;
+
+	for(i = 0; i < f->h; i++)
+		for(j = 0; j < f->w; j++)
+		{
+			int v = ((i + j + 4 * t) & 63) * 3 + 16;
+
+			if(abs(i - f->h / 2) < f->h / 8 && abs(j - (f->w / 2 - 8 * t) % f->w) < f->h / 8)
+				v = 235;
+			seed = seed * 1103515245 + 12345;
+			f->data[0][i * f->linesize[0] + j] = v + (seed >> 29);
+		}
+	for(i = 0; i < (f->h + 1) / 2; i++)
+		for(j = 0; j < (f->w + 1) / 2; j++)
+		{
+			f->data[1][i * f->linesize[1] + j] = 128 + (((j + t) & 31) - 16) * 2;
+			f->data[2][i * f->linesize[2] + j] = 128 + (((i - t) & 31) - 16) * 2;
+		}
+}
+
+static void yuvframe_alloc(YUVFRAME *f, int w, int h)
+{
+	f->w = w;
+	f->h = h;
+	f->linesize[0] = w;
+	f->linesize[1] = f->linesize[2] = (w + 1) / 2;
+	f->data[0] = (uint8_t *)xmalloc(w * h);
+	f->data[1] = (uint8_t *)xmalloc(f->linesize[1] * ((h + 1) / 2));
+	f->data[2] = (uint8_t *)xmalloc(f->linesize[2] * ((h + 1) / 2));
+}
+
+static void yuvframe_free(YUVFRAME *f)
+{
+	free(f->data[0]);
+	free(f->data[1]);
+	free(f->data[2]);
+}
+
+static void yuvframe_toavframe(const YUVFRAME *f, AVFrame *frame)
+{
+	int c;
+
+	for(c = 0; c < 3; c++)
+	{
+		frame->data[c] = f->data[c];
+		frame->linesize[c] = f->linesize[c];
+	}
+	frame->width = f->w;
+	frame->height = f->h;
+}
+
+/***************************************
+Streams
+***************************************/
+
+// Encode nframes of the patterns to *pkts; returns the number of packets, -1 if the encoder is missing
+static int encode_stream(enum AVCodecID id, YUVFRAME *pattern, AVPacket **pkts)
+{
+	AVCodec *codec = avcodec_find_encoder(id);
+	AVCodecContext *ctx;
+	AVFrame *frame;
+	int i, got, n = 0;
+
+	if(!codec || !(ctx = avcodec_alloc_context3(codec)))
+		return -1;
+	ctx->width = pattern->w;
+	ctx->height = pattern->h;
+	ctx->time_base.num = 1;
+	ctx->time_base.den = 25;
+	ctx->pix_fmt = id == AV_CODEC_ID_MJPEG ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P;
+	ctx->gop_size = 12;
+	ctx->max_b_frames = 0;
+	ctx->bit_rate = (int64_t)pattern->w * pattern->h * 4;
+	if(avcodec_open2(ctx, codec, 0) < 0)
+	{
+		av_free(ctx);
+		return -1;
+	}
+	*pkts = (AVPacket *)xmalloc((nframes + 16) * sizeof(AVPacket));
+	frame = av_frame_alloc();
+	frame->format = ctx->pix_fmt;
+	for(i = 0; ; i++)
+	{
+		AVPacket *pkt = &(*pkts)[n];
+
+		av_init_packet(pkt);
+		pkt->data = 0;
+		pkt->size = 0;
+		if(i < nframes)
+		{
+			yuvframe_toavframe(&pattern[i % NPATTERNS], frame);
+			frame->pts = i;
+		}
+		// Flush the delayed packets at the end
+		if(avcodec_encode_video2(ctx, pkt, i < nframes ? frame : 0, &got) < 0 || (!got && i >= nframes) || n == nframes + 16)
+			break;
+		if(got)
+			n++;
+	}
+	av_frame_free(&frame);
+	avcodec_close(ctx);
+	av_free(ctx);
+	return n;
+}
+
+static void bench_decode(enum AVCodecID id, const char *name, AVPacket *pkts, int npkts, int w, int h)
+{
+	AVCodec *codec = avcodec_find_decoder(id);
+	AVCodecContext *ctx;
+	AVFrame *frame;
+	AVPacket flush;
+	int i, got, decoded = 0;
+	uint64_t t0;
+
+	if(!codec || !(ctx = avcodec_alloc_context3(codec)))
+		return;
+	ctx->thread_count = decoder_threads;
+	if(avcodec_open2(ctx, codec, 0) < 0)
+	{
+		av_free(ctx);
+		return;
+	}
+	frame = av_frame_alloc();
+	t0 = stats_now_us();
+	for(i = 0; i < npkts; i++)
+		if(avcodec_decode_video2(ctx, frame, &got, &pkts[i]) >= 0 && got)
+			decoded++;
+	memset(&flush, 0, sizeof(flush));
+	av_init_packet(&flush);
+	while(avcodec_decode_video2(ctx, frame, &got, &flush) >= 0 && got)
+		decoded++;
+	report("decode", "libavcodec", name, w, h, decoded, stats_now_us() - t0);
+	av_frame_free(&frame);
+	avcodec_close(ctx);
+	av_free(ctx);
+}
+
+/***************************************
+Kernels
+***************************************/
+
+// Planar RGB buffers, as the tensors of frame_rgb and encoderwrite
+typedef struct {
+	uint8_t *byte;
+	float *flt;
+} RGBPLANES;
+
+// YUV to planar RGB of ToTensor, with the lookup tables and the SIMD row converters
+static void bench_torgb(const YUVFRAME *f, RGBPLANES *rgb)
+{
+	long plane = (long)f->w * f->h;
+	AVFrame yuv, planes;
+	uint64_t t0;
+	int simd, n, c;
+
+	memset(&yuv, 0, sizeof(yuv));
+	memset(&planes, 0, sizeof(planes));
+	yuvframe_toavframe(f, &yuv);
+	for(c = 0; c < 3; c++)
+		planes.data[c] = rgb->byte + c * ((f->w & ~1) * (long)f->h);
+	for(simd = 0; simd < 2; simd++)
+	{
+		const char *impl = yuvlut_select(simd);
+
+		if(simd && !strcmp(impl, "lut"))
+			break;
+		t0 = stats_now_us();
+		for(n = 0; n < nframes; n++)
+			video_decoder_yuv420p_rgbp(&yuv, &planes);
+		report("totensor_byte", impl, "", f->w, f->h, nframes, stats_now_us() - t0);
+		t0 = stats_now_us();
+		for(n = 0; n < nframes; n++)
+			yuv420p_floatrgbp(&yuv, rgb->flt, plane, f->w, f->w, f->h);
+		report("totensor_float", impl, "", f->w, f->h, nframes, stats_now_us() - t0);
+	}
+	yuvlut_select(1);
+}
+
+// YUYV frame of the capture path from the yuv420p pattern
+static uint8_t *yuyv_fromyuv420(const YUVFRAME *f)
+{
+	uint8_t *yuyv = (uint8_t *)xmalloc(f->w * f->h * 2);
+	int i, j;
+
+	for(i = 0; i < f->h; i++)
+		for(j = 0; j < f->w / 2; j++)
+		{
+			uint8_t *p = yuyv + (i * f->w + 2 * j) * 2;
+
+			p[0] = f->data[0][i * f->linesize[0] + 2 * j];
+			p[1] = f->data[1][i / 2 * f->linesize[1] + j];
+			p[2] = f->data[0][i * f->linesize[0] + 2 * j + 1];
+			p[3] = f->data[2][i / 2 * f->linesize[2] + j];
+		}
+	return yuyv;
+}
+
+// YUYV to planar RGB of the capture path (yuyv_totensor)
+static void bench_yuyv(const YUVFRAME *f, RGBPLANES *rgb)
+{
+	uint8_t *yuyv = yuyv_fromyuv420(f);
+	int n, w = f->w & ~1;
+	long plane = (long)w * f->h;
+	uint64_t t0;
+
+	t0 = stats_now_us();
+	for(n = 0; n < nframes; n++)
+		yuyv2torchRGB(yuyv, rgb->byte, plane, w, w, f->h);
+	report("yuyv_totensor_byte", "lut", "", w, f->h, nframes, stats_now_us() - t0);
+	t0 = stats_now_us();
+	for(n = 0; n < nframes; n++)
+		yuyv2torchfloatRGB(yuyv, rgb->flt, plane, w, w, f->h);
+	report("yuyv_totensor_float", "lut", "", w, f->h, nframes, stats_now_us() - t0);
+	free(yuyv);
+}
+
+// sws_scale to half size packed RGB, then rgb_tofloat, as scale_torgb does with one thread
+static void bench_scale(const YUVFRAME *f, RGBPLANES *rgb)
+{
+	int dw = f->w / 2, dh = f->h / 2, dststride = (dw * 3 + 3) / 4 * 4;
+	struct SwsContext *sws = sws_getContext(f->w, f->h, AV_PIX_FMT_YUV420P, dw, dh, AV_PIX_FMT_RGB24, SWS_FAST_BILINEAR, 0, 0, 0);
+	uint8_t *packed = (uint8_t *)xmalloc(dststride * dh + 3);
+	uint8_t *dst[3] = {packed, 0, 0};
+	int dstlinesize[3] = {dststride, 0, 0};
+	const uint8_t *src[3] = {f->data[0], f->data[1], f->data[2]};
+	uint64_t t0;
+	int n;
+
+	if(!sws)
+	{
+		free(packed);
+		return;
+	}
+	t0 = stats_now_us();
+	for(n = 0; n < nframes; n++)
+	{
+		sws_scale(sws, src, f->linesize, 0, f->h, dst, dstlinesize);
+		rgb_tofloat(packed, dw, dh, rgb->flt, dw * dh, dw, 0);
+	}
+	report("sws_rgb_tofloat", "sws_fast_bilinear", "", dw, dh, nframes, stats_now_us() - t0);
+	sws_freeContext(sws);
+	free(packed);
+}
+
+// Planar RGB to yuv420p of encoderwrite, alone and followed by the MPEG-4 encoder
+static void bench_encoder(const YUVFRAME *f, const RGBPLANES *rgb)
+{
+	RGBROW_BYTE frombyte;
+	RGBROW_FLOAT fromfloat;
+	YUVFRAME yuv;
+	long plane = (long)f->w * f->h;
+	uint64_t t0;
+	int simd, n, i, c, got;
+
+	yuvframe_alloc(&yuv, f->w, f->h);
+	for(simd = 0; simd < 2; simd++)
+	{
+		const char *impl = rgbrow_select(simd, &frombyte, &fromfloat);
+
+		if(simd && !strcmp(impl, "c"))
+			break;
+		for(c = 0; c < 2; c++)
+		{
+			t0 = stats_now_us();
+			for(n = 0; n < nframes; n++)
+				for(i = 0; i < f->h; i += 2)
+				{
+					int i1 = i + 1 < f->h ? i + 1 : i;
+					uint8_t *y0 = yuv.data[0] + yuv.linesize[0] * i, *y1 = yuv.data[0] + yuv.linesize[0] * i1;
+					uint8_t *u = yuv.data[1] + yuv.linesize[1] * (i / 2), *v = yuv.data[2] + yuv.linesize[2] * (i / 2);
+
+					if(c)
+					{
+						const float *row[6] = {rgb->flt + f->w * i, rgb->flt + plane + f->w * i, rgb->flt + 2 * plane + f->w * i,
+							rgb->flt + f->w * i1, rgb->flt + plane + f->w * i1, rgb->flt + 2 * plane + f->w * i1};
+						fromfloat(row, y0, y1, u, v, f->w);
+					} else {
+						const uint8_t *row[6] = {rgb->byte + f->w * i, rgb->byte + plane + f->w * i, rgb->byte + 2 * plane + f->w * i,
+							rgb->byte + f->w * i1, rgb->byte + plane + f->w * i1, rgb->byte + 2 * plane + f->w * i1};
+						frombyte(row, y0, y1, u, v, f->w);
+					}
+				}
+			report(c ? "rgb_toyuv420_float" : "rgb_toyuv420_byte", impl, "", f->w, f->h, nframes, stats_now_us() - t0);
+		}
+	}
+
+	// The whole path of the encoding thread, with the fastest converter
+	AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+	AVCodecContext *ctx = codec ? avcodec_alloc_context3(codec) : 0;
+	AVFrame *frame = av_frame_alloc();
+	AVPacket pkt;
+
+	rgbrow_select(1, &frombyte, &fromfloat);
+	if(ctx)
+	{
+		ctx->width = f->w;
+		ctx->height = f->h;
+		ctx->time_base.num = 1;
+		ctx->time_base.den = 25;
+		ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+		ctx->bit_rate = (int64_t)f->w * f->h * 4;
+	}
+	if(ctx && avcodec_open2(ctx, codec, 0) >= 0)
+	{
+		yuvframe_toavframe(&yuv, frame);
+		frame->format = AV_PIX_FMT_YUV420P;
+		t0 = stats_now_us();
+		for(n = 0; n < nframes; n++)
+		{
+			for(i = 0; i < f->h; i += 2)
+			{
+				int i1 = i + 1 < f->h ? i + 1 : i;
+				const float *row[6] = {rgb->flt + f->w * i, rgb->flt + plane + f->w * i, rgb->flt + 2 * plane + f->w * i,
+					rgb->flt + f->w * i1, rgb->flt + plane + f->w * i1, rgb->flt + 2 * plane + f->w * i1};
+
+				fromfloat(row, yuv.data[0] + yuv.linesize[0] * i, yuv.data[0] + yuv.linesize[0] * i1,
+					yuv.data[1] + yuv.linesize[1] * (i / 2), yuv.data[2] + yuv.linesize[2] * (i / 2), f->w);
+			}
+			frame->pts = n;
+			av_init_packet(&pkt);
+			pkt.data = 0;
+			pkt.size = 0;
+			if(avcodec_encode_video2(ctx, &pkt, frame, &got) >= 0 && got)
+				av_free_packet(&pkt);
+		}
+		report("encoder", "mpeg4", "mpeg4", f->w, f->h, nframes, stats_now_us() - t0);
+		avcodec_close(ctx);
+	}
+	av_free(ctx);
+	av_frame_free(&frame);
+	yuvframe_free(&yuv);
+}
+
+// Output buffer reused across the encodings, as the JPEG server encoder does
+typedef struct {
+	unsigned char *buf;
+	unsigned long cap, size;
+} JPEGBUF;
+
+// libjpeg replaces the buffer when it's too small, size is the size of the image
+static void jpegbuf_update(JPEGBUF *j, unsigned char *buf, unsigned long size)
+{
+	if(buf != j->buf)
+	{
+		free(j->buf);
+		j->buf = buf;
+		j->cap = size;
+	}
+	j->size = size;
+}
+
+static void bench_jpeg(const YUVFRAME *f)
+{
+	JPEGBUF jpeg = {0, 0, 0};
+	uint8_t *yuyv = yuyv_fromyuv420(f);
+	unsigned char *buf;
+	unsigned long size;
+	YUVFRAME out;
+	int denom, n, w, h;
+	char impl[10];
+	uint64_t t0;
+
+	t0 = stats_now_us();
+	for(n = 0; n < nframes; n++)
+	{
+		buf = jpeg.buf;
+		size = jpeg.cap;
+		if(jpeg_create_buf_yuyv(&buf, &size, yuyv, f->w & ~1, f->h, JPEG_QUALITY))
+			break;
+		jpegbuf_update(&jpeg, buf, size);
+	}
+	report("jpeg_encode", "yuyv", "mjpeg", f->w & ~1, f->h, n, stats_now_us() - t0);
+	t0 = stats_now_us();
+	for(n = 0; n < nframes; n++)
+	{
+		buf = jpeg.buf;
+		size = jpeg.cap;
+		jpeg_create_buf_planes(&buf, &size, (const unsigned char *const *)f->data, f->linesize, f->w, f->h, 1, JPEG_QUALITY);
+		jpegbuf_update(&jpeg, buf, size);
+	}
+	report("jpeg_encode", "yuv420p", "mjpeg", f->w, f->h, nframes, stats_now_us() - t0);
+
+	// Decode the last JPEG at full and reduced scale, as MPJPEG with dct_scaling
+	yuvframe_alloc(&out, f->w, f->h);
+	for(denom = 1; denom <= 8; denom *= 2)
+	{
+		snprintf(impl, sizeof(impl), "1/%d", denom);
+		t0 = stats_now_us();
+		for(n = 0; n < nframes; n++)
+			if(jpeg_decode_scaled(jpeg.buf, jpeg.size, denom, out.data, out.linesize, &w, &h))
+				break;
+		report("jpeg_decode", impl, "mjpeg", (f->w + denom - 1) / denom, (f->h + denom - 1) / denom, n, stats_now_us() - t0);
+	}
+	yuvframe_free(&out);
+	free(yuyv);
+	free(jpeg.buf);
+}
+
+static void bench_motion(const YUVFRAME *pattern)
+{
+	MOTIONDET m;
+	uint64_t t0;
+	int simd, n;
+
+	for(simd = 0; simd < 2; simd++)
+	{
+		const char *impl = motion_select(simd);
+
+		if(simd && !strcmp(impl, "c"))
+			break;
+		memset(&m, 0, sizeof(m));
+		m.width = pattern->w;
+		m.height = pattern->h;
+		m.scale = 2;
+		m.block = 16;
+		m.sensitivity = 20;
+		m.block_percent = 10;
+		m.shift = 3;
+		if(motion_init(&m))
+			return;
+		t0 = stats_now_us();
+		for(n = 0; n < nframes; n++)
+			motion_detect(&m, pattern[n % NPATTERNS].data[0], pattern->linesize[0], 1, 0);
+		report("motion", impl, "", pattern->w, pattern->h, nframes, stats_now_us() - t0);
+		motion_free(&m);
+	}
+}
+
+static void bench_size(int w, int h)
+{
+	static const struct {
+		enum AVCodecID id;
+		const char *name;
+	} codecs[] = {{AV_CODEC_ID_MPEG4, "mpeg4"}, {AV_CODEC_ID_H264, "h264"}, {AV_CODEC_ID_MJPEG, "mjpeg"}};
+	YUVFRAME pattern[NPATTERNS];
+	RGBPLANES rgb;
+	AVPacket *pkts;
+	int i, n;
+
+	for(i = 0; i < NPATTERNS; i++)
+	{
+		yuvframe_alloc(&pattern[i], w, h);
+		yuvframe_fill(&pattern[i], i);
+	}
+	for(i = 0; i < (int)(sizeof(codecs) / sizeof(*codecs)); i++)
+	{
+		n = encode_stream(codecs[i].id, pattern, &pkts);
+		if(n < 0)
+		{
+			fprintf(stderr, "No %s encoder, skipping its decoding\n", codecs[i].name);
+			continue;
+		}
+		bench_decode(codecs[i].id, codecs[i].name, pkts, n, w, h);
+		while(n--)
+			av_free_packet(&pkts[n]);
+		free(pkts);
+	}
+	// Gray planes, overwritten by the RGB conversions before the encoder reads them
+	rgb.byte = (uint8_t *)xmalloc(3L * w * h);
+	rgb.flt = (float *)xmalloc(3L * w * h * sizeof(float));
+	for(i = 0; i < 3 * w * h; i++)
+	{
+		rgb.byte[i] = pattern[0].data[0][i % (w * h)];
+		rgb.flt[i] = rgb.byte[i] * BYTE2FLOAT;
+	}
+	bench_yuyv(&pattern[0], &rgb);
+	bench_torgb(&pattern[0], &rgb);
+	bench_encoder(&pattern[0], &rgb);
+	bench_scale(&pattern[0], &rgb);
+	bench_jpeg(&pattern[0]);
+	bench_motion(pattern);
+	free(rgb.byte);
+	free(rgb.flt);
+	for(i = 0; i < NPATTERNS; i++)
+		yuvframe_free(&pattern[i]);
+}
+
+int main(int argc, char **argv)
+{
+	static const int defsizes[][2] = {{320, 240}, {640, 480}, {1280, 720}, {1920, 1080}};
+	int i, w, h, nsizes = 0;
+
+#ifndef NEWFFMPEG
+	avcodec_register_all();
+#endif
+	av_log_set_level(AV_LOG_QUIET);
+	video_decoder_yuv420p_rgbp_LUT();
+	printf("kernel,impl,codec,width,height,frames,seconds,fps,mb_s\n");
+	for(i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-n") && i + 1 < argc)
+			nframes = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-t") && i + 1 < argc)
+			decoder_threads = atoi(argv[++i]);
+		else if(sscanf(argv[i], "%dx%d", &w, &h) == 2 && w >= 16 && h >= 16)
+		{
+			bench_size(w, h);
+			nsizes++;
+		} else {
+			fprintf(stderr, "Usage: %s [-n frames] [-t decoder_threads] [WxH ...]\n", argv[0]);
+			return 1;
+		}
+		if(nframes < 1 || decoder_threads < 0)
+		{
+			fprintf(stderr, "Invalid number of frames or threads\n");
+			return 1;
+		}
+	}
+	if(!nsizes)
+		for(i = 0; i < (int)(sizeof(defsizes) / sizeof(*defsizes)); i++)
+			bench_size(defsizes[i][0], defsizes[i][1]);
+	return 0;
+}
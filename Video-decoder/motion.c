@@ -0,0 +1,207 @@
+/*
+ * File:
+ *  motion.c
+ *
+ * Description:
+ *  Block-grid motion detector for video_decoder.c: the luma plane is downsampled,
+ *  compared with a running average background 16 pixels at a time (SSE2, NEON)
+ *  and the background is updated in the same pass; a block is active when enough
+ *  of its pixels differ from the background more than the sensitivity
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "motion.h"
+
+// Compare n pixels (multiple of 16) of cur with the background, update it and
+// return the number of changed pixels
+typedef int (*MOTIONROW)(const uint8_t *cur, int16_t *bg, int n, int sensitivity, int shift);
+
+static int motionrow_c(const uint8_t *cur, int16_t *bg, int n, int sensitivity, int shift)
+{
+	int j, d, changed = 0;
+
+	for(j = 0; j < n; j++)
+	{
+		d = cur[j] - (bg[j] >> MOTION_FRACBITS);
+		if(d > sensitivity || d < -sensitivity)
+			changed++;
+		bg[j] += ((cur[j] << MOTION_FRACBITS) - bg[j]) >> shift;
+	}
+	return changed;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define TARGET_SSE2 __attribute__((target("sse2")))
+
+static TARGET_SSE2 int motionrow_sse2(const uint8_t *cur, int16_t *bg, int n, int sensitivity, int shift)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i sens = _mm_set1_epi8((char)sensitivity);
+	const __m128i sh = _mm_cvtsi32_si128(shift);
+	int j, changed = 0;
+
+	for(j = 0; j < n; j += 16)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *)(cur + j));
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(bg + j));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(bg + j + 8));
+		__m128i b = _mm_packus_epi16(_mm_srai_epi16(b0, MOTION_FRACBITS), _mm_srai_epi16(b1, MOTION_FRACBITS));
+		__m128i d = _mm_or_si128(_mm_subs_epu8(c, b), _mm_subs_epu8(b, c));
+		// Pixels with d <= sensitivity are zero after the saturated subtraction
+		int same = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(d, sens), zero));
+		__m128i c0 = _mm_slli_epi16(_mm_unpacklo_epi8(c, zero), MOTION_FRACBITS);
+		__m128i c1 = _mm_slli_epi16(_mm_unpackhi_epi8(c, zero), MOTION_FRACBITS);
+
+		changed += 16 - __builtin_popcount(same);
+		b0 = _mm_add_epi16(b0, _mm_sra_epi16(_mm_sub_epi16(c0, b0), sh));
+		b1 = _mm_add_epi16(b1, _mm_sra_epi16(_mm_sub_epi16(c1, b1), sh));
+		_mm_storeu_si128((__m128i *)(bg + j), b0);
+		_mm_storeu_si128((__m128i *)(bg + j + 8), b1);
+	}
+	return changed;
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+static int motionrow_neon(const uint8_t *cur, int16_t *bg, int n, int sensitivity, int shift)
+{
+	const uint8x16_t sens = vdupq_n_u8(sensitivity);
+	const int16x8_t sh = vdupq_n_s16(-shift);
+	uint16x8_t acc = vdupq_n_u16(0);
+	int j;
+
+	for(j = 0; j < n; j += 16)
+	{
+		uint8x16_t c = vld1q_u8(cur + j);
+		int16x8_t b0 = vld1q_s16(bg + j);
+		int16x8_t b1 = vld1q_s16(bg + j + 8);
+		uint8x16_t b = vcombine_u8(vqshrun_n_s16(b0, MOTION_FRACBITS), vqshrun_n_s16(b1, MOTION_FRACBITS));
+		// 1 for every changed pixel, at most n / 16 for every lane of acc
+		uint8x16_t changed = vshrq_n_u8(vcgtq_u8(vabdq_u8(c, b), sens), 7);
+		int16x8_t c0 = vreinterpretq_s16_u16(vshll_n_u8(vget_low_u8(c), MOTION_FRACBITS));
+		int16x8_t c1 = vreinterpretq_s16_u16(vshll_n_u8(vget_high_u8(c), MOTION_FRACBITS));
+
+		acc = vpadalq_u8(acc, changed);
+		vst1q_s16(bg + j, vaddq_s16(b0, vshlq_s16(vsubq_s16(c0, b0), sh)));
+		vst1q_s16(bg + j + 8, vaddq_s16(b1, vshlq_s16(vsubq_s16(c1, b1), sh)));
+	}
+	return vgetq_lane_u16(acc, 0) + vgetq_lane_u16(acc, 1) + vgetq_lane_u16(acc, 2) + vgetq_lane_u16(acc, 3) +
+		vgetq_lane_u16(acc, 4) + vgetq_lane_u16(acc, 5) + vgetq_lane_u16(acc, 6) + vgetq_lane_u16(acc, 7);
+}
+#endif
+
+static MOTIONROW motionrow = motionrow_c;
+
+const char *motion_select(int simd)
+{
+	motionrow = motionrow_c;
+	if(!simd)
+		return "c";
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2"))
+	{
+		motionrow = motionrow_sse2;
+		return "sse2";
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	motionrow = motionrow_neon;
+	return "neon";
+#endif
+	return "c";
+}
+
+int motion_init(MOTIONDET *m)
+{
+	m->w = m->width / m->scale;
+	m->h = m->height / m->scale;
+	m->bw = (m->w + m->block - 1) / m->block;
+	m->bh = (m->h + m->block - 1) / m->block;
+	m->stride = m->bw * m->block;
+	m->cur = (uint8_t *)calloc(m->stride * m->bh * m->block, 1);
+	m->bg = (int16_t *)calloc(m->stride * m->bh * m->block, sizeof(int16_t));
+	m->map = (uint8_t *)calloc(m->bw * m->bh, 1);
+	m->nframes = 0;
+	if(!m->cur || !m->bg || !m->map)
+	{
+		motion_free(m);
+		return -1;
+	}
+	return 0;
+}
+
+void motion_free(MOTIONDET *m)
+{
+	free(m->cur);
+	free(m->bg);
+	free(m->map);
+	m->cur = 0;
+	m->bg = 0;
+	m->map = 0;
+}
+
+// Average the luma on scale x scale squares into the rows from row0 to row1 of cur
+static void downsample(MOTIONDET *m, const uint8_t *luma, int linesize, int step, int row0, int row1)
+{
+	int i, j, a, b, sum, s = m->scale, sh = s == 4 ? 4 : s == 2 ? 2 : 0;
+
+	for(i = row0; i < row1; i++)
+	{
+		uint8_t *dst = m->cur + i * m->stride;
+		const uint8_t *src = luma + i * s * linesize;
+
+		if(s == 1 && step == 1)
+		{
+			memcpy(dst, src, m->w);
+			continue;
+		}
+		for(j = 0; j < m->w; j++)
+		{
+			sum = 0;
+			for(a = 0; a < s; a++)
+				for(b = 0; b < s; b++)
+					sum += src[a * linesize + (j * s + b) * step];
+			dst[j] = (sum + (1 << sh >> 1)) >> sh;
+		}
+	}
+}
+
+int motion_detect(MOTIONDET *m, const uint8_t *luma, int linesize, int step, int maxactive)
+{
+	int bi, bj, i, row1, changed, active = 0;
+
+	memset(m->map, 0, m->bw * m->bh);
+	for(bi = 0; bi < m->bh; bi++)
+	{
+		// Only the rows of this band of blocks are downsampled, so that an early stop skips the others
+		row1 = (bi + 1) * m->block < m->h ? (bi + 1) * m->block : m->h;
+		downsample(m, luma, linesize, step, bi * m->block, row1);
+		if(!m->nframes)
+		{
+			for(i = bi * m->block * m->stride; i < row1 * m->stride; i++)
+				m->bg[i] = m->cur[i] << MOTION_FRACBITS;
+			continue;
+		}
+		for(bj = 0; bj < m->bw; bj++)
+		{
+			int bx = bj * m->block, bwidth = m->w - bx < m->block ? m->w - bx : m->block;
+			int npixels = bwidth * (row1 - bi * m->block);
+
+			changed = 0;
+			for(i = bi * m->block; i < row1; i++)
+				changed += motionrow(m->cur + i * m->stride + bx, m->bg + i * m->stride + bx,
+					m->block, m->sensitivity, m->shift);
+			m->map[bi * m->bw + bj] = (changed * 100 + npixels / 2) / npixels;
+			if(changed && m->map[bi * m->bw + bj] >= m->block_percent)
+				active++;
+		}
+		if(maxactive > 0 && active >= maxactive)
+			break;
+	}
+	m->nframes++;
+	return active;
+}
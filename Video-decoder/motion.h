@@ -0,0 +1,40 @@
+#ifndef _MOTION_H_INCLUDED_
+#define _MOTION_H_INCLUDED_
+
+#include <stdint.h>
+
+#define MOTION_FRACBITS 7	// Fractional bits of the background
+
+// Block-grid motion detector working on the luma plane
+typedef struct {
+	int width, height;	// Size of the luma plane
+	int scale;	// The luma is averaged on scale x scale squares, 1, 2 or 4
+	int block;	// Side of the blocks in downsampled pixels, multiple of 16
+	int sensitivity;	// A pixel changed if it differs from the background more than this
+	int block_percent;	// Percentage of changed pixels that makes a block active
+	int shift;	// Every frame the background moves by 1/2^shift of the difference
+	int w, h;	// Size of the downsampled image
+	int bw, bh;	// Size of the grid
+	int stride;	// bw * block, rows of cur and bg are padded to it
+	uint8_t *cur;	// Downsampled luma, the padding is always 0
+	int16_t *bg;	// Background with MOTION_FRACBITS fractional bits
+	uint8_t *map;	// Percentage of changed pixels of every block
+	int nframes;	// Frames processed since the background was reset
+} MOTIONDET;
+
+// Allocate the buffers of a detector whose parameters from width to shift are set;
+// returns 0 if ok, -1 if out of memory
+int motion_init(MOTIONDET *m);
+void motion_free(MOTIONDET *m);
+
+/* Compare the luma plane (step is the distance between two pixels, 2 for YUYV) with the
+ * background block by block and update it; the first frame only sets the background;
+ * the scan stops when maxactive blocks are active, if maxactive > 0, and the map of the
+ * blocks not scanned is 0; returns the number of active blocks
+ */
+int motion_detect(MOTIONDET *m, const uint8_t *luma, int linesize, int step, int maxactive);
+
+// Select the SIMD implementation if simd is not 0 and return its name as yuvrow_select
+const char *motion_select(int simd);
+
+#endif
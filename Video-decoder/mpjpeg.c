@@ -4,9 +4,8 @@
 
 #define _GNU_SOURCE
 
-#include <luaT.h>
-#include <TH/TH.h>
-
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -20,17 +19,36 @@
 #include <ctype.h>
 
 #define RECV_TIMEOUT 600
+#define RECVBUF_INITSIZE 262144
+#define RECVBUF_PADDING 64	// Readable bytes after the end of the buffer, as required by the decoder
+#define MAXHEADER 16384	// Header lines longer than this are garbage
+
+enum {MP_HEADER, MP_BODY};
 
-static char *recvbuf;	// What received from the server
-static int c_sk;		// Client socket used to connect to the server
+typedef struct {
+	char *recvbuf;	// Receive buffer, reused for all the parts
+	int bufsize;	// Size of recvbuf without the padding
+	int start, end;	// recvbuf[start..end) has been received and not consumed yet
+	int state;	// MP_HEADER: looking for the end of the header, MP_BODY: receiving the content
+	int scan;	// Offset from start where the search of the end of the header or of the boundary resumes
+	int hdrlen;	// Length of the header of the current part, including the empty line
+	int contentlength;	// Length of the current part, -1 if it ends at the boundary
+	long timestamp;	// X-Timestamp of the current part
+	int isjpeg;	// The Content-Type of the current part is image/jpeg
+	char boundary[84];	// "\r\n--" followed by the boundary of the HTTP header, empty if not known
+	int c_sk;		// Client socket used to connect to the server
+} MPJPEG;
 
-int mpjpeg_disconnect()
+// Close the connection and free the handle returned by mpjpeg_connect
+int mpjpeg_disconnect(void *mpjpeg)
 {
-	if(c_sk)
-	{
-		close(c_sk);
-		c_sk = 0;
-	}
+	MPJPEG *m = (MPJPEG *)mpjpeg;
+
+	if(m->c_sk)
+		close(m->c_sk);
+	if(m->recvbuf)
+		free(m->recvbuf);
+	free(m);
 	return 0;
 }
 
@@ -49,45 +67,65 @@ static int recvtmout(int sk, int timeout, char *buf, int bufsize)
 	return recv(sk, (char *)buf, bufsize, 0);
 }
 
-// Receives a HTTP header + content from sk, waits at most timeout, content length (without header) is saved in rlen
-static char *httprecv(int sk, int timeout, int *rlen)
+// Receive as much as it fits after the end of the received data, waiting at most timeout seconds;
+// only called before the part is returned, so the consumed data can be discarded to make space;
+// the buffer is enlarged when it's full, this happens only until it fits the largest part
+static int recvmore(MPJPEG *m, int timeout)
 {
-	int bufsize = 3900;
-	char *buf = (char *)malloc(bufsize);
-	char *p, *q;
-	int pcontent, len = 0;
-	int rc, contentlength = 0;
-	
-	bufsize--;
-	*buf = 0;
-	while(len < bufsize)
+	int rc;
+
+	if(m->end == m->bufsize && m->start)
 	{
-		rc = recvtmout(sk, timeout, buf + len, contentlength ? bufsize - len : 1);
-		if(rc <= 0)
-		{
-			free(buf);
-			return 0;
-		}
-		len += rc;
-		buf[len] = 0;
-		p = strstr(buf, "\r\n\r\n");
-		if(p)
+		memmove(m->recvbuf, m->recvbuf + m->start, m->end - m->start);
+		m->end -= m->start;
+		m->start = 0;
+	}
+	if(m->end == m->bufsize)
+	{
+		char *p = (char *)realloc(m->recvbuf, m->bufsize * 2 + RECVBUF_PADDING);
+
+		if(!p)
+			return -1;
+		m->recvbuf = p;
+		m->bufsize *= 2;
+	}
+	rc = recvtmout(m->c_sk, timeout, m->recvbuf + m->end, m->bufsize - m->end);
+	if(rc > 0)
+		m->end += rc;
+	return rc;
+}
+
+// Parse the header of length len at hdr
+static void parseheader(MPJPEG *m, char *hdr, int len)
+{
+	char *p, *q, save = hdr[len];
+	int n;
+
+	// Only the header is searched
+	hdr[len] = 0;
+	m->contentlength = -1;
+	p = strcasestr(hdr, "\r\nContent-Length:");
+	if(p)
+		m->contentlength = atoi(p + 17);
+	m->isjpeg = strcasestr(hdr, "image/jpeg") != 0;
+	p = strcasestr(hdr, "X-Timestamp:");
+	m->timestamp = p ? strtoul(p + 12, 0, 10) : 0;
+	// The HTTP header gives the boundary of the parts
+	if(!m->boundary[0] && (p = strcasestr(hdr, "boundary=")))
+	{
+		p += 9;
+		if(*p == '"')
+			p++;
+		for(q = p; *q && *q != '"' && *q != ';' && *q != '\r' && q - p < (int)sizeof(m->boundary) - 5; q++);
+		n = q - p;
+		if(n > 0)
 		{
-			pcontent = p + 4 - buf;
-			if(!contentlength)
-			{
-				q = strcasestr(buf, "\r\nContent-Length:");
-				if(q)
-					contentlength = atoi(q + 17);
-				bufsize = pcontent + contentlength;
-				buf = (char *)realloc(buf, bufsize+1);
-			}
-			if(!contentlength)
-				break;
+			memcpy(m->boundary, "\r\n--", 4);
+			memcpy(m->boundary + 4, p, n);
+			m->boundary[n + 4] = 0;
 		}
 	}
-	*rlen = len;
-	return buf;
+	hdr[len] = save;
 }
 
 // Resolve address and convert it to a sockaddr_in structure, complete with port
@@ -128,15 +166,16 @@ int Resolve(const char *address, struct sockaddr_in *addr, int defaultport)
 	}
 }
 
-int mpjpeg_connect(const char *url)
+// Connect to the server and return a handle to be used with the other functions;
+// in case of error, return 0 and put the error code in rc
+void *mpjpeg_connect(const char *url, int *rc)
 {
 	char *host, *sendbuf;	// allocated, to be freed before returning
 	char *remotefn;
-	int rc;
+	int c_sk;
 	struct sockaddr_in addr;
+	MPJPEG *m;
 	
-	if(c_sk)
-		mpjpeg_disconnect();
 	if(!memcmp(url, "http://", 7))
 		url += 7;
 
@@ -153,69 +192,130 @@ int mpjpeg_connect(const char *url)
 	if(!Resolve(host, &addr, 80))
 	{
 		free(host);
-		return -1;
+		*rc = -1;
+		return 0;
 	}
 	if((c_sk = socket(AF_INET, SOCK_STREAM, 0)) < 0)
 	{
 		free(host);
-		return -2;
+		*rc = -2;
+		return 0;
 	}
 	if(connect(c_sk, (struct sockaddr *)&addr, sizeof(addr)) < 0)
 	{
 		free(host);
 		close(c_sk);
-		c_sk = 0;
-		return -3;
+		*rc = -3;
+		return 0;
 	}
 	sendbuf = (char *)malloc(300 + strlen(remotefn) + strlen(host));
 	sprintf(sendbuf, "GET %s HTTP/1.1\r\n"
 		"User-agent: MPJPG library\r\n"
 		"Host: %s\r\n"
 		"\r\n", remotefn, host);
-	rc = send(c_sk, sendbuf, strlen(sendbuf), 0);
+	*rc = send(c_sk, sendbuf, strlen(sendbuf), 0);
 	free(host);
-	if(rc != strlen(sendbuf))
+	if(*rc != strlen(sendbuf))
 	{
 		free(sendbuf);
-		return -4;
+		close(c_sk);
+		*rc = -4;
+		return 0;
 	}
 	free(sendbuf);
-	return 0;
+	m = (MPJPEG *)calloc(1, sizeof(MPJPEG));
+	m->recvbuf = (char *)malloc(RECVBUF_INITSIZE + RECVBUF_PADDING);
+	if(!m->recvbuf)
+	{
+		free(m);
+		close(c_sk);
+		*rc = -2;
+		return 0;
+	}
+	m->bufsize = RECVBUF_INITSIZE;
+	m->c_sk = c_sk;
+	*rc = 0;
+	return m;
 }
 
-int mpjpeg_getdata(char **data, unsigned *datalen, char *filename, int filename_size)
+// Get the next JPEG image; data points to the receive buffer and it's valid until the next call
+int mpjpeg_getdata(void *mpjpeg, char **data, unsigned *datalen, char *filename, int filename_size)
 {
-	int recvlen, retry;
-	char *p, *q;
-	long timestamp;
+	MPJPEG *m = (MPJPEG *)mpjpeg;
+	int retry = 0, avail, len, blen;
+	char *s, *p;
 
-	if(!c_sk)
+	if(!m->c_sk)
 		return -5;
-	if(recvbuf)
-		free(recvbuf);
-	for(retry = 0; retry < 5; retry++)
+	// The part returned by the previous call is not needed anymore, move what follows it at the beginning
+	if(m->start)
 	{
-		recvbuf = httprecv(c_sk, RECV_TIMEOUT, &recvlen);
-		if(!recvbuf)
-			break;
-		if(recvlen > 0 && (p = strcasestr(recvbuf, "Content-Length:")) &&
-
-			(q = strstr(p, "\r\n\r\n")) )
+		memmove(m->recvbuf, m->recvbuf + m->start, m->end - m->start);
+		m->end -= m->start;
+		m->start = 0;
+	}
+	while(retry < 5)
+	{
+		s = m->recvbuf + m->start;
+		avail = m->end - m->start;
+		if(m->state == MP_HEADER)
+		{
+			p = memmem(s + m->scan, avail - m->scan, "\r\n\r\n", 4);
+			if(!p)
+			{
+				// Continue from here when more data arrives
+				m->scan = avail > 3 ? avail - 3 : 0;
+				if(avail > MAXHEADER || recvmore(m, RECV_TIMEOUT) <= 0)
+					return -6;
+				continue;
+			}
+			m->hdrlen = p + 4 - s;
+			parseheader(m, s, m->hdrlen);
+			m->scan = 0;
+			if(m->contentlength >= 0 || (m->boundary[0] && m->isjpeg))
+				m->state = MP_BODY;
+			else {
+				// Not an image (for example the HTTP header), skip it
+				m->start += m->hdrlen;
+				retry++;
+			}
+			continue;
+		}
+		// Receive the content, up to Content-Length or to the boundary
+		if(m->contentlength >= 0)
 		{
-			q += 4;
-			*data = q;
-			*datalen = recvlen - (q - recvbuf);
-			p = strcasestr(recvbuf, "X-Timestamp:");
-			timestamp = p ? strtoul(p+12, 0, 10) : 0;
-			if(!timestamp)
+			if(avail - m->hdrlen < m->contentlength)
 			{
-				struct timeval tv;
-				gettimeofday(&tv, 0);
-				timestamp = tv.tv_sec * 1000L + tv.tv_usec / 1000;
+				if(recvmore(m, RECV_TIMEOUT) <= 0)
+					return -6;
+				continue;
 			}
-			snprintf(filename, filename_size, "%ld", timestamp);
-			return 0;
+			len = m->contentlength;
+		} else {
+			blen = strlen(m->boundary);
+			p = memmem(s + m->hdrlen + m->scan, avail - m->hdrlen - m->scan, m->boundary, blen);
+			if(!p)
+			{
+				m->scan = avail - m->hdrlen >= blen ? avail - m->hdrlen - blen + 1 : 0;
+				if(recvmore(m, RECV_TIMEOUT) <= 0)
+					return -6;
+				continue;
+			}
+			len = p - (s + m->hdrlen);
 		}
+		*data = s + m->hdrlen;
+		*datalen = len;
+		m->start += m->hdrlen + len;
+		m->state = MP_HEADER;
+		m->scan = 0;
+		if(!m->timestamp)
+		{
+			struct timeval tv;
+			gettimeofday(&tv, 0);
+			m->timestamp = tv.tv_sec * 1000L + tv.tv_usec / 1000;
+		}
+		snprintf(filename, filename_size, "%ld", m->timestamp);
+		return 0;
 	}
 	return -6;
 }
@@ -340,3 +440,217 @@ int jpeg_create_buf_422(unsigned char **dest, unsigned long *destsize, void *buf
 	jpeg_destroy_compress(&cinfo);
 	return 0;
 }
+
+// Encode a planar YUV image whose chroma planes are subsampled horizontally and,
+// if chroma_vshift is 1, vertically (4:2:0, otherwise 4:2:2); the planes are given
+// to libjpeg directly with their strides, the rows after the last one repeat it
+int jpeg_create_buf_planes(unsigned char **dest, unsigned long *destsize, const unsigned char *const planes[3],
+	const int strides[3], int width, int height, int chroma_vshift, int quality)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned char *ptr1[48];
+	unsigned char **ptr[3] = {ptr1, ptr1+16, ptr1+32};
+	int i, j, r, crows = 16 >> chroma_vshift, cheight = (height + chroma_vshift) >> chroma_vshift;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	cinfo.in_color_space = JCS_YCbCr;
+	cinfo.input_components = 3;
+	cinfo.data_precision = 8;
+	cinfo.image_width = (JDIMENSION)width;
+	cinfo.image_height = (JDIMENSION)height;
+	jpeg_set_defaults(&cinfo);
+	jpeg_default_colorspace(&cinfo);
+	jpeg_set_quality(&cinfo, quality, 75);
+	jpeg_mem_dest(&cinfo, dest, destsize);
+	cinfo.raw_data_in = TRUE;
+	cinfo.do_fancy_downsampling = FALSE;
+	if(!chroma_vshift)
+		cinfo.comp_info[1].v_samp_factor = cinfo.comp_info[2].v_samp_factor = 2;
+	jpeg_start_compress(&cinfo, TRUE);
+	for(i = 0; i < height; i += 16)
+	{
+		for(j = 0; j < 16; j++)
+		{
+			r = i + j < height ? i + j : height - 1;
+			ptr[0][j] = (unsigned char *)planes[0] + strides[0] * r;
+		}
+		for(j = 0; j < crows; j++)
+		{
+			r = (i >> chroma_vshift) + j < cheight ? (i >> chroma_vshift) + j : cheight - 1;
+			ptr[1][j] = (unsigned char *)planes[1] + strides[1] * r;
+			ptr[2][j] = (unsigned char *)planes[2] + strides[2] * r;
+		}
+		jpeg_write_raw_data(&cinfo, ptr, 16);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	return 0;
+}
+
+// Encode a YUYV image as 4:2:2, splitting it in planes 16 rows at a time
+int jpeg_create_buf_yuyv(unsigned char **dest, unsigned long *destsize, const void *buf, int width, int height, int quality)
+{
+	const unsigned char *yuyv = (const unsigned char *)buf;
+	unsigned char *strip = (unsigned char *)malloc(16 * width * 2);
+	const unsigned char *planes[3];
+	int strides[3] = {width, width / 2, width / 2};
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned char *ptr1[48];
+	unsigned char **ptr[3] = {ptr1, ptr1+16, ptr1+32};
+	int i, j, k, r;
+
+	if(!strip)
+		return -1;
+	planes[0] = strip;
+	planes[1] = strip + 16 * width;
+	planes[2] = strip + 16 * width * 3 / 2;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	cinfo.in_color_space = JCS_YCbCr;
+	cinfo.input_components = 3;
+	cinfo.data_precision = 8;
+	cinfo.image_width = (JDIMENSION)width;
+	cinfo.image_height = (JDIMENSION)height;
+	jpeg_set_defaults(&cinfo);
+	jpeg_default_colorspace(&cinfo);
+	jpeg_set_quality(&cinfo, quality, 75);
+	jpeg_mem_dest(&cinfo, dest, destsize);
+	cinfo.raw_data_in = TRUE;
+	cinfo.do_fancy_downsampling = FALSE;
+	cinfo.comp_info[1].v_samp_factor = cinfo.comp_info[2].v_samp_factor = 2;
+	jpeg_start_compress(&cinfo, TRUE);
+	for(i = 0; i < height; i += 16)
+	{
+		for(j = 0; j < 16; j++)
+		{
+			const unsigned char *from;
+
+			r = i + j < height ? i + j : height - 1;
+			from = yuyv + 2 * width * r;
+			for(k = 0; k < width / 2; k++)
+			{
+				strip[j * width + 2*k] = from[4*k];
+				strip[j * width + 2*k + 1] = from[4*k + 2];
+				strip[16 * width + j * strides[1] + k] = from[4*k + 1];
+				strip[16 * width * 3 / 2 + j * strides[2] + k] = from[4*k + 3];
+			}
+			ptr[0][j] = (unsigned char *)planes[0] + strides[0] * j;
+			ptr[1][j] = (unsigned char *)planes[1] + strides[1] * j;
+			ptr[2][j] = (unsigned char *)planes[2] + strides[2] * j;
+		}
+		jpeg_write_raw_data(&cinfo, ptr, 16);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	free(strip);
+	return 0;
+}
+
+struct decoder_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf jb;
+};
+
+// Corrupt images are reported by the caller, which falls back to libavcodec
+static void decoder_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((struct decoder_error *)cinfo->err)->jb, 1);
+}
+
+static void decoder_output_message(j_common_ptr cinfo)
+{
+}
+
+// Decode the JPEG in buf reduced by 1/denom (1, 2, 4 or 8) with the libjpeg DCT scaling,
+// which only computes the lowest frequencies of every block, to yuv420p planes of
+// width x height (rounded up), returned in *width and *height; if planes is 0, only the
+// size is returned; the chroma is averaged on 2x2 blocks, repeating the last row and column
+int jpeg_decode_scaled(const void *buf, unsigned len, int denom, unsigned char *const planes[3],
+	const int strides[3], int *width, int *height)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct decoder_error jerr;
+	unsigned char *volatile rows = 0;
+	JSAMPROW row[2];
+	int i, j, w, h, cw, x1, ncomp;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = decoder_error_exit;
+	jerr.pub.output_message = decoder_output_message;
+	jpeg_create_decompress(&cinfo);
+	if(setjmp(jerr.jb))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		free(rows);
+		return -1;
+	}
+	jpeg_mem_src(&cinfo, (unsigned char *)buf, len);
+	jpeg_read_header(&cinfo, TRUE);
+	if(cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE)
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return -2;
+	}
+	ncomp = cinfo.jpeg_color_space == JCS_YCbCr ? 3 : 1;
+	cinfo.out_color_space = cinfo.jpeg_color_space;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denom;
+	jpeg_calc_output_dimensions(&cinfo);
+	*width = w = cinfo.output_width;
+	*height = h = cinfo.output_height;
+	if(!planes)
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return 0;
+	}
+	rows = (unsigned char *)malloc(2 * w * ncomp);
+	if(!rows)
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return -3;
+	}
+	row[0] = rows;
+	row[1] = rows + w * ncomp;
+	cw = (w + 1) / 2;
+	jpeg_start_decompress(&cinfo);
+	for(i = 0; i < h; i += 2)
+	{
+		unsigned char *y0 = planes[0] + strides[0] * i;
+		unsigned char *y1 = y0 + strides[0];
+		unsigned char *u = planes[1] + strides[1] * (i / 2);
+		unsigned char *v = planes[2] + strides[2] * (i / 2);
+
+		jpeg_read_scanlines(&cinfo, row, 1);
+		if(i + 1 < h)
+			jpeg_read_scanlines(&cinfo, row + 1, 1);
+		else memcpy(row[1], row[0], w * ncomp);
+		if(ncomp == 1)
+		{
+			memcpy(y0, row[0], w);
+			if(i + 1 < h)
+				memcpy(y1, row[1], w);
+			memset(u, 128, cw);
+			memset(v, 128, cw);
+			continue;
+		}
+		for(j = 0; j < w; j++)
+		{
+			y0[j] = row[0][3*j];
+			if(i + 1 < h)
+				y1[j] = row[1][3*j];
+		}
+		for(j = 0; j < cw; j++)
+		{
+			x1 = 2*j + 1 < w ? 2*j + 1 : 2*j;
+			u[j] = (row[0][6*j+1] + row[0][3*x1+1] + row[1][6*j+1] + row[1][3*x1+1] + 2) >> 2;
+			v[j] = (row[0][6*j+2] + row[0][3*x1+2] + row[1][6*j+2] + row[1][3*x1+2] + 2) >> 2;
+		}
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(rows);
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * File:
+ *  stats.c
+ *
+ * Description:
+ *  Log-linear latency histograms for the per-stage statistics of video_decoder.c:
+ *  values below STATS_SUBBUCKETS have their own bucket, then every power of 2 is
+ *  split in STATS_SUBBUCKETS buckets, so that recording a sample is a few
+ *  instructions and three relaxed atomic additions
+ */
+
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+uint64_t stats_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bucket_index(uint64_t v)
+{
+	int e, i;
+
+	if(v < STATS_SUBBUCKETS)
+		return (int)v;
+	e = 63 - __builtin_clzll(v);	// 3 or more
+	i = (e - 2) * STATS_SUBBUCKETS + (int)((v >> (e - 3)) & (STATS_SUBBUCKETS - 1));
+	return i < STATS_NBUCKETS ? i : STATS_NBUCKETS - 1;
+}
+
+// Values from *lo to *hi (excluded) go in bucket i
+static void bucket_range(int i, double *lo, double *hi)
+{
+	int e, m;
+
+	if(i < STATS_SUBBUCKETS)
+	{
+		*lo = i;
+		*hi = i + 1;
+		return;
+	}
+	e = i / STATS_SUBBUCKETS + 2;
+	m = i % STATS_SUBBUCKETS;
+	*lo = (double)((uint64_t)(STATS_SUBBUCKETS + m) << (e - 3));
+	*hi = (double)((uint64_t)(STATS_SUBBUCKETS + m + 1) << (e - 3));
+}
+
+void stats_record(STATHIST *h, uint64_t us)
+{
+	uint64_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&h->bucket[bucket_index(us)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->total_us, us, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	while(us > max && !__atomic_compare_exchange_n(&h->max_us, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Value below which there is the fraction q of the n samples of bucket
+static double percentile(const uint32_t *bucket, uint64_t n, double q, double max)
+{
+	double target = q * n, lo, hi, v;
+	uint64_t seen = 0;
+	int i;
+
+	for(i = 0; i < STATS_NBUCKETS; i++)
+	{
+		if(!bucket[i] || seen + bucket[i] < target)
+		{
+			seen += bucket[i];
+			continue;
+		}
+		bucket_range(i, &lo, &hi);
+		v = lo + (hi - lo) * (target - seen) / bucket[i];
+		return v < max ? v : max;
+	}
+	return max;
+}
+
+void stats_summary(const STATHIST *h, STATSUMMARY *s)
+{
+	uint32_t bucket[STATS_NBUCKETS];
+	uint64_t n = 0;
+	int i;
+
+	// Take a copy, so that the percentiles are consistent even if other threads are recording
+	for(i = 0; i < STATS_NBUCKETS; i++)
+	{
+		bucket[i] = __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+		n += bucket[i];
+	}
+	memset(s, 0, sizeof(*s));
+	s->count = n;
+	if(!n)
+		return;
+	s->max_us = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+	s->avg_us = (double)__atomic_load_n(&h->total_us, __ATOMIC_RELAXED) / __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	s->p50_us = percentile(bucket, n, 0.50, s->max_us);
+	s->p95_us = percentile(bucket, n, 0.95, s->max_us);
+	s->p99_us = percentile(bucket, n, 0.99, s->max_us);
+}
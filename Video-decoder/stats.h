@@ -0,0 +1,30 @@
+#ifndef _STATS_H_INCLUDED_
+#define _STATS_H_INCLUDED_
+
+#include <stdint.h>
+
+#define STATS_SUBBUCKETS 8	// Buckets for every power of 2, the error is at most 1/8
+#define STATS_NBUCKETS 200	// Up to 2^26 us (67 s), longer times go in the last bucket
+
+// Latency histogram in microseconds; any thread can record in it, the updates are
+// relaxed atomics, so a reader can see a sample counted in count but not yet in bucket
+typedef struct {
+	uint64_t count, total_us, max_us;
+	uint32_t bucket[STATS_NBUCKETS];
+} STATHIST;
+
+typedef struct {
+	uint64_t count;
+	double avg_us, p50_us, p95_us, p99_us, max_us;
+} STATSUMMARY;
+
+// Monotonic clock in microseconds
+uint64_t stats_now_us(void);
+
+// Add a sample of us microseconds
+void stats_record(STATHIST *h, uint64_t us);
+
+// Count, average, percentiles (interpolated inside the bucket) and maximum of the histogram
+void stats_summary(const STATHIST *h, STATSUMMARY *s);
+
+#endif
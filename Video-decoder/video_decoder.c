@@ -21,15 +21,27 @@
 #include <libswscale/swscale.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#ifdef DARWIN
+#include <poll.h>
+#else
+#include <sys/epoll.h>
+#endif
 #ifdef DOVIDEOCAP
 #include "videocap.h"
 #include "videocodec.h"
 #endif
+#include "yuvrgb.h"
+#include "yuvlut.h"
+#include "motion.h"
+#include "stats.h"
 
 #ifdef NEWFFMPEG
 #define avcodec_alloc_frame() av_frame_alloc()
@@ -38,225 +50,793 @@
 #define av_free_packet(a) av_packet_unref(a)
 #endif
 
-#define BYTE2FLOAT 0.003921568f // 1/255
-
 // Defined in mpjpeg.c
-int mpjpeg_disconnect();
-int mpjpeg_connect(const char *url);
-int mpjpeg_getdata(char **data, unsigned *datalen, char *filename, int filename_size);
+void *mpjpeg_connect(const char *url, int *rc);
+int mpjpeg_disconnect(void *mpjpeg);
+int mpjpeg_getdata(void *mpjpeg, char **data, unsigned *datalen, char *filename, int filename_size);
 int jpeg_create(const char *path, void *buf, int width, int height, int quality);
 int jpeg_create_buf(unsigned char **dest, unsigned long *destsize, void *buf, int width, int height, int quality);
 int jpeg_create_buf_422(unsigned char **dest, unsigned long *destsize, void *buf, int width, int height, int quality);
+int jpeg_create_buf_planes(unsigned char **dest, unsigned long *destsize, const unsigned char *const planes[3],
+	const int strides[3], int width, int height, int chroma_vshift, int quality);
+int jpeg_create_buf_yuyv(unsigned char **dest, unsigned long *destsize, const void *buf, int width, int height, int quality);
+int jpeg_decode_scaled(const void *buf, unsigned len, int denom, unsigned char *const planes[3],
+	const int strides[3], int *width, int *height);
 
-
-/* video decoder on DMA memory */
 int loglevel = 0;
-static int stream_idx;
-static AVFormatContext *pFormatCtx;
-static AVFormatContext *ofmt_ctx;
-static AVCodecContext *pCodecCtx;
-static AVFrame *pFrame_yuv;
-static int nbuffered_frames;
-static AVFrame *pFrame_intm;
-static struct SwsContext *sws_ctx;
-static uint8_t *sws_rgb;
-static uint8_t *lastframe_raw, *jpeg_buf;
-static unsigned long jpeg_size;
-static int sws_w, sws_h;
-static int stream_ended;	// Flag to indicate that we reached the end of the file
-static char destfile[500], *destext, destformat[100];
-static pthread_t rx_tid;
-static int rx_active, frame_decoded;
-static pthread_mutex_t readmutex = PTHREAD_MUTEX_INITIALIZER;
-static int fragmentsize_seconds;
-static int reencode_stream;
-static uint64_t start_dts;
-static int64_t fragmentsize;
-static short audiobuf[16384];
-static int audiobuflen;
-static int savenow_seconds_before, savenow_seconds_after;
-static char savenow_path[300];
-#define RXFIFOQUEUESIZE 1000
-static AVPacket rxfifo[RXFIFOQUEUESIZE];
-static int rxfifo_tail, rxfifo_head;
-static int frame_width, frame_height, vcap_fps;
-// Encoder variables
-static struct {
-	int width, height, fps;
-	AVFormatContext *fmt_ctx;
-	struct SwsContext *sws_ctx;
-	uint8_t *sws_rgb;
-	AVFrame *pFrame_yuv;
-	AVPacket pkt;
-	int curframe;
-} enc;
-// End encoder variables
+enum {DECODE_ALL, DECODE_NONREF, DECODE_KEYFRAMES, DECODE_EVERYNTH};
+enum {MUX_BLOCK, MUX_DROPNONKEY, MUX_DROPGOP};
+#define MAXTHREADS 64
 #ifdef DOVIDEOCAP
-static void *vcap, *vcodec, *vcap_frame, *vcodec_extradata;
-static int vcodec_writeextradata, vcodec_extradata_size, vcap_nframes;
 const int vcodec_gopsize = 12;
 #endif
 
+// Immutable JPEG frame of the JPEG server with its multipart header, shared
+// by the clients and freed when the last reference is released
+typedef struct {
+	int refs;
+	unsigned seq;	// Sequence number given by the JPEG server
+	unsigned len, hdrlen;	// Total length and length of the multipart header before the JPEG
+	unsigned long frameseq;	// Sequence number of the received frame, 0 if unknown
+	char data[];
+} JPEGFRAME;
+
+// Packet stored in the pre-roll buffer
+typedef struct {
+	long offset;	// Data offset in the arena
+	int size, stream_index, flags, duration;
+	int64_t dts, pts;
+	int64_t t;	// dts in the video stream time base
+} PREROLLPKT;
+
+// Frame queued by encoderwrite, copied from the tensor as contiguous planes
+typedef struct {
+	void *data;
+	long size;	// Allocated bytes
+	int isfloat;	// data is float, otherwise byte
+} ENCFRAME;
+
+// Stages timed by the statistics returned by stats
+enum { ST_DEMUX, ST_DECODE, ST_CONVERT, ST_RESCALE, ST_JPEGENC, ST_MUXWRITE, ST_ENCODE, ST_N };
+static const char *const stage_names[ST_N] = {"demux", "decode", "convert", "rescale", "jpeg_encode", "mux_write", "encode"};
+
+/* Every decoder instance has its own state, so that more streams can be
+ * decoded at the same time from the same Lua process
+ */
+typedef struct {
+	/* video decoder on DMA memory */
+	int stream_idx;
+	AVFormatContext *pFormatCtx;
+	AVFormatContext *ofmt_ctx;
+	AVCodecContext *pCodecCtx;
+	AVFrame *pFrame_yuv;
+	AVFrame **batchframes;	// Refcounted frames kept by frame_batch_resized, reused across calls
+	int nbatchframes;	// Number of allocated batchframes
+	int nbuffered_frames;	// Number of valid batchframes
+	AVFrame *pFrame_intm;
+	// One rescaler for every worker thread, [0] is used by the calling thread
+	struct SwsContext *sws_ctx[MAXTHREADS];
+	uint8_t *sws_rgb[MAXTHREADS];
+	uint8_t *lastframe_raw;
+	long lastframe_seq;	// Incremented every time lastframe_raw is written
+	unsigned long lastframe_rxseq;	// Sequence number of the received frame in lastframe_raw, 0 if none
+	JPEGFRAME *jpeglua;	// JPEG of lastframe_raw for frame_jpeg and save_jpeg
+	MOTIONDET motion;	// Motion detector of the motion function
+	long jpeglua_seq;	// lastframe_seq of jpeglua
+	int sws_w, sws_h;
+	enum AVPixelFormat sws_fmt;	// RGB24 for float tensors, GBRP to write byte tensors directly
+	// Sample offsets and weights of frame_resized_normalized, kept while the sizes don't change
+	struct {
+		int *x;	// x0, x1, cx0 and cx1 of struct normjob
+		float *f;	// fx and cfx
+		int srcw, cw, dstw, step, cstep;
+	} normtab;
+	int stream_ended;	// Flag to indicate that we reached the end of the file
+	int read_error;	// Error returned by av_read_frame, if it was not the end of the file
+	// Decoding thread started by init with the prefetch option
+	struct {
+		int size;	// Number of frames of the ring, 0 if prefetch is not enabled
+		AVFrame **ring;
+		int head, count;
+		int status;	// 0=decoding, 1=end of stream, <0=libav error
+		int active;
+		pthread_t tid;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;	// Signals both a new frame and a free slot
+	} prefetch;
+	// PTS index of the video stream, built or loaded by init with the index option
+	struct {
+		int64_t *pts;	// PTS of every frame, in presentation order
+		int64_t *keypts;	// PTS of the keyframes, sorted
+		int nframes, nkeys;
+	} index;
+	AVFrame *seekframe;	// Frame reached by seek
+	int seek_pending;	// seekframe has to be returned by the next read
+	// Decode mode set by init
+	int decode_mode;
+	int decode_every;	// N of DECODE_EVERYNTH
+	long decode_count;	// Frames decoded in DECODE_EVERYNTH mode, when there is no index
+	int64_t decode_nextpts;	// Next frame to get by seeking to a keyframe in DECODE_EVERYNTH mode
+	char destfile[500], *destext, destformat[100];
+	pthread_t rx_tid;
+	int rx_active, frame_decoded;
+	int rx_running;	// The receiving thread has not ended yet
+	pthread_mutex_t readmutex;	// Protects rx_running and the wait on framecond
+	pthread_cond_t framecond;	// Signals a new received frame or the end of the receiving thread
+	unsigned long frame_seq;	// Sequence number of the last received frame, 0 if none
+	unsigned long returned_seq;	// Sequence number of the last frame returned to Lua
+	// Latest frame triple buffer between the receiving thread and the consumer: the thread
+	// fills slot back and exchanges it with middle, the consumer exchanges front with middle
+	struct {
+		AVFrame *frame[3];	// libav frames
+		char *vcap[3];	// YUYV frames of the capture device, in vcap_frame
+		unsigned long seq[3];	// Sequence number of the frame in every slot, 0 if empty
+		int back, front;	// Owned by the receiving thread and by the consumer
+		int middle;	// Slot | TB_FRESH if it was not taken yet, only changed atomically
+		int nwaiters;	// Consumers waiting on framecond
+	} tb;
+	int fragmentsize_seconds;
+	int reencode_stream;
+	uint64_t start_dts;
+	int64_t fragmentsize;
+	short audiobuf[16384];
+	int audiobuflen;
+	int savenow_seconds_before, savenow_seconds_after;
+	char savenow_path[300];
+	// Pre-roll buffer of the received packets for savenow
+	struct {
+		uint8_t *arena;	// Packet data
+		long arenasize, wpos;	// wpos is where the data of the last packet ends
+		PREROLLPKT *pkts;	// Packet n is pkts[n % cap]
+		int64_t *keys;	// Packet numbers of the video keyframes, keyframe k is keys[k % cap]
+		int cap;
+		int64_t first, next;	// Packet numbers of the oldest and of the next packet
+		int64_t kfirst, knext;	// Same for keyframes
+		int64_t maxdur;	// Maximum duration in video stream time base units
+	} preroll;
+	// Muxing thread and its queue of received packets
+	struct {
+		pthread_t tid;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;	// Signals a change of the queue
+		AVPacket *pkts;	// Ring of size packets, n of them starting at head
+		int size, head, n;
+		int overflow;	// What to do when the queue is full, MUX_BLOCK, MUX_DROPNONKEY or MUX_DROPGOP
+		int skip_to_key;	// Drop the video packets up to the next keyframe
+		int eos;	// The receiving thread has ended
+		int64_t t;	// Last dts in the video stream time base
+		// Statistics
+		int max_n;
+		long dropped, written;
+		double write_ms_last, write_ms_max, write_ms_total;
+	} mux;
+	int frame_width, frame_height, vcap_fps;
+	enum AVPixelFormat frame_fmt;	// Source of the rescalers and lastframe_raw, pCodecCtx belongs to libavcodec
+	// Encoder variables
+	struct {
+		int width, height, fps;
+		AVFormatContext *fmt_ctx;
+		AVFrame *pFrame_yuv;
+		AVPacket pkt;
+		int curframe;
+		// Queue of the frames to encode and the thread that encodes them
+		pthread_t tid;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;	// Signals a change of the queue
+		ENCFRAME *queue;	// Ring of depth frames, n of them starting at head
+		int depth, head, n;
+		int stop;	// Exit when the queue is empty
+	} enc;
+	// End encoder variables
+#ifdef DOVIDEOCAP
+	void *vcap, *vcodec, *vcap_frame, *vcodec_extradata;
+	const char *vcap_last;	// Last frame returned by frame_*, valid until the next one is got
+	int vcodec_writeextradata, vcodec_extradata_size, vcap_nframes;
+#endif
+	// MPJPEG client (see mpjpeg.c) and the last JPEG received from it
+	void *mpjpeg;
+	struct {
+		char *data;
+		unsigned datalen;
+		char filename[101];
+		int dctscale;	// Decode at reduced scale with libjpeg when the tensor is smaller
+		int minw, minh;	// Minimum size of the image to decode, 0 for the full size
+	} jpeg;
+	// JPEG server
+	pthread_mutex_t jpegmutex;	// Protects jpegframe
+	int jpegserver_nclients;	// Only written by the server thread
+	int jpegseq;
+	JPEGFRAME *jpegframe;	// Latest frame for the clients, holding a reference
+	int srvsk, srvpipe[2], srvep, srvstop;
+	pthread_t srv_tid;
+	// JPEG encoder thread of the JPEG server, fed by the receiving thread
+	struct {
+		pthread_t tid;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;	// Signals a frame to encode or stop
+		int busy;	// A frame is being encoded, frame or yuyv cannot be changed
+		int stop;
+		AVFrame *frame;	// Reference to the libav frame to encode
+		char *yuyv;	// or copy of the capture frame
+		unsigned long seq;	// Sequence number of the frame
+		double interval_ms, next_ms;	// Minimum time between two frames and earliest time for the next one
+		int quality;
+		unsigned char *outbuf;	// libjpeg output buffer, reused
+		unsigned long outcap;
+	} jenc;
+	// Per-stage latencies and counters, updated with relaxed atomics by any thread
+	struct {
+		int enabled;	// Time the stages, the counters are always updated
+		uint64_t start_us;	// Time of the creation or of the last reset
+		STATHIST stage[ST_N];
+		unsigned long frames_decoded;
+		unsigned long frames_skipped;	// Received frames replaced by newer ones before being returned
+		unsigned long jpeg_frames, jpeg_skipped;	// Frames sent to the JPEG server and not encoded because it was busy
+		// Thread that appends the statistics to a CSV file every interval seconds
+		pthread_t tid;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;	// Signals stop
+		FILE *csv;
+		double interval;
+		int stop;
+	} stats;
+} VIDEODEC;
+
 /***************************************
 JPEG server stuff
 ***************************************/
 
-static pthread_mutex_t ntm = PTHREAD_MUTEX_INITIALIZER;	// Protects nclients access
-static pthread_rwlock_t rwl = PTHREAD_RWLOCK_INITIALIZER;	// Protects buffers[0] access
-static pthread_mutex_t jpegmutex =  PTHREAD_MUTEX_INITIALIZER;	// Protects buffers[1] access
-static pthread_mutex_t jpegbufmutex =  PTHREAD_MUTEX_INITIALIZER;	// Protects jpeg_buf
-static pthread_cond_t jpegwait = PTHREAD_COND_INITIALIZER;
-
-static int jpegserver_nclients;
-#ifdef DOVIDEOCAP
-static int jpegseq;
-#endif
-static struct {
-	char *data;
-	unsigned datalen;
-	unsigned seq;
-} buffers[2];
-static int srvsk;
-
 #ifdef DARWIN
 #define MSG_NOSIGNAL 0
 #endif
 
-static void *client_thread(void *sk1)
+#define JPEGCLIENT_TIMEOUT 5	// Seconds a client can be stuck before being dropped
+
+static const char *http200 =
+	"HTTP/1.1 200 OK\r\nCache-Control: max-age=0, no-cache, no-store\r\nContent-Type: multipart/x-mixed-replace;boundary=Boundary\r\n\r\n";
+
+struct jpegclient {
+	int sk;
+	int streaming;	// The HTTP request has been received
+	int closed;	// To be removed after the current events have been processed
+	int wantwrite;	// Waiting for the socket to become writable
+	const char *out;	// Data being sent, http200 or frame->data
+	unsigned outlen, outpos;
+	JPEGFRAME *frame;	// Frame being sent, the client holds a reference to it
+	unsigned lastseq;	// Sequence number of the last frame taken
+	time_t lastprogress;
+};
+
+static void jpegframe_unref(JPEGFRAME *f)
 {
-	unsigned lastseq = 0;
-	int sk = (int)(size_t)sk1;
-	char tmp[3000];
+	if(f && !__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL))
+		free(f);
+}
+
+// Get a reference to the latest frame
+static JPEGFRAME *jpegframe_get(VIDEODEC *d)
+{
+	JPEGFRAME *f;
+
+	pthread_mutex_lock(&d->jpegmutex);
+	f = d->jpegframe;
+	if(f)
+		__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&d->jpegmutex);
+	return f;
+}
+
+static void client_setwrite(VIDEODEC *d, struct jpegclient *cl, int on)
+{
+	if(cl->wantwrite == on)
+		return;
+	cl->wantwrite = on;
+#ifndef DARWIN
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+	ev.data.ptr = cl;
+	epoll_ctl(d->srvep, EPOLL_CTL_MOD, cl->sk, &ev);
+#endif
+}
+
+// Send as much as possible without blocking; when the current frame has been sent,
+// continue with the latest one, so that slow clients skip the frames they cannot take
+static void client_send(VIDEODEC *d, struct jpegclient *cl)
+{
+	JPEGFRAME *f;
 	int rc;
-	const char *http200 =
-		"HTTP/1.1 200 OK\r\nCache-Control: max-age=0, no-cache, no-store\r\nContent-Type: multipart/x-mixed-replace;boundary=Boundary\r\n\r\n";
 
-	// Ignore HTTP request
-	rc = recv(sk, tmp, sizeof(tmp), 0);
-	if(rc <= 0)
-	{
-		close(sk);
-		pthread_mutex_lock(&ntm);
-		jpegserver_nclients--;
-		pthread_mutex_unlock(&ntm);
-		return 0;
-	}
-	send(sk, http200, strlen(http200), MSG_NOSIGNAL);
 	for(;;)
 	{
-		pthread_rwlock_rdlock(&rwl);
-		// If there is a new image, send it (keep read-write lock locked in reading)
-		if(buffers[0].data && buffers[0].seq != lastseq)
+		if(cl->outpos == cl->outlen)
 		{
-			rc = send(sk, buffers[0].data, buffers[0].datalen, MSG_NOSIGNAL);
-			lastseq = buffers[0].seq;
+			jpegframe_unref(cl->frame);
+			cl->frame = 0;
+			f = jpegframe_get(d);
+			if(!f || f->seq == cl->lastseq)
+			{
+				// Nothing new, wait for the next frame
+				jpegframe_unref(f);
+				client_setwrite(d, cl, 0);
+				return;
+			}
+			cl->frame = f;
+			cl->lastseq = f->seq;
+			cl->out = f->data;
+			cl->outlen = f->len;
+			cl->outpos = 0;
+			cl->lastprogress = time(0);
 		}
-		pthread_rwlock_unlock(&rwl);
-		if(rc <= 0)
-			break;	// The client has disconnected
-
-		// Check if there is a new image; for this lock both buffers[0] in write mode and buffers[1]
-		pthread_rwlock_wrlock(&rwl);
-		pthread_mutex_lock(&jpegmutex);
-		if(buffers[1].data)
+		rc = send(cl->sk, cl->out + cl->outpos, cl->outlen - cl->outpos, MSG_NOSIGNAL);
+		if(rc < 0)
 		{
-			if(buffers[0].data)
-				free(buffers[0].data);
-			buffers[0].data = buffers[1].data;
-			buffers[0].datalen = buffers[1].datalen;
-			buffers[0].seq = buffers[1].seq;
-			buffers[1].data = 0;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				client_setwrite(d, cl, 1);
+			else cl->closed = 1;	// The client has disconnected
+			return;
 		}
-		pthread_rwlock_unlock(&rwl);
-		pthread_cond_wait(&jpegwait, &jpegmutex);
-		// We don't need to keep buffers[1] locked
-		pthread_mutex_unlock(&jpegmutex);
+		cl->outpos += rc;
+		cl->lastprogress = time(0);
 	}
+}
 
-	pthread_mutex_lock(&ntm);
-	jpegserver_nclients--;
-	pthread_mutex_unlock(&ntm);
-	close(sk);
-	return 0;
+static void client_event(VIDEODEC *d, struct jpegclient *cl, int readable, int writable)
+{
+	char tmp[3000];
+	int rc;
+
+	if(cl->closed)
+		return;
+	if(readable)
+	{
+		// Ignore HTTP request, we only need to know that it has arrived
+		rc = recv(cl->sk, tmp, sizeof(tmp), 0);
+		if(rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			cl->closed = 1;
+			return;
+		}
+		if(rc > 0 && !cl->streaming)
+		{
+			cl->streaming = 1;
+			cl->out = http200;
+			cl->outlen = strlen(http200);
+			cl->outpos = 0;
+			writable = 1;
+		}
+	}
+	if(writable && cl->streaming)
+		client_send(d, cl);
 }
 
-static void *server_thread(void *dummy)
+// Event loop of the JPEG server: it accepts the clients and sends them the frames
+// without blocking, all in this thread
+static void *server_thread(void *arg)
 {
+	VIDEODEC *d = (VIDEODEC *)arg;
+	struct jpegclient **clients = 0, *cl;
+	int nclients = 0, maxclients = 0;
 	struct sockaddr_in addr;
 	socklen_t addrlen;
-	int sk;
-	pthread_t tid;
+	int i, n, sk, newframe;
+	time_t now;
+	char tmp[100];
+#ifdef DARWIN
+	struct pollfd *pfd = 0;
+	int maxpfd = 0;
+#else
+	struct epoll_event ev, events[64];
+#endif
 
-	addrlen = sizeof(addr);
 	for(;;)
 	{
-		sk = accept(srvsk, (struct sockaddr *) &addr, &addrlen);
-		if(sk < 0)
+		int accepting = 0;
+
+		newframe = 0;
+#ifdef DARWIN
+		if(maxpfd < nclients + 2)
 		{
-			usleep(10000);
-			continue;
+			maxpfd = (nclients + 2) * 2;
+			pfd = (struct pollfd *)realloc(pfd, maxpfd * sizeof(*pfd));
+		}
+		pfd[0].fd = d->srvsk;
+		pfd[1].fd = d->srvpipe[0];
+		pfd[0].events = pfd[1].events = POLLIN;
+		for(i = 0; i < nclients; i++)
+		{
+			pfd[i+2].fd = clients[i]->sk;
+			pfd[i+2].events = POLLIN | (clients[i]->wantwrite ? POLLOUT : 0);
+		}
+		n = poll(pfd, nclients + 2, 1000);
+		if(n > 0)
+		{
+			accepting = pfd[0].revents != 0;
+			newframe = pfd[1].revents != 0;
+			for(i = 0; i < nclients; i++)
+				if(pfd[i+2].revents)
+					client_event(d, clients[i], (pfd[i+2].revents & ~POLLOUT) != 0, (pfd[i+2].revents & POLLOUT) != 0);
+		}
+#else
+		n = epoll_wait(d->srvep, events, sizeof(events) / sizeof(events[0]), 1000);
+		for(i = 0; i < n; i++)
+		{
+			if(events[i].data.ptr == d)
+				accepting = 1;
+			else if(events[i].data.ptr == d->srvpipe)
+				newframe = 1;
+			else client_event(d, (struct jpegclient *)events[i].data.ptr,
+				(events[i].events & ~EPOLLOUT) != 0, (events[i].events & EPOLLOUT) != 0);
+		}
+#endif
+		if(newframe)
+		{
+			// Empty the pipe and let the clients that are not busy send the new frame
+			while(read(d->srvpipe[0], tmp, sizeof(tmp)) > 0);
+			if(d->srvstop)
+				break;	// jpegserver_stop has been called
+			for(i = 0; i < nclients; i++)
+				if(clients[i]->streaming && !clients[i]->closed && clients[i]->outpos == clients[i]->outlen)
+					client_send(d, clients[i]);
 		}
+		while(accepting)
+		{
+			addrlen = sizeof(addr);
+			sk = accept(d->srvsk, (struct sockaddr *) &addr, &addrlen);
+			if(sk < 0)
+				break;
+#ifdef DARWIN
+			int set = 1;
+			setsockopt(sk, SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(int));
+#endif
+			fcntl(sk, F_SETFL, fcntl(sk, F_GETFL) | O_NONBLOCK);
+			cl = (struct jpegclient *)calloc(1, sizeof(struct jpegclient));
+			if(nclients == maxclients)
+			{
+				maxclients = maxclients ? maxclients * 2 : 16;
+				clients = (struct jpegclient **)realloc(clients, maxclients * sizeof(*clients));
+			}
+			cl->sk = sk;
+			cl->lastprogress = time(0);
+#ifndef DARWIN
+			ev.events = EPOLLIN;
+			ev.data.ptr = cl;
+			epoll_ctl(d->srvep, EPOLL_CTL_ADD, sk, &ev);
+#endif
+			clients[nclients++] = cl;
+		}
+		// Remove the disconnected clients and the ones that are stuck
+		now = time(0);
+		for(i = nclients - 1; i >= 0; i--)
+		{
+			cl = clients[i];
+			if(!cl->closed && (!cl->streaming || cl->outpos < cl->outlen) && now - cl->lastprogress > JPEGCLIENT_TIMEOUT)
+				cl->closed = 1;
+			if(cl->closed)
+			{
+				close(cl->sk);	// This also removes it from the epoll set
+				jpegframe_unref(cl->frame);
+				free(cl);
+				clients[i] = clients[--nclients];
+			}
+		}
+		__atomic_store_n(&d->jpegserver_nclients, nclients, __ATOMIC_RELAXED);
+	}
+	for(i = 0; i < nclients; i++)
+	{
+		close(clients[i]->sk);
+		jpegframe_unref(clients[i]->frame);
+		free(clients[i]);
+	}
+	free(clients);
 #ifdef DARWIN
-		int set = 1;
-		setsockopt(sk, SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(int));
+	free(pfd);
 #endif
-		pthread_mutex_lock(&ntm);
-		jpegserver_nclients++;
-		pthread_mutex_unlock(&ntm);
-		pthread_create(&tid, 0, client_thread, (void *)(size_t)sk);
-		pthread_detach(tid);
+	d->jpegserver_nclients = 0;
+	return 0;
+}
+
+static double now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec * 1e-6;
+}
+
+// Start timing a stage, returns 0 if the statistics are disabled
+static inline uint64_t stage_begin(VIDEODEC *d)
+{
+	return __atomic_load_n(&d->stats.enabled, __ATOMIC_RELAXED) ? stats_now_us() : 0;
+}
+
+static inline void stage_end(VIDEODEC *d, int stage, uint64_t t0)
+{
+	if(t0)
+		stats_record(&d->stats.stage[stage], stats_now_us() - t0);
+}
+
+#define STATS_ADD(d, counter, n) __atomic_add_fetch(&(d)->stats.counter, (n), __ATOMIC_RELAXED)
+
+// Create a frame for the JPEG server from the JPEG image jpeg of frame number frameseq
+static JPEGFRAME *jpegframe_new(const void *jpeg, unsigned long size, unsigned long frameseq)
+{
+	const char *httpdata = "--Boundary\r\nContent-Type: image/jpeg\r\nInfo: %s\r\nContent-Length: %d\r\n\r\n";
+	const char *info = "";
+	JPEGFRAME *f;
+
+	f = (JPEGFRAME *)malloc(sizeof(JPEGFRAME) + size + strlen(info) + 200);
+	if(!f)
+		return 0;
+	sprintf(f->data, httpdata, info, (int)size);
+	f->hdrlen = strlen(f->data);
+	memcpy(f->data + f->hdrlen, jpeg, size);
+	f->data[f->hdrlen + size] = '\r';
+	f->data[f->hdrlen + size + 1] = '\n';
+	f->len = f->hdrlen + size + 2;
+	f->refs = 1;
+	f->seq = 0;
+	f->frameseq = frameseq;
+	return f;
+}
+
+// Make f the latest frame of the JPEG server, taking its reference
+static void sendjpeg(VIDEODEC *d, JPEGFRAME *f)
+{
+	JPEGFRAME *old;
+
+	pthread_mutex_lock(&d->jpegmutex);
+	f->seq = ++d->jpegseq;
+	old = d->jpegframe;
+	d->jpegframe = f;
+	pthread_mutex_unlock(&d->jpegmutex);
+	jpegframe_unref(old);
+	// Wake up the server, if the pipe is full it will wake up anyway
+	if(write(d->srvpipe[1], "", 1) < 0 && errno != EAGAIN)
+		fprintf(stderr, "Error waking up the JPEG server\n");
+}
+
+/***************************************
+JPEG encoder thread
+
+Frames are encoded only once, on this thread, directly from their YUV planes; the
+receiving thread gives it a frame only when it's idle and the maximum frame rate allows it
+***************************************/
+
+#define JPEGENC_QUALITY 75
+
+// Give a frame to the JPEG encoder, either a libav frame or a YUYV capture frame;
+// called by the receiving thread before publishing frame number seq
+static void jpegenc_feed(VIDEODEC *d, AVFrame *frame, const char *yuyv, unsigned long seq)
+{
+	double now;
+
+	if(!d->jenc.tid || d->jpegserver_nclients <= 0)
+		return;
+	if(__atomic_load_n(&d->jenc.busy, __ATOMIC_ACQUIRE))
+	{
+		STATS_ADD(d, jpeg_skipped, 1);
+		return;
+	}
+	now = now_ms();
+	if(now < d->jenc.next_ms)
+		return;
+	d->jenc.next_ms = now + d->jenc.interval_ms;
+	pthread_mutex_lock(&d->jenc.mutex);
+	if(frame)
+	{
+		// Only a reference, the encoder reads the decoder planes
+		av_frame_unref(d->jenc.frame);
+		av_frame_ref(d->jenc.frame, frame);
+	} else {
+		if(!d->jenc.yuyv)
+			d->jenc.yuyv = (char *)malloc(d->frame_width * d->frame_height * 2);
+		if(!d->jenc.yuyv)
+		{
+			pthread_mutex_unlock(&d->jenc.mutex);
+			return;
+		}
+		memcpy(d->jenc.yuyv, yuyv, d->frame_width * d->frame_height * 2);
+	}
+	d->jenc.seq = seq;
+	d->jenc.busy = 1;
+	pthread_cond_signal(&d->jenc.cond);
+	pthread_mutex_unlock(&d->jenc.mutex);
+}
+
+static void jpegenc_encode(VIDEODEC *d)
+{
+	AVFrame *frame = d->jenc.frame;
+	unsigned char *buf = d->jenc.outbuf;
+	unsigned long size = d->jenc.outcap;
+	uint64_t t0 = stage_begin(d);
+	JPEGFRAME *f;
+
+	if(frame->data[0])
+	{
+		int vshift;
+
+		switch(frame->format)
+		{
+		case AV_PIX_FMT_YUV420P:
+		case AV_PIX_FMT_YUVJ420P:
+			vshift = 1;
+			break;
+		case AV_PIX_FMT_YUV422P:
+		case AV_PIX_FMT_YUVJ422P:
+			vshift = 0;
+			break;
+		default:
+			if(loglevel > 0)
+				fprintf(stderr, "JPEG encoder: unsupported pixel format %d\n", frame->format);
+			return;
+		}
+		jpeg_create_buf_planes(&buf, &size, (const unsigned char *const *)frame->data, frame->linesize,
+			frame->width, frame->height, vshift, d->jenc.quality);
+	} else if(jpeg_create_buf_yuyv(&buf, &size, d->jenc.yuyv, d->frame_width, d->frame_height, d->jenc.quality))
+		return;
+	// libjpeg replaces the output buffer when it's too small
+	if(buf != d->jenc.outbuf)
+	{
+		free(d->jenc.outbuf);
+		d->jenc.outbuf = buf;
+		d->jenc.outcap = size;
+	}
+	stage_end(d, ST_JPEGENC, t0);
+	f = jpegframe_new(buf, size, d->jenc.seq);
+	if(f)
+	{
+		STATS_ADD(d, jpeg_frames, 1);
+		sendjpeg(d, f);
+	}
+}
+
+static void *jpegenc_thread(void *arg)
+{
+	VIDEODEC *d = (VIDEODEC *)arg;
+
+	pthread_mutex_lock(&d->jenc.mutex);
+	for(;;)
+	{
+		while(!d->jenc.busy && !d->jenc.stop)
+			pthread_cond_wait(&d->jenc.cond, &d->jenc.mutex);
+		if(d->jenc.stop)
+			break;
+		pthread_mutex_unlock(&d->jenc.mutex);
+		jpegenc_encode(d);
+		pthread_mutex_lock(&d->jenc.mutex);
+		av_frame_unref(d->jenc.frame);
+		__atomic_store_n(&d->jenc.busy, 0, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&d->jenc.mutex);
+	return 0;
+}
+
+static int jpegenc_start(VIDEODEC *d, double maxfps, int quality)
+{
+	d->jenc.frame = av_frame_alloc();
+	if(!d->jenc.frame)
+		return -1;
+	d->jenc.interval_ms = maxfps > 0 ? 1000.0 / maxfps : 0;
+	d->jenc.next_ms = 0;
+	d->jenc.quality = quality;
+	d->jenc.busy = d->jenc.stop = 0;
+	if(pthread_create(&d->jenc.tid, 0, jpegenc_thread, d))
+	{
+		d->jenc.tid = 0;
+		av_frame_free(&d->jenc.frame);
+		return -1;
 	}
 	return 0;
 }
 
+static void jpegenc_stop(VIDEODEC *d)
+{
+	if(!d->jenc.tid)
+		return;
+	pthread_mutex_lock(&d->jenc.mutex);
+	d->jenc.stop = 1;
+	pthread_cond_signal(&d->jenc.cond);
+	pthread_mutex_unlock(&d->jenc.mutex);
+	pthread_join(d->jenc.tid, 0);
+	d->jenc.tid = 0;
+	av_frame_free(&d->jenc.frame);
+	free(d->jenc.yuyv);
+	d->jenc.yuyv = 0;
+	free(d->jenc.outbuf);
+	d->jenc.outbuf = 0;
+	d->jenc.outcap = 0;
+}
+
+static VIDEODEC *getdec(lua_State *L);
+
 static int jpegserver_init(lua_State * L)
 {
-	pthread_t tid;
+	VIDEODEC *d = getdec(L);
 	struct sockaddr_in addr;
-	int yes = 1;
+	int yes = 1, quality = JPEGENC_QUALITY;
+	double fps = 0;
 
-	srvsk = socket(AF_INET, SOCK_STREAM, 0);
-	setsockopt(srvsk, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+	if(d->srvsk)
+		luaL_error(L, "JPEG server already started");
+	if(lua_istable(L, 2))
+	{
+		lua_getfield(L, 2, "fps");
+		if(lua_isnumber(L, -1))
+			fps = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "quality");
+		if(lua_isnumber(L, -1))
+			quality = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if(quality < 1 || quality > 100)
+			luaL_error(L, "quality has to be between 1 and 100");
+	}
+	d->srvsk = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(d->srvsk, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 	addr.sin_family = AF_INET;
 	addr.sin_addr.s_addr = INADDR_ANY;
 	addr.sin_port = htons(lua_tointeger(L, 1));
-	if(bind(srvsk, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	if(bind(d->srvsk, (struct sockaddr *)&addr, sizeof(addr)) < 0)
 	{
-		close(srvsk);
-		srvsk = 0;
+		close(d->srvsk);
+		d->srvsk = 0;
 		luaL_error(L, "Error binding on port %d", ntohs(addr.sin_port));
 	}
-	listen(srvsk, 5);
-	pthread_create(&tid, 0, server_thread, 0);
-	pthread_detach(tid);
+	listen(d->srvsk, 64);
+	fcntl(d->srvsk, F_SETFL, fcntl(d->srvsk, F_GETFL) | O_NONBLOCK);
+	// The pipe wakes up the server when there is a new frame or when it has to stop
+	if(pipe(d->srvpipe))
+	{
+		close(d->srvsk);
+		d->srvsk = 0;
+		luaL_error(L, "Error creating the JPEG server pipe");
+	}
+	fcntl(d->srvpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(d->srvpipe[1], F_SETFL, O_NONBLOCK);
+	d->srvstop = 0;
+#ifndef DARWIN
+	struct epoll_event ev;
+
+	d->srvep = epoll_create(1);
+	ev.events = EPOLLIN;
+	ev.data.ptr = d;
+	epoll_ctl(d->srvep, EPOLL_CTL_ADD, d->srvsk, &ev);
+	ev.data.ptr = d->srvpipe;
+	epoll_ctl(d->srvep, EPOLL_CTL_ADD, d->srvpipe[0], &ev);
+#endif
+	pthread_create(&d->srv_tid, 0, server_thread, d);
+	if(jpegenc_start(d, fps, quality))
+		fprintf(stderr, "Error starting the JPEG encoder\n");
 	return 0;
 }
 
-#ifdef DOVIDEOCAP
-static void sendjpeg(const void *buf, unsigned long buflen)
+// Stop the JPEG encoder and the JPEG server thread, which closes all the clients
+static void jpegserver_stop(VIDEODEC *d)
 {
-	unsigned headerlen;
-	const char *httpdata = "--Boundary\r\nContent-Type: image/jpeg\r\nInfo: %s\r\nContent-Length: %d\r\n\r\n";
-	const char *info = 0;
-
-	if(!info)
-		info = "";
-	pthread_mutex_lock(&jpegmutex);
-	if(buffers[1].data)
-		free(buffers[1].data);
-	buffers[1].data = malloc(buflen + strlen(info) + 200);
-	sprintf(buffers[1].data, httpdata, info, buflen);
-	headerlen = strlen(buffers[1].data);
-	memcpy(buffers[1].data + headerlen, buf, buflen);
-	buffers[1].data[headerlen + buflen] = '\r';
-	buffers[1].data[headerlen + buflen + 1] = '\n';
-	buffers[1].datalen = headerlen + buflen + 2;
-	buffers[1].seq = ++jpegseq;
-	pthread_mutex_unlock(&jpegmutex);
-	// Broadcast that there is a new buffers[1]
-	pthread_cond_broadcast(&jpegwait);
-}
+	JPEGFRAME *f;
+
+	if(!d->srvsk)
+		return;
+	jpegenc_stop(d);
+	d->srvstop = 1;
+	if(write(d->srvpipe[1], "", 1) < 0)
+		fprintf(stderr, "Error waking up the JPEG server\n");
+	pthread_join(d->srv_tid, 0);
+	close(d->srvsk);
+	d->srvsk = 0;
+	close(d->srvpipe[0]);
+	close(d->srvpipe[1]);
+#ifndef DARWIN
+	close(d->srvep);
 #endif
+	pthread_mutex_lock(&d->jpegmutex);
+	f = d->jpegframe;
+	d->jpegframe = 0;
+	pthread_mutex_unlock(&d->jpegmutex);
+	jpegframe_unref(f);
+}
+
 
 #define LADDRI ((struct sockaddr_in *)&ifr[i].ifr_addr)->sin_addr.s_addr
 #define BADDRI ((unsigned char *)&(((struct sockaddr_in *)&ifr[i].ifr_addr)->sin_addr))
@@ -320,125 +900,144 @@ static int getlocalhostaddr(lua_State *L)
 End of JPEG server stuff
 ***************************************/
 
-static struct {
-	char *data;
-	unsigned datalen;
-	char filename[101];
-} jpeg;
-
-/* yuv420p-to-rgbp lookup table */
-static short TB_YUR[256], TB_YUB[256], TB_YUGU[256], TB_YUGV[256], TB_Y[256];
-static uint8_t TB_SAT[1024 + 1024 + 256];
+/***************************************
+Worker pool
+***************************************/
 
-/* This function calculates a lookup table for yuv420p-to-rgbp conversion
- * Written by Marko Vitez.
+/* The conversions of a frame are split in horizontal bands (or a batch in frames)
+ * and the slices are processed in parallel by the worker threads and by the calling
+ * thread, which is worker 0; every slice gives exactly the same result regardless
+ * of the thread that processes it
  */
-static void video_decoder_yuv420p_rgbp_LUT()
+typedef void (*WORKFN)(void *ctx, int slice, int worker);
+
+static struct {
+	int nthreads;		// Number of threads including the calling thread
+	pthread_t tids[MAXTHREADS];
+	pthread_mutex_t runmutex;	// Only one job at a time
+	pthread_mutex_t mutex;	// Protects the fields below
+	pthread_cond_t start, done;
+	WORKFN fn;
+	void *ctx;
+	int nslices, nextslice, pending;
+	unsigned gen;	// Incremented at every new job
+	int quit;
+} pool = {1, {0}, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// Process the slices of the current job until there are no more; called with mutex locked
+static void pool_runslices(int worker)
 {
-	int i;
+	int slice;
 
-	/* calculate lookup table for yuv420p */
-	for (i = 0; i < 256; i++) {
-		TB_YUR[i]  =  459 * (i-128) / 256;
-		TB_YUB[i]  =  541 * (i-128) / 256;
-		TB_YUGU[i] = -137 * (i-128) / 256;
-		TB_YUGV[i] = - 55 * (i-128) / 256;
-		TB_Y[i]    = (i-16) * 298 / 256;
+	while(pool.nextslice < pool.nslices)
+	{
+		slice = pool.nextslice++;
+		pthread_mutex_unlock(&pool.mutex);
+		pool.fn(pool.ctx, slice, worker);
+		pthread_mutex_lock(&pool.mutex);
+		if(!--pool.pending)
+			pthread_cond_signal(&pool.done);
 	}
-	for (i = 0; i < 1024; i++) {
-		TB_SAT[i] = 0;
-		TB_SAT[i + 1024 + 256] = 255;
+}
+
+static void *pool_thread(void *arg)
+{
+	int worker = (int)(long)arg;
+	unsigned gen = 0;
+
+	pthread_mutex_lock(&pool.mutex);
+	for(;;)
+	{
+		while(!pool.quit && pool.gen == gen)
+			pthread_cond_wait(&pool.start, &pool.mutex);
+		if(pool.quit)
+			break;
+		gen = pool.gen;
+		pool_runslices(worker);
 	}
-	for (i = 0; i < 256; i++)
-		TB_SAT[i + 1024] = i;
+	pthread_mutex_unlock(&pool.mutex);
+	return 0;
 }
 
-/* This function is a main function for converting color space from yuv420p to planar RGB.
- * It utilizes a lookup table method for fast conversion. Written by Marko Vitez.
- */
-static void video_decoder_yuv420p_rgbp(AVFrame * yuv, AVFrame * rgb)
-{
-	int i, j, U, V, Y, YUR, YUG, YUB;
-	int h = yuv->height;
-	int w = yuv->width;
-	int wy = yuv->linesize[0];
-	int wu = yuv->linesize[1];
-	int wv = yuv->linesize[2];
-	uint8_t *r = rgb->data[0];
-	uint8_t *g = rgb->data[1];
-	uint8_t *b = rgb->data[2];
-	uint8_t *y = yuv->data[0];
-	uint8_t *u = yuv->data[1];
-	uint8_t *v = yuv->data[2];
-	uint8_t *r1, *g1, *b1, *y1;
-	w /= 2;
-	h /= 2;
+// Call fn for every slice from 0 to nslices-1 and wait for all of them to finish
+static void parallel_for(WORKFN fn, void *ctx, int nslices)
+{
+	int i;
 
-	/* convert for R channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + 2*i*wy + 2*j;
-			V     = v[j + i * wv];
-			YUR   = TB_YUR[V];
-			r1    = (uint8_t *) r + 4*w*i + 2*j;
-
-			Y     = TB_Y[y1[0]];
-			*r1++ = TB_SAT[Y + YUR + 1024];
-			Y     = TB_Y[y1[1]];
-			*r1   = TB_SAT[Y + YUR + 1024];
-			y1   += wy;
-			r1   += 2*w - 1;
-			Y     = TB_Y[y1[0]];
-			*r1++ = TB_SAT[Y + YUR + 1024];
-			Y     = TB_Y[y1[1]];
-			*r1   = TB_SAT[Y + YUR + 1024];
-		}
-	}
-
-	/* convert for G channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + 2*i*wy + 2*j;
-			U     = u[j + i * wu];
-			V     = v[j + i * wv];
-			YUG   = TB_YUGU[U] + TB_YUGV[V];
-			g1    = (uint8_t *) g + 4*w*i + 2*j;
-
-			Y     = TB_Y[y1[0]];
-			*g1++ = TB_SAT[Y + YUG + 1024];
-			Y     = TB_Y[y1[1]];
-			*g1   = TB_SAT[Y + YUG + 1024];
-			y1   += wy;
-			g1   += 2*w - 1;
-			Y     = TB_Y[y1[0]];
-			*g1++ = TB_SAT[Y + YUG + 1024];
-			Y     = TB_Y[y1[1]];
-			*g1   = TB_SAT[Y + YUG + 1024];
-		}
-	}
-
-	/* convert for B channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + 2*i*wy + 2*j;
-			U     = u[j + i * wu];
-			YUB   = TB_YUB[U];
-			b1    = (uint8_t *) b + 4*w*i + 2*j;
+	if(pool.nthreads == 1 || nslices == 1)
+	{
+		for(i = 0; i < nslices; i++)
+			fn(ctx, i, 0);
+		return;
+	}
+	pthread_mutex_lock(&pool.runmutex);
+	pthread_mutex_lock(&pool.mutex);
+	pool.fn = fn;
+	pool.ctx = ctx;
+	pool.nslices = nslices;
+	pool.nextslice = 0;
+	pool.pending = nslices;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.start);
+	pool_runslices(0);
+	while(pool.pending)
+		pthread_cond_wait(&pool.done, &pool.mutex);
+	pthread_mutex_unlock(&pool.mutex);
+	pthread_mutex_unlock(&pool.runmutex);
+}
+
+// Stop the current workers and start n-1 new ones
+static void pool_setthreads(int n)
+{
+	int i;
 
-			Y     = TB_Y[y1[0]];
-			*b1++ = TB_SAT[Y + YUB + 1024];
-			Y     = TB_Y[y1[1]];
-			*b1   = TB_SAT[Y + YUB + 1024];
-			y1   += wy;
-			b1   += 2*w - 1;
-			Y     = TB_Y[y1[0]];
-			*b1++ = TB_SAT[Y + YUB + 1024];
-			Y     = TB_Y[y1[1]];
-			*b1   = TB_SAT[Y + YUB + 1024];
+	pthread_mutex_lock(&pool.runmutex);
+	pthread_mutex_lock(&pool.mutex);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.mutex);
+	for(i = 1; i < pool.nthreads; i++)
+		pthread_join(pool.tids[i], 0);
+	pool.quit = 0;
+	pool.nthreads = 1;
+	for(i = 1; i < n; i++)
+	{
+		if(pthread_create(&pool.tids[i], 0, pool_thread, (void *)(long)i))
+		{
+			fprintf(stderr, "Cannot create worker thread %d\n", i);
+			break;
 		}
+		pool.nthreads++;
 	}
+	pthread_mutex_unlock(&pool.runmutex);
+}
+
+// Rows of the band-th of nbands bands of a frame of height h; bands start on even rows
+static void band_rows(int h, int band, int nbands, int *row0, int *row1)
+{
+	*row0 = h / 2 * band / nbands * 2;
+	*row1 = band == nbands - 1 ? h : h / 2 * (band + 1) / nbands * 2;
+}
+
+// Make band a view of the rows from row0 to row1 of frame, whose chroma planes are
+// vertically subsampled by 1 << vshift
+static void frame_band(AVFrame *band, const AVFrame *frame, int row0, int row1, int vshift)
+{
+	int c;
+
+	*band = *frame;
+	band->height = row1 - row0;
+	band->data[0] = frame->data[0] + row0 * frame->linesize[0];
+	for(c = 1; c < 3; c++)
+		if(frame->data[c])
+			band->data[c] = frame->data[c] + (row0 >> vshift) * frame->linesize[c];
 }
 
+/* Planar RGB to yuv420p converters of the encoder, never 0 */
+static RGBROW_BYTE rgbrow_byte;
+static RGBROW_FLOAT rgbrow_float;
+
 static void video_decoder_rgb_ByteTensor(AVFrame *rgb, uint8_t *dst, long *strides)
 {
 	int i, j;
@@ -483,553 +1082,835 @@ static void video_decoder_rgb_FloatTensor(AVFrame *rgb, float *dst, long *stride
 	}
 }
 
-/* This function is a main function for converting color space from yuv420p to planar RGB
- * directly in torch float tensor
- * It utilizes a lookup table method for fast conversion. Written by Marko Vitez.
+/* This function is a main function for converting color space from yuv420p to planar YUV.
+ * Written by Marko Vitez.
  */
-static void yuv420p_floatrgbp(AVFrame * yuv, float *dst_float, int imgstride, int rowstride, int w, int h)
-{
-	int i, j, U, V, Y, YUR, YUG, YUB;
-	int wy = yuv->linesize[0];
-	int wu = yuv->linesize[1];
-	int wv = yuv->linesize[2];
-	float *r = dst_float;
-	float *g = dst_float + imgstride;
-	float *b = dst_float + 2*imgstride;
-	uint8_t *y = yuv->data[0];
-	uint8_t *u = yuv->data[1];
-	uint8_t *v = yuv->data[2];
-	uint8_t *y1;
-	float *r1, *g1, *b1;
-	w /= 2;
-	h /= 2;
+static void video_decoder_yuv420p_yuvp(AVFrame * yuv420, AVFrame * yuv)
+{
+	int i, j, j2, k;
+	int h = yuv420->height;
+	int w = yuv420->width;
+	int wy = yuv420->linesize[0];
+	int wu = yuv420->linesize[1];
+	int wv = yuv420->linesize[2];
 
-	/* convert for R channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + 2*i*wy + 2*j;
-			V     = v[j + i * wv];
-			YUR   = TB_YUR[V];
-			r1    = r + 2*(rowstride*i + j);
-
-			Y     = TB_Y[y1[0]];
-			*r1++ = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
-			Y     = TB_Y[y1[1]];
-			*r1   = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
-			y1   += wy;
-			r1   += 2*w - 1;
-			Y     = TB_Y[y1[0]];
-			*r1++ = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
-			Y     = TB_Y[y1[1]];
-			*r1   = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
-		}
-	}
-
-	/* convert for G channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + 2*i*wy + 2*j;
-			U     = u[j + i * wu];
-			V     = v[j + i * wv];
-			YUG   = TB_YUGU[U] + TB_YUGV[V];
-			g1    = g + 2*(rowstride*i + j);
-
-			Y     = TB_Y[y1[0]];
-			*g1++ = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
-			Y     = TB_Y[y1[1]];
-			*g1   = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
-			y1   += wy;
-			g1   += 2*w - 1;
-			Y     = TB_Y[y1[0]];
-			*g1++ = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
-			Y     = TB_Y[y1[1]];
-			*g1   = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
-		}
-	}
-
-	/* convert for B channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + 2*i*wy + 2*j;
-			U     = u[j + i * wu];
-			YUB   = TB_YUB[U];
-			b1    = b + 2*(rowstride*i + j);
+	uint8_t *srcy = yuv420->data[0];
+	uint8_t *srcu = yuv420->data[1];
+	uint8_t *srcv = yuv420->data[2];
 
-			Y     = TB_Y[y1[0]];
-			*b1++ = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
-			Y     = TB_Y[y1[1]];
-			*b1   = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
-			y1   += wy;
-			b1   += 2*w - 1;
-			Y     = TB_Y[y1[0]];
-			*b1++ = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
-			Y     = TB_Y[y1[1]];
-			*b1   = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
-		}
-	}
-}
+	uint8_t *dsty = yuv->data[0];
+	uint8_t *dstu = yuv->data[1];
+	uint8_t *dstv = yuv->data[2];
 
-/* This function is a main function for converting color space from yuv422p to planar RGB.
- * It utilizes a lookup table method for fast conversion. Written by Marko Vitez.
- */
-static void video_decoder_yuv422p_rgbp(AVFrame * yuv, AVFrame * rgb)
-{
-	int i, j, U, V, Y, YUR, YUG, YUB;
-	int h = yuv->height;
-	int w = yuv->width;
-	int wy = yuv->linesize[0];
-	int wu = yuv->linesize[1];
-	int wv = yuv->linesize[2];
-	uint8_t *r = rgb->data[0];
-	uint8_t *g = rgb->data[1];
-	uint8_t *b = rgb->data[2];
-	uint8_t *y = yuv->data[0];
-	uint8_t *u = yuv->data[1];
-	uint8_t *v = yuv->data[2];
-	uint8_t *r1, *g1, *b1, *y1;
-	w /= 2;
+	uint8_t *dst_y, *dst_u, *dst_v;
+	uint8_t *src_y, *src_u, *src_v;
 
-	/* convert for R channel */
 	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + i*wy + 2*j;
-			V     = v[j + i * wv];
-			YUR   = TB_YUR[V];
-			r1    = (uint8_t *) r + 2*(w*i + j);
+		src_y = &srcy[i * wy];
+		src_u = &srcu[i * wu / 2];
+		src_v = &srcv[i * wv / 2];
 
-			Y     = TB_Y[y1[0]];
-			*r1++ = TB_SAT[Y + YUR + 1024];
-			Y     = TB_Y[y1[1]];
-			*r1   = TB_SAT[Y + YUR + 1024];
-		}
-	}
+		dst_y = &dsty[i * w];
+		dst_u = &dstu[i * w];
+		dst_v = &dstv[i * w];
 
-	/* convert for G channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + i*wy + 2*j;
-			U     = u[j + i * wu];
-			V     = v[j + i * wv];
-			YUG   = TB_YUGU[U] + TB_YUGV[V];
-			g1    = (uint8_t *) g + 2*(w*i + j);
+		for (j = 0, k = 0; j < w; j++, k += 1) {
+			j2 = j >> 1;
 
-			Y     = TB_Y[y1[0]];
-			*g1++ = TB_SAT[Y + YUG + 1024];
-			Y     = TB_Y[y1[1]];
-			*g1   = TB_SAT[Y + YUG + 1024];
+			dst_y[k] = src_y[j];
+			dst_u[k] = src_u[j2];
+			dst_v[k] = src_v[j2];
 		}
 	}
+}
 
-	/* convert for B channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + i*wy + 2*j;
-			U     = u[j + i * wu];
-			YUB   = TB_YUB[U];
-			b1    = (uint8_t *) b + 2*(w*i + j);
+// Convert the rows from row0 to row1 (even) of a YUYV frame to yuv420p in lastframe_raw
+void yuyv_toyuv420(VIDEODEC *d, const char *from, int row0, int row1)
+{
+	int i, j, w = d->frame_width / 2;
+	uint8_t *lastframe_raw_u = d->lastframe_raw + d->frame_width * d->frame_height;
+	uint8_t *lastframe_raw_v = d->lastframe_raw + d->frame_width * d->frame_height / 4 * 5;
 
-			Y     = TB_Y[y1[0]];
-			*b1++ = TB_SAT[Y + YUB + 1024];
-			Y     = TB_Y[y1[1]];
-			*b1   = TB_SAT[Y + YUB + 1024];
+	for(i = row0 / 2; i < row1 / 2; i++)
+		for(j = 0; j < w; j++)
+		{
+			d->lastframe_raw[2*i*d->frame_width + 2*j] = from[4*i*d->frame_width + 4*j];
+			d->lastframe_raw[2*i*d->frame_width + 2*j+1] = from[4*i*d->frame_width + 4*j+2];
+			d->lastframe_raw[(2*i + 1)*d->frame_width + 2*j] = from[(2*i+1)*2*d->frame_width + 4*j];
+			d->lastframe_raw[(2*i + 1)*d->frame_width + 2*j+1] = from[(2*i+1)*2*d->frame_width + 4*j+2];
+			lastframe_raw_u[i*w + j] = from[4*i*d->frame_width + 4*j+1];
+			lastframe_raw_v[i*w + j] = from[4*i*d->frame_width + 4*j+3];
 		}
-	}
 }
 
-/* This function is a main function for converting color space from yuv422p to planar RGB
- * directly in torch float tensor
- * It utilizes a lookup table method for fast conversion. Written by Marko Vitez.
- */
-static void yuv422p_floatrgbp(AVFrame * yuv, float *dst_float, int imgstride, int rowstride, int w, int h)
-{
-	int i, j, U, V, Y, YUR, YUG, YUB;
-	int wy = yuv->linesize[0];
-	int wu = yuv->linesize[1];
-	int wv = yuv->linesize[2];
-	float *r = dst_float;
-	float *g = dst_float + imgstride;
-	float *b = dst_float + 2*imgstride;
-	uint8_t *y = yuv->data[0];
-	uint8_t *u = yuv->data[1];
-	uint8_t *v = yuv->data[2];
-	uint8_t *y1;
-	float *r1, *g1, *b1;
-	w /= 2;
-
-	/* convert for R channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + i*wy + 2*j;
-			V     = v[j + i * wv];
-			YUR   = TB_YUR[V];
-			r1    = r + i*rowstride + 2*j;
-
-			Y     = TB_Y[y1[0]];
-			*r1++ = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
-			Y     = TB_Y[y1[1]];
-			*r1   = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
+// Save the rows from row0 to row1 of the libav frame in lastframe_raw as yuv420p
+static void save_lastframe(VIDEODEC *d, AVFrame *pFrame_yuv, int row0, int row1)
+{
+	int offs[3], widths[3], stride2[3], i, j;
+
+	offs[0] = 0;
+	offs[1] = d->frame_width * d->frame_height;
+	offs[2] = d->frame_width * d->frame_height * 5 / 4;
+	stride2[0] = d->frame_width;
+	stride2[1] = stride2[2] = d->frame_width/2;
+	widths[0] = d->frame_width;
+	widths[2] = widths[1] = d->frame_width / 2;
+	for(i = 0; i < 3; i++)
+	{
+		int h0 = row0, h1 = row1;
+		if(i > 0)
+		{
+			h0 /= 2;
+			h1 /= 2;
 		}
+		for(j = h0; j < h1; j++)
+			memcpy(d->lastframe_raw + offs[i] + stride2[i]*j, pFrame_yuv->data[i] + pFrame_yuv->linesize[i]*j, widths[i]);
 	}
+}
 
-	/* convert for G channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + i*wy + 2*j;
-			U     = u[j + i * wu];
-			V     = v[j + i * wv];
-			YUG   = TB_YUGU[U] + TB_YUGV[V];
-			g1    = g + i*rowstride + 2*j;
+// Scale the frame using the rescaler of the worker to packed RGB in sws_rgb[worker] or,
+// if dst_byte is given, to the planes of the byte tensor, that the GBRP rescalers write directly
+static void rescale(VIDEODEC *d, int worker, const char *frame, AVFrame *pFrame_yuv, uint8_t *dst_byte, long *tensor_stride)
+{
+	const uint8_t *srcslice[3];
+	uint8_t *dstslice[3];
+	int srcstride[3], dststride[3], height;
 
-			Y     = TB_Y[y1[0]];
-			*g1++ = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
-			Y     = TB_Y[y1[1]];
-			*g1   = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
-		}
+#ifdef DOVIDEOCAP
+	if(d->vcap)
+	{
+		srcslice[0] = (uint8_t *)frame;
+		srcslice[1] = srcslice[2] = 0;
+		srcstride[0] = 2*d->frame_width;
+		srcstride[1] = srcstride[2] = 0;
+		height = d->frame_height;
+	} else
+#endif
+	{
+		srcslice[0] = pFrame_yuv->data[0];
+		srcslice[1] = pFrame_yuv->data[1];
+		srcslice[2] = pFrame_yuv->data[2];
+		srcstride[0] = pFrame_yuv->linesize[0];
+		srcstride[1] = pFrame_yuv->linesize[1];
+		srcstride[2] = pFrame_yuv->linesize[2];
+		height = d->frame_height;
+	}
+	if(dst_byte)
+	{
+		dstslice[0] = dst_byte + tensor_stride[0];
+		dstslice[1] = dst_byte + 2 * tensor_stride[0];
+		dstslice[2] = dst_byte;
+		dststride[0] = dststride[1] = dststride[2] = tensor_stride[1];
+	} else {
+		dstslice[0] = d->sws_rgb[worker];
+		dstslice[1] = dstslice[2] = 0;
+		dststride[0] = (3 * d->sws_w + 3) / 4 * 4;
+		dststride[1] = dststride[2] = 0;
 	}
+	sws_scale(d->sws_ctx[worker], srcslice, srcstride, 0, height, dstslice, dststride);
+}
 
-	/* convert for B channel */
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			y1    = y + i*wy + 2*j;
-			U     = u[j + i * wu];
-			YUB   = TB_YUB[U];
-			b1    = b + i*rowstride + 2*j;
+struct scalejob {
+	VIDEODEC *d;
+	const char *frame;	// YUYV frame from videocap
+	AVFrame *pFrame_yuv;	// or frames from libav
+	AVFrame **frames;	// Frames of a batch
+	uint8_t *dst_byte;	// Byte tensor
+	float *dst_float;	// or float tensor
+	const float *norm;	// Normalization of the float tensor, 0 for none
+	long *tensor_stride;
+	long framestride;	// Distance between the images of a batch
+	int nbands;
+};
 
-			Y     = TB_Y[y1[0]];
-			*b1++ = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
-			Y     = TB_Y[y1[1]];
-			*b1   = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
-		}
+static void save_band(void *ctx, int band, int worker)
+{
+	struct scalejob *job = (struct scalejob *)ctx;
+	VIDEODEC *d = job->d;
+	int row0, row1;
+
+#ifdef DOVIDEOCAP
+	if(d->vcap)
+	{
+		band_rows(d->frame_height, band, job->nbands, &row0, &row1);
+		yuyv_toyuv420(d, job->frame, row0, row1);
+		return;
 	}
+#endif
+	band_rows(d->frame_height, band, job->nbands, &row0, &row1);
+	save_lastframe(d, job->pFrame_yuv, row0, row1);
 }
 
-/* This function is a main function for converting color space from yuv420p to planar YUV.
- * Written by Marko Vitez.
- */
-static void video_decoder_yuv420p_yuvp(AVFrame * yuv420, AVFrame * yuv)
+static void tofloat_band(void *ctx, int band, int worker)
 {
-	int i, j, j2, k;
-	int h = yuv420->height;
-	int w = yuv420->width;
-	int wy = yuv420->linesize[0];
-	int wu = yuv420->linesize[1];
-	int wv = yuv420->linesize[2];
+	struct scalejob *job = (struct scalejob *)ctx;
+	VIDEODEC *d = job->d;
+	int row0, row1;
 
-	uint8_t *srcy = yuv420->data[0];
-	uint8_t *srcu = yuv420->data[1];
-	uint8_t *srcv = yuv420->data[2];
+	band_rows(d->sws_h, band, job->nbands, &row0, &row1);
+	rgb_tofloat(d->sws_rgb[0] + row0 * ((3 * d->sws_w + 3) / 4 * 4), d->sws_w, row1 - row0,
+		job->dst_float + row0 * job->tensor_stride[1], job->tensor_stride[0], job->tensor_stride[1], job->norm);
+}
 
-	uint8_t *dsty = yuv->data[0];
-	uint8_t *dstu = yuv->data[1];
-	uint8_t *dstv = yuv->data[2];
+// Scale and convert one frame of a batch with the rescaler of the worker
+static void scale_frame(void *ctx, int i, int worker)
+{
+	struct scalejob *job = (struct scalejob *)ctx;
+	VIDEODEC *d = job->d;
 
-	uint8_t *dst_y, *dst_u, *dst_v;
-	uint8_t *src_y, *src_u, *src_v;
+	if(job->dst_byte)
+	{
+		rescale(d, worker, 0, job->frames[i], job->dst_byte + job->framestride * i, job->tensor_stride);
+		return;
+	}
+	rescale(d, worker, 0, job->frames[i], 0, 0);
+	rgb_tofloat(d->sws_rgb[worker], d->sws_w, d->sws_h, job->dst_float + job->framestride * i,
+		job->tensor_stride[0], job->tensor_stride[1], 0);
+}
 
-	for (i = 0; i < h; i++) {
-		src_y = &srcy[i * wy];
-		src_u = &srcu[i * wu / 2];
-		src_v = &srcv[i * wv / 2];
+// Save the frame in lastframe_raw for frame_jpeg and save_jpeg
+static void save_frame(VIDEODEC *d, const char *frame, AVFrame *pFrame_yuv)
+{
+	struct scalejob job;
 
-		dst_y = &dsty[i * w];
-		dst_u = &dstu[i * w];
-		dst_v = &dstv[i * w];
+	job.d = d;
+	job.frame = frame;
+	job.pFrame_yuv = pFrame_yuv;
+	job.nbands = pool.nthreads;
+	if(!d->lastframe_raw)
+		return;
+	d->lastframe_seq++;
+	d->lastframe_rxseq = d->rx_tid ? d->returned_seq : 0;
+	parallel_for(save_band, &job, job.nbands);
+}
 
-		for (j = 0, k = 0; j < w; j++, k += 1) {
-			j2 = j >> 1;
+// Rescale the frame and convert it to the float tensor, normalizing it if norm is given
+static void rescale_tofloat(VIDEODEC *d, float *dst_float, long *tensor_stride, const char *frame, AVFrame *pFrame_yuv, const float *norm)
+{
+	struct scalejob job;
+
+	job.d = d;
+	job.frame = frame;
+	job.pFrame_yuv = pFrame_yuv;
+	job.dst_float = dst_float;
+	job.norm = norm;
+	job.tensor_stride = tensor_stride;
+	job.nbands = pool.nthreads;
+	// libswscale cannot rescale bands independently without changing the results
+	// at the borders of the bands, so the frame is rescaled by this thread
+	rescale(d, 0, frame, pFrame_yuv, 0, 0);
+	parallel_for(tofloat_band, &job, job.nbands);
+}
 
-			dst_y[k] = src_y[j];
-			dst_u[k] = src_u[j2];
-			dst_v[k] = src_v[j2];
-		}
+void scale_torgb(VIDEODEC *d, float *dst_float, long *tensor_stride, const char *frame, AVFrame *pFrame_yuv)
+{
+	save_frame(d, frame, pFrame_yuv);
+	rescale_tofloat(d, dst_float, tensor_stride, frame, pFrame_yuv, 0);
+}
+
+// Scale the frame directly to the planes of the byte tensor with the GBRP rescaler
+void scale_tobyte(VIDEODEC *d, uint8_t *dst_byte, long *tensor_stride, const char *frame, AVFrame *pFrame_yuv)
+{
+	save_frame(d, frame, pFrame_yuv);
+	rescale(d, 0, frame, pFrame_yuv, dst_byte, tensor_stride);
+}
+
+// Scale and convert a batch of frames, every worker with its own rescaler
+void scale_torgb_batch(VIDEODEC *d, uint8_t *dst_byte, float *dst_float, long *tensor_stride, AVFrame **frames, int nframes)
+{
+	struct scalejob job;
+
+	if(!nframes)
+		return;
+	job.d = d;
+	job.frames = frames;
+	job.dst_byte = dst_byte;
+	job.dst_float = dst_float;
+	job.tensor_stride = tensor_stride + 1;
+	job.framestride = tensor_stride[0];
+	// Only the last frame is kept in lastframe_raw
+	if(d->lastframe_raw)
+	{
+		save_lastframe(d, frames[nframes - 1], 0, d->frame_height);
+		d->lastframe_seq++;
+		d->lastframe_rxseq = 0;
 	}
+	parallel_for(scale_frame, &job, nframes);
 }
 
-/* This function is a main function for converting color space from YUYV to planar RGB.
- * It can fill directly a torch byte tensor
- * Written by Marko Vitez.
- */
-void yuyv2torchRGB(const unsigned char *frame, unsigned char *dst_byte, int imgstride, int rowstride, int w, int h)
+/***************************************
+Fused resize and normalization
+***************************************/
+
+struct normjob {
+	const uint8_t *plane[3];	// Y, U, V
+	int linesize[3];
+	int step[3];	// Distance between two samples of the same plane in a row
+	int srcw, srch, chromah;
+	int dstw, dsth;
+	int *x0, *x1, *cx0, *cx1;	// Sample offsets in the rows
+	float *fx, *cfx;	// Weight of x1 and cx1
+	float *dst_float;
+	long *stride;
+	const float *norm;	// scale[3] and bias[3]
+	int nbands;
+};
+
+// Bilinear sampling position of the i-th of n destination samples from srcn source samples
+static void bilinear_pos(int i, int n, int srcn, int *p0, int *p1, float *f)
 {
-	int i, j, w2 = w / 2;
-	uint8_t *dst;
-	const uint8_t *src;
+	float pos = (i + 0.5f) * srcn / n - 0.5f;
+	int k;
 
-	/* convert for R channel */
-	src = frame;
-	for (i = 0; i < h; i++) {
-		dst = dst_byte + i * rowstride;
-		for (j = 0; j < w2; j++) {
-			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUR[ src[3] ] + 1024];
-			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUR[ src[3] ] + 1024];
-			src += 4;
-		}
+	if(pos < 0)
+		pos = 0;
+	k = (int)pos;
+	if(k >= srcn - 1)
+	{
+		*p0 = *p1 = srcn - 1;
+		*f = 0;
+	} else {
+		*p0 = k;
+		*p1 = k + 1;
+		*f = pos - k;
 	}
+}
 
-	/* convert for G channel */
-	src = frame;
-	for (i = 0; i < h; i++) {
-		dst = dst_byte + i * rowstride + imgstride;
-		for (j = 0; j < w2; j++) {
-			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUGU[ src[1] ] + TB_YUGV[ src[3] ] + 1024];
-			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUGU[ src[1] ] + TB_YUGV[ src[3] ] + 1024];
-			src += 4;
+static inline float lerp2(const uint8_t *r0, const uint8_t *r1, int x0, int x1, float fx, float fy)
+{
+	float a = r0[x0] + (r0[x1] - r0[x0]) * fx;
+	float b = r1[x0] + (r1[x1] - r1[x0]) * fx;
+
+	return a + (b - a) * fy;
+}
+
+static inline float clamp255(float x)
+{
+	return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+static void normalized_band(void *ctx, int band, int worker)
+{
+	struct normjob *job = (struct normjob *)ctx;
+	const float *norm = job->norm;
+	int row0, row1, i, j, y0, y1, c0, c1;
+	float fy, cfy, Y, U, V;
+
+	band_rows(job->dsth, band, job->nbands, &row0, &row1);
+	for(i = row0; i < row1; i++)
+	{
+		float *r = job->dst_float + i * job->stride[1];
+		float *g = r + job->stride[0];
+		float *b = g + job->stride[0];
+		const uint8_t *yr0, *yr1, *ur0, *ur1, *vr0, *vr1;
+
+		bilinear_pos(i, job->dsth, job->srch, &y0, &y1, &fy);
+		bilinear_pos(i, job->dsth, job->chromah, &c0, &c1, &cfy);
+		yr0 = job->plane[0] + y0 * job->linesize[0];
+		yr1 = job->plane[0] + y1 * job->linesize[0];
+		ur0 = job->plane[1] + c0 * job->linesize[1];
+		ur1 = job->plane[1] + c1 * job->linesize[1];
+		vr0 = job->plane[2] + c0 * job->linesize[2];
+		vr1 = job->plane[2] + c1 * job->linesize[2];
+		for(j = 0; j < job->dstw; j++)
+		{
+			// Same coefficients of the yuv to rgb lookup tables
+			Y = (lerp2(yr0, yr1, job->x0[j], job->x1[j], job->fx[j], fy) - 16) * (298 / 256.0f);
+			U = lerp2(ur0, ur1, job->cx0[j], job->cx1[j], job->cfx[j], cfy) - 128;
+			V = lerp2(vr0, vr1, job->cx0[j], job->cx1[j], job->cfx[j], cfy) - 128;
+			r[j] = clamp255(Y + (459 / 256.0f) * V) * norm[0] + norm[3];
+			g[j] = clamp255(Y - (137 / 256.0f) * U - (55 / 256.0f) * V) * norm[1] + norm[4];
+			b[j] = clamp255(Y + (541 / 256.0f) * U) * norm[2] + norm[5];
 		}
 	}
+}
 
-	/* convert for B channel */
-	src = frame;
-	for (i = 0; i < h; i++) {
-		dst = dst_byte + i * rowstride + 2*imgstride;
-		for (j = 0; j < w2; j++) {
-			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUB[ src[1] ] + 1024];
-			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUB[ src[1] ] + 1024];
-			src += 4;
+static void FreeNormTables(VIDEODEC *d)
+{
+	free(d->normtab.x);
+	free(d->normtab.f);
+	d->normtab.x = 0;
+	d->normtab.f = 0;
+	d->normtab.dstw = 0;
+}
+
+// Point the job to the sample offsets and weights of its sizes, computing them only if they
+// changed since the last frame; returns -1 if they cannot be allocated
+static int normalized_tables(VIDEODEC *d, struct normjob *job, int cw)
+{
+	int j, changed = d->normtab.dstw != job->dstw || d->normtab.srcw != job->srcw || d->normtab.cw != cw ||
+		d->normtab.step != job->step[0] || d->normtab.cstep != job->step[1];
+
+	if(changed)
+	{
+		FreeNormTables(d);
+		d->normtab.x = (int *)malloc(4 * job->dstw * sizeof(int));
+		d->normtab.f = (float *)malloc(2 * job->dstw * sizeof(float));
+		if(!d->normtab.x || !d->normtab.f)
+		{
+			FreeNormTables(d);
+			return -1;
 		}
+		d->normtab.dstw = job->dstw;
+		d->normtab.srcw = job->srcw;
+		d->normtab.cw = cw;
+		d->normtab.step = job->step[0];
+		d->normtab.cstep = job->step[1];
 	}
+	job->x0 = d->normtab.x;
+	job->x1 = job->x0 + job->dstw;
+	job->cx0 = job->x1 + job->dstw;
+	job->cx1 = job->cx0 + job->dstw;
+	job->fx = d->normtab.f;
+	job->cfx = job->fx + job->dstw;
+	if(changed)
+		for(j = 0; j < job->dstw; j++)
+		{
+			bilinear_pos(j, job->dstw, job->srcw, job->x0 + j, job->x1 + j, job->fx + j);
+			bilinear_pos(j, job->dstw, cw, job->cx0 + j, job->cx1 + j, job->cfx + j);
+			job->x0[j] *= job->step[0];
+			job->x1[j] *= job->step[0];
+			job->cx0[j] *= job->step[1];
+			job->cx1[j] *= job->step[1];
+		}
+	return 0;
 }
 
-/* This function is a main function for converting color space from YUYV to planar RGB.
- * It can fill directly a torch float tensor
- * Written by Marko Vitez.
+/* Resample the frame directly from the YUV planes with bilinear interpolation to planar
+ * float RGB, where every channel c is (rgb / 255 - mean[c]) / std[c]; the norm array
+ * contains scale = 1 / (255 * std) and bias = -mean / std for the three channels
+ * Formats that are not planar yuv420p/yuv422p or YUYV are rescaled and normalized in the
+ * conversion to float
  */
-void yuyv2torchfloatRGB(const unsigned char *frame, float *dst_float, int imgstride, int rowstride, int w, int h)
+static void scale_normalized(VIDEODEC *d, float *dst_float, long *stride, long *size, const char *frame, AVFrame *pFrame_yuv, const float *norm)
 {
-	int i, j, w2 = w / 2;
-	float *dst;
-	const uint8_t *src;
+	struct normjob job;
+	enum AVPixelFormat fmt;
+	int c, cw, vshift;
 
-	/* convert for R channel */
-	src = frame;
-	for (i = 0; i < h; i++) {
-		dst = dst_float + i * rowstride;
-		for (j = 0; j < w2; j++) {
-			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUR[ src[3] ] + 1024] * BYTE2FLOAT;
-			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUR[ src[3] ] + 1024] * BYTE2FLOAT;
-			src += 4;
+	save_frame(d, frame, pFrame_yuv);
+#ifdef DOVIDEOCAP
+	if(d->vcap)
+	{
+		job.plane[0] = (const uint8_t *)frame;
+		job.plane[1] = (const uint8_t *)frame + 1;
+		job.plane[2] = (const uint8_t *)frame + 3;
+		job.linesize[0] = job.linesize[1] = job.linesize[2] = 2 * d->frame_width;
+		job.step[0] = 2;
+		job.step[1] = job.step[2] = 4;
+		job.srcw = d->frame_width;
+		job.srch = d->frame_height;
+		vshift = 0;
+	} else
+#endif
+	{
+		fmt = pFrame_yuv->format;
+		if(fmt == AV_PIX_FMT_YUV420P || fmt == AV_PIX_FMT_YUVJ420P)
+			vshift = 1;
+		else if(fmt == AV_PIX_FMT_YUV422P || fmt == AV_PIX_FMT_YUVJ422P)
+			vshift = 0;
+		else {
+			rescale_tofloat(d, dst_float, stride, frame, pFrame_yuv, norm);
+			return;
 		}
-	}
-
-	/* convert for G channel */
-	src = frame;
-	for (i = 0; i < h; i++) {
-		dst = dst_float + i * rowstride + imgstride;
-		for (j = 0; j < w2; j++) {
-			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUGU[ src[1] ] + TB_YUGV[ src[3] ] + 1024] * BYTE2FLOAT;
-			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUGU[ src[1] ] + TB_YUGV[ src[3] ] + 1024] * BYTE2FLOAT;
-			src += 4;
+		for(c = 0; c < 3; c++)
+		{
+			job.plane[c] = pFrame_yuv->data[c];
+			job.linesize[c] = pFrame_yuv->linesize[c];
+			job.step[c] = 1;
 		}
+		job.srcw = pFrame_yuv->width;
+		job.srch = pFrame_yuv->height;
 	}
-
-	/* convert for B channel */
-	src = frame;
-	for (i = 0; i < h; i++) {
-		dst = dst_float + i * rowstride + 2*imgstride;
-		for (j = 0; j < w2; j++) {
-			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUB[ src[1] ] + 1024] * BYTE2FLOAT;
-			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUB[ src[1] ] + 1024] * BYTE2FLOAT;
-			src += 4;
-		}
+	cw = (job.srcw + 1) / 2;
+	job.chromah = vshift ? (job.srch + 1) / 2 : job.srch;
+	job.dstw = size[2];
+	job.dsth = size[1];
+	job.dst_float = dst_float;
+	job.stride = stride;
+	job.norm = norm;
+	job.nbands = pool.nthreads;
+	if(normalized_tables(d, &job, cw))
+	{
+		rescale_tofloat(d, dst_float, stride, frame, pFrame_yuv, norm);
+		return;
 	}
+	parallel_for(normalized_band, &job, job.nbands);
 }
 
-// Convert packed RGB present in sws_rgb to planar float
-void rgb_tofloat(float *dst_float, int imgstride, int linestride)
+// Free the rescalers of all the workers
+static void FreeRescalers(VIDEODEC *d)
 {
-	int c, i, j, srcstride;
+	int i;
 
-	srcstride = (sws_w * 3 + 3) / 4 * 4;
-	for(c = 0; c < 3; c++)
-		for(i = 0; i < sws_h; i++)
-			for(j = 0; j < sws_w; j++)
-				dst_float[j + i * linestride + c * imgstride] =
-					sws_rgb[c + 3*j + srcstride*i] * BYTE2FLOAT;
+	for(i = 0; i < MAXTHREADS; i++)
+		if(d->sws_ctx[i])
+		{
+			sws_freeContext(d->sws_ctx[i]);
+			free(d->sws_rgb[i]);
+			d->sws_ctx[i] = 0;
+			d->sws_rgb[i] = 0;
+		}
+	d->sws_w = d->sws_h = 0;
 }
 
-// Convert planar RGB to packed RGB
-void rgb_fromfloat(const float *src_float, int imgstride, int linestride, int width, int height, uint8_t *rgb)
+static int prefetch_start(VIDEODEC *d, int n);
+static void prefetch_stop(VIDEODEC *d);
+static int prefetch_pop(VIDEODEC *d, AVFrame *frame);
+static void free_frames(VIDEODEC *d);
+static int push_eos(lua_State *L, int rc);
+static int frame_view(lua_State *L, VIDEODEC *d, int yuv);
+static int index_open(VIDEODEC *d, const char *fpath, const char *sidecar);
+static void index_free(VIDEODEC *d);
+static void preroll_free(VIDEODEC *d);
+int get_next_frame(VIDEODEC *d, AVFrame *frame);
+static int read_mode_frame(VIDEODEC *d, AVFrame *frame);
+static void push_pts(lua_State *L, VIDEODEC *d, int64_t pts);
+
+// Decode a packet to frame; decoded frames are refcounted and belong to us,
+// so the previous frame has to be released first
+static int decode_video(VIDEODEC *d, AVFrame *frame, int *got_frame, AVPacket *pkt)
 {
-	int c, i, j, dststride;
+	uint64_t t0 = stage_begin(d);
+	int rc;
 
-	dststride = (width * 3 + 3) / 4 * 4;
-	for(c = 0; c < 3; c++)
-		for(i = 0; i < height; i++)
-			for(j = 0; j < width; j++)
-				rgb[c + 3*j + dststride*i] = src_float[j + i * linestride + c * imgstride] * 255;
+	if(d->pCodecCtx->refcounted_frames)
+		av_frame_unref(frame);
+	rc = avcodec_decode_video2(d->pCodecCtx, frame, got_frame, pkt);
+	stage_end(d, ST_DECODE, t0);
+	if(rc >= 0 && *got_frame)
+		STATS_ADD(d, frames_decoded, 1);
+	return rc;
 }
 
-void rgb_frombyte(const unsigned char *src_float, int imgstride, int linestride, int width, int height, uint8_t *rgb)
+/* The receiving thread started by startremux publishes every new frame with a
+ * sequence number in a triple buffer, so that it never waits for the consumer
+ * and the consumer never waits for it, unless it wants to wait for a frame newer
+ * than the last one it got: in this case it sleeps on framecond, which is only
+ * signalled if somebody is waiting
+ */
+#define TB_FRESH 4
+
+// Publish the frame written in the back slot as the newest one
+static void tb_publish(VIDEODEC *d)
 {
-	int c, i, j, dststride;
+	d->tb.seq[d->tb.back] = ++d->frame_seq;
+	d->tb.back = __atomic_exchange_n(&d->tb.middle, d->tb.back | TB_FRESH, __ATOMIC_SEQ_CST) & ~TB_FRESH;
+	if(__atomic_load_n(&d->tb.nwaiters, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&d->readmutex);
+		pthread_cond_broadcast(&d->framecond);
+		pthread_mutex_unlock(&d->readmutex);
+	}
+}
 
-	dststride = (width * 3 + 3) / 4 * 4;
-	for(c = 0; c < 3; c++)
-		for(i = 0; i < height; i++)
-			for(j = 0; j < width; j++)
-				rgb[c + 3*j + dststride*i] = src_float[j + i * linestride + c * imgstride];
+// Move the newest published frame to the front slot, if it was not taken yet
+static void tb_grab(VIDEODEC *d)
+{
+	if(__atomic_load_n(&d->tb.middle, __ATOMIC_SEQ_CST) & TB_FRESH)
+		d->tb.front = __atomic_exchange_n(&d->tb.middle, d->tb.front, __ATOMIC_SEQ_CST) & ~TB_FRESH;
 }
 
-void yuyv_toyuv420(const char *from)
+// The front slot contains a frame, newer than the last returned one if wait_new is set
+#define TB_HASFRAME(d, wait_new) ((d)->tb.seq[(d)->tb.front] && \
+	(!(wait_new) || (d)->tb.seq[(d)->tb.front] != (d)->returned_seq))
+
+/* Get the newest received frame in the front slot and, for libav, in pFrame_yuv; if
+ * wait_new is set, wait for a frame newer than the last returned one, for timeout_ms
+ * at most if timeout_ms >= 0
+ * Returns the sequence number of the frame, or 0 if there is no frame
+ */
+static unsigned long rx_getframe(VIDEODEC *d, int wait_new, int timeout_ms)
 {
-	int i, j, h = frame_height / 2, w = frame_width / 2;
-	uint8_t *lastframe_raw_u = lastframe_raw + frame_width * frame_height;
-	uint8_t *lastframe_raw_v = lastframe_raw + frame_width * frame_height / 4 * 5;
+	struct timespec ts;
+	int rc = 0;
 
-	for(i = 0; i < h; i++)
-		for(j = 0; j < w; j++)
+	tb_grab(d);
+	if(TB_HASFRAME(d, wait_new))
+		goto found;
+
+	if(timeout_ms >= 0)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if(ts.tv_nsec >= 1000000000L)
 		{
-			lastframe_raw[2*i*frame_width + 2*j] = from[4*i*frame_width + 4*j];
-			lastframe_raw[2*i*frame_width + 2*j+1] = from[4*i*frame_width + 4*j+2];
-			lastframe_raw[(2*i + 1)*frame_width + 2*j] = from[(2*i+1)*2*frame_width + 4*j];
-			lastframe_raw[(2*i + 1)*frame_width + 2*j+1] = from[(2*i+1)*2*frame_width + 4*j+2];
-			lastframe_raw_u[i*w + j] = from[4*i*frame_width + 4*j+1];
-			lastframe_raw_v[i*w + j] = from[4*i*frame_width + 4*j+3];
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
 		}
+	}
+	pthread_mutex_lock(&d->readmutex);
+	__atomic_add_fetch(&d->tb.nwaiters, 1, __ATOMIC_SEQ_CST);
+	for(;;)
+	{
+		// Check again after having declared that we wait, a frame could have been published
+		tb_grab(d);
+		if(rc || !d->rx_running || TB_HASFRAME(d, wait_new))
+			break;
+		if(timeout_ms >= 0)
+			rc = pthread_cond_timedwait(&d->framecond, &d->readmutex, &ts);
+		else pthread_cond_wait(&d->framecond, &d->readmutex);
+	}
+	__atomic_sub_fetch(&d->tb.nwaiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&d->readmutex);
+	if(!TB_HASFRAME(d, wait_new))
+		return 0;
+found:
+	// The frame in the front slot stays ours until the next grab
+	if(d->pCodecCtx)
+	{
+		av_frame_unref(d->pFrame_yuv);
+		av_frame_ref(d->pFrame_yuv, d->tb.frame[d->tb.front]);
+	}
+	if(d->returned_seq && d->tb.seq[d->tb.front] > d->returned_seq + 1)
+		STATS_ADD(d, frames_skipped, d->tb.seq[d->tb.front] - d->returned_seq - 1);
+	d->returned_seq = d->tb.seq[d->tb.front];
+	return d->returned_seq;
 }
 
-void scale_torgb(float *dst_float, long *tensor_stride, const char *frame, AVFrame *pFrame_yuv)
+// Get the number field name of the optional table at idx, def if missing
+static double getoptnumber(lua_State *L, int idx, const char *name, double def)
 {
-	// Convert image from YUYV to RGB torch tensor
-	const uint8_t *srcslice[3];
-	uint8_t *dstslice[3];
-	int srcstride[3], dststride[3], height;
-
-#ifdef DOVIDEOCAP
-	if(vcap)
-	{
-		srcslice[0] = (uint8_t *)frame;
-		srcslice[1] = srcslice[2] = 0;
-		srcstride[0] = 2*frame_width;
-		srcstride[1] = srcstride[2] = 0;
-		height = frame_height;
-		if(!jpegserver_nclients)
-			yuyv_toyuv420(frame);
-	} else
-#endif
+	if(lua_istable(L, idx))
 	{
-		srcslice[0] = pFrame_yuv->data[0];
-		srcslice[1] = pFrame_yuv->data[1];
-		srcslice[2] = pFrame_yuv->data[2];
-		srcstride[0] = pFrame_yuv->linesize[0];
-		srcstride[1] = pFrame_yuv->linesize[1];
-		srcstride[2] = pFrame_yuv->linesize[2];
-		height = pCodecCtx->height;
-
-		// Save frame
-		int offs[3], widths[3], stride2[3], i, j;
-		offs[0] = 0;
-		offs[1] = pCodecCtx->width * pCodecCtx->height;
-		offs[2] = pCodecCtx->width * pCodecCtx->height * 5 / 4;
-		stride2[0] = pCodecCtx->width;
-		stride2[1] = stride2[2] = pCodecCtx->width/2;
-		widths[0] = pCodecCtx->width;
-		widths[2] = widths[1] = pCodecCtx->width / 2;
-		if(lastframe_raw)
-		for(i = 0; i < 3; i++)
-		{
-			int h = pCodecCtx->height;
-			if(i > 0)
-				h /= 2;
-			for(j = 0; j < h; j++)
-				memcpy(lastframe_raw + offs[i] + stride2[i]*j, srcslice[i] + srcstride[i]*j, widths[i]);
-		}
+		lua_getfield(L, idx, name);
+		if(lua_isnumber(L, -1))
+			def = lua_tonumber(L, -1);
+		lua_pop(L, 1);
 	}
-	dstslice[0] = sws_rgb;
-	dstslice[1] = dstslice[2] = 0;
-	dststride[0] = (3 * sws_w + 3) / 4 * 4;
-	dststride[1] = dststride[2] = 0;
-	sws_scale(sws_ctx, srcslice, srcstride, 0, height, dstslice, dststride);
-	rgb_tofloat(dst_float, tensor_stride[0], tensor_stride[1]);
+	return def;
+}
+
+// Get the wait_new and timeout_ms fields of the optional table at idx
+static void getwaitoptions(lua_State *L, int idx, int *wait_new, int *timeout_ms)
+{
+	*wait_new = 0;
+	*timeout_ms = -1;
+	if(!lua_istable(L, idx))
+		return;
+	lua_getfield(L, idx, "wait_new");
+	*wait_new = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	lua_getfield(L, idx, "timeout_ms");
+	if(lua_isnumber(L, -1))
+		*timeout_ms = lua_tointeger(L, -1);
+	lua_pop(L, 1);
 }
 
 /*
  * Free and close video decoder
  */
-int video_decoder_exit(lua_State * L)
+static void decoder_close(VIDEODEC *d)
 {
-	if(rx_tid)
+	int i;
+
+	prefetch_stop(d);
+	index_free(d);
+	av_frame_free(&d->seekframe);
+	d->seek_pending = 0;
+	if(d->rx_tid)
 	{
 		void *retval;
-		rx_active = 0;
-		pthread_join(rx_tid, &retval);
-		rx_tid = 0;
+		d->rx_active = 0;
+		pthread_join(d->rx_tid, &retval);
+		d->rx_tid = 0;
 	}
+	for(i = 0; i < 3; i++)
+		av_frame_free(&d->tb.frame[i]);
+	preroll_free(d);
+	free(d->mux.pkts);
+	d->mux.pkts = 0;
+	d->mux.size = 0;
 
 #ifdef DOVIDEOCAP
-	if(vcap)
+	if(d->vcap)
 	{
-		videocap_close(vcap);
-		vcap = 0;
+		videocap_close(d->vcap);
+		d->vcap = 0;
+		d->vcap_last = 0;
 	}
-	if(vcodec)
+	if(d->vcodec)
 	{
-		videocodec_close(vcodec);
-		vcodec = 0;
+		videocodec_close(d->vcodec);
+		d->vcodec = 0;
 	}
-	if(vcap_frame)
+	if(d->vcap_frame)
 	{
-		free(vcap_frame);
-		vcap_frame = 0;
+		free(d->vcap_frame);
+		d->vcap_frame = 0;
 	}
-	if(vcodec_extradata)
+	if(d->vcodec_extradata)
 	{
-		free(vcodec_extradata);
-		vcodec_extradata = 0;
+		free(d->vcodec_extradata);
+		d->vcodec_extradata = 0;
 	}
 #endif
 	/* free the AVFrame structures */
-	if (pFrame_intm) {
-		av_free(pFrame_intm);
-		pFrame_intm = 0;
+	if (d->pFrame_intm) {
+		av_free(d->pFrame_intm);
+		d->pFrame_intm = 0;
 	}
-	if (pFrame_yuv) {
-		av_free(pFrame_yuv);
-		pFrame_yuv = 0;
+	if (d->pFrame_yuv) {
+		free_frames(d);
+		d->pFrame_yuv = 0;
 	}
 
 	/* close the codec and video file */
-	if (pCodecCtx) {
-		avcodec_close(pCodecCtx);
-		pCodecCtx = 0;
+	if (d->pCodecCtx) {
+		avcodec_close(d->pCodecCtx);
+		d->pCodecCtx = 0;
 	}
-	if (pFormatCtx)
+	if (d->pFormatCtx)
 	{
-		avformat_close_input(&pFormatCtx);
-		pFormatCtx = 0;
+		avformat_close_input(&d->pFormatCtx);
+		d->pFormatCtx = 0;
 	}
-	if(ofmt_ctx)
+	if(d->ofmt_ctx)
 	{
-		avformat_free_context(ofmt_ctx);
-		ofmt_ctx = 0;
+		avformat_free_context(d->ofmt_ctx);
+		d->ofmt_ctx = 0;
 	}
 
-	if(sws_ctx)
+	FreeRescalers(d);
+	FreeNormTables(d);
+	if(d->lastframe_raw)
 	{
-		sws_freeContext(sws_ctx);
-		sws_ctx = 0;
+		free(d->lastframe_raw);
+		d->lastframe_raw = 0;
 	}
-	if(sws_rgb)
+	d->sws_w = d->sws_h = 0;
+	jpegframe_unref(d->jpeglua);
+	d->jpeglua = 0;
+	motion_free(&d->motion);
+	d->frame_decoded = 0;
+	d->stream_ended = 0;
+	d->read_error = 0;
+	if(d->mpjpeg)
 	{
-		free(sws_rgb);
-		sws_rgb = 0;
+		mpjpeg_disconnect(d->mpjpeg);
+		d->mpjpeg = 0;
+		d->jpeg.data = 0;
 	}
-	if(lastframe_raw)
+}
+
+/***************************************
+Decoder objects
+***************************************/
+
+#define VIDEODEC_MT "libvideo_decoder.decoder"
+static VIDEODEC *defdec;	// Decoder used when the functions are not called as methods
+static int defdec_ref = LUA_NOREF;
+
+// Create a new decoder object and leave it on the top of the Lua stack
+static VIDEODEC *newdec(lua_State *L)
+{
+	VIDEODEC *d = (VIDEODEC *)lua_newuserdata(L, sizeof(VIDEODEC));
+
+	memset(d, 0, sizeof(VIDEODEC));
+	pthread_mutex_init(&d->readmutex, 0);
+	pthread_cond_init(&d->framecond, 0);
+	pthread_mutex_init(&d->jpegmutex, 0);
+	pthread_mutex_init(&d->jenc.mutex, 0);
+	pthread_cond_init(&d->jenc.cond, 0);
+	pthread_mutex_init(&d->prefetch.mutex, 0);
+	pthread_cond_init(&d->prefetch.cond, 0);
+	pthread_mutex_init(&d->mux.mutex, 0);
+	pthread_cond_init(&d->mux.cond, 0);
+	pthread_mutex_init(&d->enc.mutex, 0);
+	pthread_cond_init(&d->enc.cond, 0);
+	pthread_mutex_init(&d->stats.mutex, 0);
+	pthread_cond_init(&d->stats.cond, 0);
+	d->stats.enabled = 1;
+	d->stats.start_us = stats_now_us();
+	d->decode_nextpts = AV_NOPTS_VALUE;
+	d->tb.back = 0;
+	d->tb.front = 1;
+	d->tb.middle = 2;
+	luaL_getmetatable(L, VIDEODEC_MT);
+	lua_setmetatable(L, -2);
+	return d;
+}
+
+// Make the decoder object on the top of the Lua stack the default one
+static void setdefdec(lua_State *L, VIDEODEC *d)
+{
+	if(defdec_ref != LUA_NOREF)
+		luaL_unref(L, LUA_REGISTRYINDEX, defdec_ref);
+	lua_pushvalue(L, -1);
+	defdec_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	defdec = d;
+}
+
+// If the function has been called as a method, return the decoder object and remove it
+// from the stack, so that the other parameters are found at the same positions;
+// otherwise return the default decoder (the last one opened with init or capture)
+static VIDEODEC *getdec(lua_State *L)
+{
+	VIDEODEC *d;
+
+	if(lua_getmetatable(L, 1))
 	{
-		free(lastframe_raw);
-		lastframe_raw = 0;
+		luaL_getmetatable(L, VIDEODEC_MT);
+		if(lua_rawequal(L, -1, -2))
+		{
+			d = (VIDEODEC *)lua_touserdata(L, 1);
+			lua_pop(L, 2);
+			lua_remove(L, 1);
+			return d;
+		}
+		lua_pop(L, 2);
 	}
-	sws_w = sws_h = 0;
-	if(jpeg_buf)
+	if(!defdec)
 	{
-		free(jpeg_buf);
-		jpeg_buf = 0;
+		d = newdec(L);
+		setdefdec(L, d);
+		lua_pop(L, 1);
 	}
-	frame_decoded = 0;
-	stream_ended = 0;
-	mpjpeg_disconnect();
+	return defdec;
+}
+
+static int video_decoder_exit(lua_State * L)
+{
+	decoder_close(getdec(L));
+	return 0;
+}
+
+static void encoder_close(VIDEODEC *d);
+static void stats_csvstop(VIDEODEC *d);
+
+// Called when the decoder object is garbage collected
+static int decoder_gc(lua_State *L)
+{
+	VIDEODEC *d = (VIDEODEC *)lua_touserdata(L, 1);
+
+	stats_csvstop(d);
+	decoder_close(d);
+	encoder_close(d);
+	jpegserver_stop(d);
+	pthread_mutex_destroy(&d->readmutex);
+	pthread_cond_destroy(&d->framecond);
+	pthread_mutex_destroy(&d->jpegmutex);
+	pthread_mutex_destroy(&d->jenc.mutex);
+	pthread_cond_destroy(&d->jenc.cond);
+	pthread_mutex_destroy(&d->prefetch.mutex);
+	pthread_cond_destroy(&d->prefetch.cond);
+	pthread_mutex_destroy(&d->mux.mutex);
+	pthread_cond_destroy(&d->mux.cond);
+	pthread_mutex_destroy(&d->enc.mutex);
+	pthread_cond_destroy(&d->enc.cond);
+	pthread_mutex_destroy(&d->stats.mutex);
+	pthread_cond_destroy(&d->stats.cond);
 	return 0;
 }
 
+// Create an empty decoder object, useful to use the encoder without opening anything
+static int video_decoder_new(lua_State *L)
+{
+	newdec(L);
+	return 1;
+}
+
 /* This function initiates libavcodec and its utilities. It finds a valid stream from
  * the given video file and returns the height and width of the input video. The input
  * arguments is the location of file in a string.
@@ -1040,10 +1921,69 @@ static int video_decoder_init(lua_State * L)
 	int i;
 	AVCodec *pCodec;
 
-	video_decoder_exit(NULL);
 	/* pass input arguments */
 	const char *fpath = lua_tostring(L, 1);
 	const char *src_type = lua_tostring(L, 2);
+	int prefetch = 0, decode_mode = DECODE_ALL, decode_every = 1;
+	int thread_count = -1, thread_type = 0, low_delay = 0, dctscale = 1;
+	char sidecar[500];
+	*sidecar = 0;
+	if(lua_istable(L, 3))
+	{
+		const char *mode;
+
+		lua_getfield(L, 3, "thread_count");
+		if(!lua_isnil(L, -1))
+			thread_count = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 3, "thread_type");
+		mode = lua_tostring(L, -1);
+		if(mode && !strcmp(mode, "frame"))
+			thread_type = FF_THREAD_FRAME;
+		else if(mode && !strcmp(mode, "slice"))
+			thread_type = FF_THREAD_SLICE;
+		else if(mode && !strcmp(mode, "frame+slice"))
+			thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+		else if(mode)
+			luaL_error(L, "<video_decoder> thread_type has to be frame, slice or frame+slice");
+		lua_pop(L, 1);
+		lua_getfield(L, 3, "low_delay");
+		low_delay = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 3, "dct_scaling");
+		if(!lua_isnil(L, -1))
+			dctscale = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "decode");
+		mode = lua_tostring(L, -1);
+		if(!mode || !strcmp(mode, "all"))
+			decode_mode = DECODE_ALL;
+		else if(!strcmp(mode, "nonref-skip"))
+			decode_mode = DECODE_NONREF;
+		else if(!strcmp(mode, "keyframes-only"))
+			decode_mode = DECODE_KEYFRAMES;
+		else if(!strcmp(mode, "every-Nth"))
+			decode_mode = DECODE_EVERYNTH;
+		else luaL_error(L, "<video_decoder> unknown decode mode %s", mode);
+		lua_pop(L, 1);
+		lua_getfield(L, 3, "every");
+		if(decode_mode == DECODE_EVERYNTH && (decode_every = lua_tointeger(L, -1)) < 1)
+			luaL_error(L, "<video_decoder> the every-Nth decode mode needs every >= 1");
+		lua_pop(L, 1);
+		lua_getfield(L, 3, "prefetch");
+		prefetch = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 3, "index");
+		if(lua_type(L, -1) == LUA_TSTRING)
+			snprintf(sidecar, sizeof(sidecar), "%s", lua_tostring(L, -1));
+		else if(lua_toboolean(L, -1) && fpath)
+			snprintf(sidecar, sizeof(sidecar), "%s.idx", fpath);
+		lua_pop(L, 1);
+	}
+	VIDEODEC *d = newdec(L);
+	d->decode_mode = decode_mode;
+	d->decode_every = decode_every;
 	if(loglevel >= 3)
 		fprintf(stderr, "video_decoder_init(%s,%s)\n", fpath, src_type);
 
@@ -1052,49 +1992,53 @@ static int video_decoder_init(lua_State * L)
 		// For JPEGs coming from a webserver with multipart content-type
 		// we have our routines
 		AVPacket pkt;
-		int rc = mpjpeg_connect(fpath);
-		if(rc)
+		int rc;
+		d->mpjpeg = mpjpeg_connect(fpath, &rc);
+		if(!d->mpjpeg)
 			luaL_error(L, "Connection to %s failed: %d", fpath, rc);
-		rc = mpjpeg_getdata(&jpeg.data, &jpeg.datalen, jpeg.filename, sizeof(jpeg.filename));
+		rc = mpjpeg_getdata(d->mpjpeg, &d->jpeg.data, &d->jpeg.datalen, d->jpeg.filename, sizeof(d->jpeg.filename));
 		if(rc)
 			luaL_error(L, "Connection to %s failed: %d", fpath, rc);
 		// Create a JPEG decoder
 		pCodec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
 		if (pCodec == NULL)
 			luaL_error(L, "<video_decoder> the codec is not supported");
-		pCodecCtx = avcodec_alloc_context3(pCodec);
-		if(!pCodecCtx)
+		d->pCodecCtx = avcodec_alloc_context3(pCodec);
+		if(!d->pCodecCtx)
 			luaL_error(L, "<video_decoder> error allocating codec");
-		if (avcodec_open2(pCodecCtx, pCodec, NULL) < 0) {
-			video_decoder_exit(NULL);
+		d->pCodecCtx->refcounted_frames = 1;
+		if (avcodec_open2(d->pCodecCtx, pCodec, NULL) < 0) {
+			decoder_close(d);
 			luaL_error(L, "<video_decoder> could not open the codec");
 		}
 
 		memset(&pkt, 0, sizeof(pkt));
 		av_init_packet(&pkt);
-		pkt.data = (unsigned char *)jpeg.data;
-		pkt.size = jpeg.datalen;
+		pkt.data = (unsigned char *)d->jpeg.data;
+		pkt.size = d->jpeg.datalen;
 		pkt.flags = AV_PKT_FLAG_KEY;
-		pFrame_yuv = avcodec_alloc_frame();
-		if(avcodec_decode_video2(pCodecCtx, pFrame_yuv, &i, &pkt) < 0 || !i)
+		d->pFrame_yuv = avcodec_alloc_frame();
+		if(avcodec_decode_video2(d->pCodecCtx, d->pFrame_yuv, &i, &pkt) < 0 || !i)
 		{
-			video_decoder_exit(NULL);
+			decoder_close(d);
 			luaL_error(L, "<video_decoder> Error decoding JPEG image");
 		}
 
 		/* allocate an AVFrame structure (No DMA memory) */
-		pFrame_intm = avcodec_alloc_frame();
-		pFrame_intm->height = pCodecCtx->height;
-		pFrame_intm->width = pCodecCtx->width;
-		pFrame_intm->data[0] = av_malloc(pCodecCtx->width * pCodecCtx->height);
-		pFrame_intm->data[1] = av_malloc(pCodecCtx->width * pCodecCtx->height);
-		pFrame_intm->data[2] = av_malloc(pCodecCtx->width * pCodecCtx->height);
-
-		frame_width = pCodecCtx->width;
-		frame_height = pCodecCtx->height;
-		lua_pushboolean(L, 1);
-		lua_pushnumber(L, pCodecCtx->height);
-		lua_pushnumber(L, pCodecCtx->width);
+		d->pFrame_intm = avcodec_alloc_frame();
+		d->pFrame_intm->height = d->pCodecCtx->height;
+		d->pFrame_intm->width = d->pCodecCtx->width;
+		d->pFrame_intm->data[0] = av_malloc(d->pCodecCtx->width * d->pCodecCtx->height);
+		d->pFrame_intm->data[1] = av_malloc(d->pCodecCtx->width * d->pCodecCtx->height);
+		d->pFrame_intm->data[2] = av_malloc(d->pCodecCtx->width * d->pCodecCtx->height);
+
+		d->frame_width = d->pCodecCtx->width;
+		d->frame_height = d->pCodecCtx->height;
+		d->frame_fmt = d->pCodecCtx->pix_fmt;
+		d->jpeg.dctscale = dctscale;
+		setdefdec(L, d);
+		lua_pushnumber(L, d->pCodecCtx->height);
+		lua_pushnumber(L, d->pCodecCtx->width);
 		lua_pushnil(L);
 		lua_pushnil(L);
 		return 5;
@@ -1103,80 +2047,112 @@ static int video_decoder_init(lua_State * L)
 	AVInputFormat *iformat = av_find_input_format(src_type);
 
 	/* open video file */
-	if (avformat_open_input(&pFormatCtx, fpath, iformat, NULL) != 0) {
-		video_decoder_exit(NULL);
+	if (avformat_open_input(&d->pFormatCtx, fpath, iformat, NULL) != 0) {
+		decoder_close(d);
 		luaL_error(L, "<video_decoder> no video was provided");
 	}
 
 	/* retrieve stream information */
-	if (avformat_find_stream_info(pFormatCtx, NULL) < 0) {
-		video_decoder_exit(NULL);
+	if (avformat_find_stream_info(d->pFormatCtx, NULL) < 0) {
+		decoder_close(d);
 		luaL_error(L, "<video_decoder> no stream information was found");
 	}
 
 	/* dump information about file onto standard error */
-	if (loglevel > 0) av_dump_format(pFormatCtx, 0, fpath, 0);
+	if (loglevel > 0) av_dump_format(d->pFormatCtx, 0, fpath, 0);
 
 	/* find the first video stream */
-	stream_idx = -1;
-	for (i = 0; i < pFormatCtx->nb_streams; i++) {
-		if (pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-			stream_idx = i;
+	d->stream_idx = -1;
+	for (i = 0; i < d->pFormatCtx->nb_streams; i++) {
+		if (d->pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+			d->stream_idx = i;
 			break;
 		}
 	}
-	if (stream_idx == -1) {
-		video_decoder_exit(NULL);
+	if (d->stream_idx == -1) {
+		decoder_close(d);
 		luaL_error(L, "<video_decoder> could not find a video stream");
 	}
 
 	/* get a pointer to the codec context for the video stream */
-	pCodecCtx = pFormatCtx->streams[stream_idx]->codec;
+	d->pCodecCtx = d->pFormatCtx->streams[d->stream_idx]->codec;
 
 	/* find the decoder for the video stream */
-	pCodec = avcodec_find_decoder(pCodecCtx->codec_id);
+	pCodec = avcodec_find_decoder(d->pCodecCtx->codec_id);
 	if (pCodec == NULL) {
-		video_decoder_exit(NULL);
+		decoder_close(d);
 		luaL_error(L, "<video_decoder> the codec is not supported");
 	}
 
+	/* decoded frames have to stay valid after the next decode for the prefetch
+	   thread, the batches of frame_batch_resized and the tensor views */
+	d->pCodecCtx->refcounted_frames = 1;
+
+	/* decoding threads: frame threading adds thread_count - 1 frames of delay,
+	   slice threading does not, but not every stream has more slices */
+	if (thread_count >= 0)
+		d->pCodecCtx->thread_count = thread_count;
+	if (thread_type)
+		d->pCodecCtx->thread_type = thread_type;
+	if (low_delay)
+		d->pCodecCtx->flags |= CODEC_FLAG_LOW_DELAY;
+
+	/* the decoder does not decode the discarded frames */
+	if (decode_mode == DECODE_NONREF)
+		d->pCodecCtx->skip_frame = AVDISCARD_NONREF;
+	else if (decode_mode == DECODE_KEYFRAMES)
+		d->pCodecCtx->skip_frame = AVDISCARD_NONKEY;
+
 	/* open codec */
-	if (avcodec_open2(pCodecCtx, pCodec, NULL) < 0) {
-		video_decoder_exit(NULL);
+	if (avcodec_open2(d->pCodecCtx, pCodec, NULL) < 0) {
+		decoder_close(d);
 		luaL_error(L, "<video_decoder> could not open the codec");
 	}
 
 	/* allocate a raw AVFrame structure (yuv420p) */
-	pFrame_yuv = avcodec_alloc_frame();
+	d->pFrame_yuv = avcodec_alloc_frame();
 
 	/* allocate an AVFrame structure (No DMA memory) */
-	pFrame_intm = avcodec_alloc_frame();
-	pFrame_intm->height = pCodecCtx->height;
-	pFrame_intm->width = pCodecCtx->width;
-	pFrame_intm->data[0] = av_malloc(pCodecCtx->width * pCodecCtx->height);
-	pFrame_intm->data[1] = av_malloc(pCodecCtx->width * pCodecCtx->height);
-	pFrame_intm->data[2] = av_malloc(pCodecCtx->width * pCodecCtx->height);
+	d->pFrame_intm = avcodec_alloc_frame();
+	d->pFrame_intm->height = d->pCodecCtx->height;
+	d->pFrame_intm->width = d->pCodecCtx->width;
+	d->pFrame_intm->data[0] = av_malloc(d->pCodecCtx->width * d->pCodecCtx->height);
+	d->pFrame_intm->data[1] = av_malloc(d->pCodecCtx->width * d->pCodecCtx->height);
+	d->pFrame_intm->data[2] = av_malloc(d->pCodecCtx->width * d->pCodecCtx->height);
+
+	if (*sidecar && index_open(d, fpath, sidecar)) {
+		decoder_close(d);
+		luaL_error(L, "<video_decoder> could not index %s", fpath);
+	}
+
+	if (prefetch > 0 && prefetch_start(d, prefetch)) {
+		decoder_close(d);
+		luaL_error(L, "<video_decoder> could not start the prefetch thread");
+	}
 
     /* calculate fps */
-	double frame_rate = pFormatCtx->streams[stream_idx]->avg_frame_rate.num /
-		(double) pFormatCtx->streams[stream_idx]->avg_frame_rate.den;
+	double frame_rate = d->pFormatCtx->streams[d->stream_idx]->avg_frame_rate.num /
+		(double) d->pFormatCtx->streams[d->stream_idx]->avg_frame_rate.den;
 
 	if(loglevel >= 3)
-		fprintf(stderr, "video_decoder_init ok, %dx%d, %ld frames, %f fps\n", pCodecCtx->width,
-			pCodecCtx->height, (long)pFormatCtx->streams[i]->nb_frames, frame_rate);
+		fprintf(stderr, "video_decoder_init ok, %dx%d, %ld frames, %f fps\n", d->pCodecCtx->width,
+			d->pCodecCtx->height, (long)d->pFormatCtx->streams[i]->nb_frames, frame_rate);
 	/* return frame dimensions */
-	frame_width = pCodecCtx->width;
-	frame_height = pCodecCtx->height;
-	lua_pushboolean(L, 1);
-	lua_pushnumber(L, pCodecCtx->height);
-	lua_pushnumber(L, pCodecCtx->width);
-	if (pFormatCtx->streams[stream_idx]->nb_frames > 0) {
-		lua_pushnumber(L, pFormatCtx->streams[stream_idx]->nb_frames);
-	} else if(pFormatCtx->duration > 0 && pFormatCtx->streams[stream_idx]->avg_frame_rate.den > 0 &&
-		pFormatCtx->streams[stream_idx]->avg_frame_rate.num)
-	{
-		lua_pushnumber(L, pFormatCtx->duration * pFormatCtx->streams[stream_idx]->avg_frame_rate.num /
-			pFormatCtx->streams[stream_idx]->avg_frame_rate.den / 1000000);
+	d->frame_width = d->pCodecCtx->width;
+	d->frame_height = d->pCodecCtx->height;
+	d->frame_fmt = d->pCodecCtx->pix_fmt;
+	setdefdec(L, d);
+	lua_pushnumber(L, d->pCodecCtx->height);
+	lua_pushnumber(L, d->pCodecCtx->width);
+	if (d->index.nframes > 0) {
+		lua_pushnumber(L, d->index.nframes);
+	} else if (d->pFormatCtx->streams[d->stream_idx]->nb_frames > 0) {
+		lua_pushnumber(L, d->pFormatCtx->streams[d->stream_idx]->nb_frames);
+	} else if(d->pFormatCtx->duration > 0 && d->pFormatCtx->streams[d->stream_idx]->avg_frame_rate.den > 0 &&
+		d->pFormatCtx->streams[d->stream_idx]->avg_frame_rate.num)
+	{
+		lua_pushnumber(L, d->pFormatCtx->duration * d->pFormatCtx->streams[d->stream_idx]->avg_frame_rate.num /
+			d->pFormatCtx->streams[d->stream_idx]->avg_frame_rate.den / 1000000);
 	} else {
 		lua_pushnil(L);
 	}
@@ -1189,38 +2165,94 @@ static int video_decoder_init(lua_State * L)
 	return 5;
 }
 
-int ToTensor(unsigned char *dst_byte, float *dst_float, long *stride, long *size)
-{
-	if(dst_byte)
+struct tensorjob {
+	VIDEODEC *d;
+	unsigned char *dst_byte;
+	float *dst_float;
+	long *stride;
+	int nbands;
+};
+
+// Convert one horizontal band of pFrame_yuv
+static void totensor_band(void *ctx, int band, int worker)
+{
+	struct tensorjob *job = (struct tensorjob *)ctx;
+	VIDEODEC *d = job->d;
+	long *stride = job->stride;
+	enum AVPixelFormat fmt = d->pFrame_yuv->format;
+	int is422 = fmt == AV_PIX_FMT_YUV422P || fmt == AV_PIX_FMT_YUVJ422P;
+	int is420 = fmt == AV_PIX_FMT_YUV420P || fmt == AV_PIX_FMT_YUVJ420P;
+	int row0, row1, c;
+	AVFrame yuv, rgb;
+
+	if(job->dst_byte)
 	{
-		int c;
-
-		if(pCodecCtx->pix_fmt == AV_PIX_FMT_YUV422P || pCodecCtx->pix_fmt == AV_PIX_FMT_YUVJ422P)
-			video_decoder_yuv422p_rgbp(pFrame_yuv, pFrame_intm);
-		else if(pCodecCtx->pix_fmt == AV_PIX_FMT_YUV420P || pCodecCtx->pix_fmt == AV_PIX_FMT_YUVJ420P)
-			video_decoder_yuv420p_rgbp(pFrame_yuv, pFrame_intm);
-		else if(pCodecCtx->pix_fmt == AV_PIX_FMT_RGB24)
-			video_decoder_rgb_ByteTensor(pFrame_yuv, dst_byte, stride);
-		else return -1;
-
-		/* copy each channel from av_malloc to DMA_malloc */
-		if(pCodecCtx->pix_fmt != AV_PIX_FMT_RGB24)
-			for (c = 0; c < 3; c++)
-				memcpy(dst_byte + c * stride[0],
-					   pFrame_intm->data[c],
-					   size[1] * size[2]);
+		band_rows(d->pFrame_yuv->height, band, job->nbands, &row0, &row1);
+		frame_band(&yuv, d->pFrame_yuv, row0, row1, is420);
+		if(is422 || is420)
+		{
+			rgb = *d->pFrame_intm;
+			for(c = 0; c < 3; c++)
+				rgb.data[c] += row0 * (d->pFrame_yuv->width & ~1);
+			if(is422)
+				video_decoder_yuv422p_rgbp(&yuv, &rgb);
+			else video_decoder_yuv420p_rgbp(&yuv, &rgb);
+		} else video_decoder_rgb_ByteTensor(&yuv, job->dst_byte + row0 * stride[1], stride);
+	} else if(is422 || is420) {
+		band_rows(d->pFrame_yuv->height, band, job->nbands, &row0, &row1);
+		frame_band(&yuv, d->pFrame_yuv, row0, row1, is420);
+		if(is422)
+			yuv422p_floatrgbp(&yuv, job->dst_float + row0 * stride[1], stride[0], stride[1], d->pFrame_yuv->width, row1 - row0);
+		else yuv420p_floatrgbp(&yuv, job->dst_float + row0 * stride[1], stride[0], stride[1], d->pFrame_yuv->width, row1 - row0);
 	} else {
-		if(pCodecCtx->pix_fmt == AV_PIX_FMT_YUV422P || pCodecCtx->pix_fmt == AV_PIX_FMT_YUVJ422P)
-			yuv422p_floatrgbp(pFrame_yuv, dst_float, stride[0], stride[1], pCodecCtx->width, pCodecCtx->height);
-		else if(pCodecCtx->pix_fmt == AV_PIX_FMT_YUV420P || pCodecCtx->pix_fmt == AV_PIX_FMT_YUVJ420P)
-			yuv420p_floatrgbp(pFrame_yuv, dst_float, stride[0], stride[1], pCodecCtx->width, pCodecCtx->height);
-		else if(pCodecCtx->pix_fmt == AV_PIX_FMT_RGB24)
-			video_decoder_rgb_FloatTensor(pFrame_yuv, dst_float, stride);
-		else return -1;
+		band_rows(d->pFrame_yuv->height, band, job->nbands, &row0, &row1);
+		frame_band(&yuv, d->pFrame_yuv, row0, row1, 0);
+		video_decoder_rgb_FloatTensor(&yuv, job->dst_float + row0 * stride[1], stride);
 	}
+}
+
+// Convert pFrame_yuv to the tensor, in parallel bands if more threads are enabled
+int ToTensor(VIDEODEC *d, unsigned char *dst_byte, float *dst_float, long *stride, long *size)
+{
+	enum AVPixelFormat fmt = d->pFrame_yuv->format;
+	struct tensorjob job;
+	uint64_t t0;
+	int c;
+
+	if(fmt != AV_PIX_FMT_YUV422P && fmt != AV_PIX_FMT_YUVJ422P &&
+		fmt != AV_PIX_FMT_YUV420P && fmt != AV_PIX_FMT_YUVJ420P && fmt != AV_PIX_FMT_RGB24)
+		return -1;
+	job.d = d;
+	job.dst_byte = dst_byte;
+	job.dst_float = dst_float;
+	job.stride = stride;
+	job.nbands = pool.nthreads;
+	t0 = stage_begin(d);
+	parallel_for(totensor_band, &job, job.nbands);
+
+	/* copy each channel from av_malloc to DMA_malloc */
+	if(dst_byte && fmt != AV_PIX_FMT_RGB24)
+		for (c = 0; c < 3; c++)
+			memcpy(dst_byte + c * stride[0],
+				   d->pFrame_intm->data[c],
+				   size[1] * size[2]);
+	stage_end(d, ST_CONVERT, t0);
 	return 0;
 }
 
+#ifdef DOVIDEOCAP
+// Convert a YUYV capture frame to the byte or float tensor
+static void yuyv_totensor(VIDEODEC *d, const char *frame, unsigned char *dst_byte, float *dst_float, long *stride)
+{
+	uint64_t t0 = stage_begin(d);
+
+	if(dst_byte)
+		yuyv2torchRGB((const unsigned char *)frame, dst_byte, stride[0], stride[1], d->frame_width, d->frame_height);
+	else yuyv2torchfloatRGB((const unsigned char *)frame, dst_float, stride[0], stride[1], d->frame_width, d->frame_height);
+	stage_end(d, ST_CONVERT, t0);
+}
+#endif
+
 /* This function decodes each frame on the fly. Frame is decoded and saved
  * into "pFrame_yuv" as yuv420p, then converted to planar RGB in
  * "pFrame_intm". Finally, memcpy copies all from "pFrame_intm" to
@@ -1233,17 +2265,21 @@ int ToTensor(unsigned char *dst_byte, float *dst_float, long *stride, long *size
  *    on Linux; it's supposed that the V4L2 device outputs frames in the YUVV format;
  *    not every webcam supports this format, but it's very common
  * 2) If rx_tid!=0, decoding occurs in another thread (started by startremux), so this
- *    routine only returns the last decoded frame
+ *    routine only returns the last decoded frame, optionally waiting for a new one
  */
 static int video_decoder_rgb(lua_State * L)
 {
-	AVPacket packet;
+	VIDEODEC *d = getdec(L);
 	int dim = 0;
 	long *stride = NULL;
 	long *size = NULL;
 	unsigned char *dst_byte = NULL;
 	float *dst_float = NULL;
+	int wait_new, timeout_ms;
 
+	if (lua_isnoneornil(L, 1))
+		return frame_view(L, d, 0);
+	getwaitoptions(L, 2, &wait_new, &timeout_ms);
 	const char *tname = luaT_typename(L, 1);
 	if (strcmp("torch.ByteTensor", tname) == 0) {
 		THByteTensor *frame =
@@ -1274,369 +2310,1113 @@ static int video_decoder_rgb(lua_State * L)
 	}
 
 #ifdef DOVIDEOCAP
-	if(vcap)
+	if(d->vcap)
 	{
-		if(rx_tid)
+		if(d->rx_tid)
 		{
-			// Wait for the first frame to be decoded
-			if(!frame_decoded)
-			{
-				while(rx_tid && !frame_decoded)
-					usleep(10000);
-			}
-			// pFrame_yuv should not be read while it's being written, so lock a mutex
-			pthread_mutex_lock(&readmutex);
-			if(!frame_decoded)
+			// Get the newest frame, the receiving thread will not write it while we read it
+			unsigned long seq = rx_getframe(d, wait_new, timeout_ms);
+			if(!seq)
 			{
-				pthread_mutex_unlock(&readmutex);
 				lua_pushboolean(L, 0);
 				return 1;
 			}
+			d->vcap_last = d->tb.vcap[d->tb.front];
 			// Convert image from YUYV to RGB torch tensor
-			if(dst_byte)
-				yuyv2torchRGB((unsigned char *)vcap_frame, dst_byte, stride[0], stride[1], frame_width, frame_height);
-			else yuyv2torchfloatRGB((unsigned char *)vcap_frame, dst_float, stride[0], stride[1], frame_width, frame_height);
-			pthread_mutex_unlock(&readmutex);
+			yuyv_totensor(d, d->tb.vcap[d->tb.front], dst_byte, dst_float, stride);
 			lua_pushboolean(L, 1);
-			return 1;
+			lua_pushnil(L);
+			lua_pushnumber(L, seq);
+			return 3;
 		}
 		char *frame;
 		struct timeval tv;
 
 		// Get the frame from the V4L2 device using our videocap library
-		int rc = videocap_getframe(vcap, &frame, &tv);
+		int rc = videocap_getframe(d->vcap, &frame, &tv);
 		if(rc < 0)
 		{
 			luaL_error(L, "videocap_getframe returned error %d", rc);
 		}
+		d->vcap_last = frame;
 		// Convert image from YUYV to RGB torch tensor
-		if(dst_byte)
-			yuyv2torchRGB((unsigned char *)frame, dst_byte, stride[0], stride[1], frame_width, frame_height);
-		else yuyv2torchfloatRGB((unsigned char *)frame, dst_float, stride[0], stride[1], frame_width, frame_height);
+		yuyv_totensor(d, frame, dst_byte, dst_float, stride);
 		lua_pushboolean(L, 1);
 		return 1;
 	}
 #endif
-	if(rx_tid)
+	if(d->rx_tid)
 	{
-		// Wait for the first frame to be decoded
-		if(!frame_decoded)
+		// Get the newest frame, the receiving thread will not write it while we read it
+		unsigned long seq = rx_getframe(d, wait_new, timeout_ms);
+		if(!seq)
 		{
-			while(rx_tid && !frame_decoded)
-				usleep(10000);
-		}
-		// pFrame_yuv should not be read while it's being written, so lock a mutex
-		pthread_mutex_lock(&readmutex);
-		if(!frame_decoded)
-		{
-			pthread_mutex_unlock(&readmutex);
 			lua_pushboolean(L, 0);
 			return 1;
 		}
 		// Convert from YUV to RGB
-		if(ToTensor(dst_byte, dst_float, stride, size))
-			luaL_error(L, "<video_decoder>: unsupported codec pixel format %d", pCodecCtx->pix_fmt);
-		pthread_mutex_unlock(&readmutex);
+		if(ToTensor(d, dst_byte, dst_float, stride, size))
+			luaL_error(L, "<video_decoder>: unsupported codec pixel format %d", d->pFrame_yuv->format);
+		int64_t pts = av_frame_get_best_effort_timestamp(d->pFrame_yuv);
 
 		lua_pushboolean(L, 1);
+		push_pts(L, d, pts);
+		lua_pushnumber(L, seq);
+		return 3;
+	}
+	if(!d->pFormatCtx && !d->jpeg.data)
+		luaL_error(L, "Call init first\n");
+	int rc = get_next_frame(d, d->pFrame_yuv);
+	if(rc <= 0)
+		return push_eos(L, rc);
+	if(ToTensor(d, dst_byte, dst_float, stride, size))
+		luaL_error(L, "<video_decoder>: unsupported codec pixel format %d", d->pFrame_yuv->format);
+	lua_pushboolean(L, 1);
+	if(!d->pFormatCtx)
+	{
+		// MJPEG
+		THByteTensor *t = THByteTensor_newWithSize1d(d->jpeg.datalen);
+		unsigned char *data = THByteTensor_data(t);
+		memcpy(data, d->jpeg.data, d->jpeg.datalen);
+		luaT_pushudata(L, t, "torch.ByteTensor");
+		lua_pushstring(L, d->jpeg.filename);
+		return 3;
+	}
+	push_pts(L, d, av_frame_get_best_effort_timestamp(d->pFrame_yuv));
+	return 2;
+}
+
+/* Decode the received JPEG with the libjpeg DCT scaling to the smallest image not smaller
+ * than jpeg.minw x jpeg.minh, which costs up to 64 times less than decoding it at full size
+ * for 1/8; returns 0 if the image cannot be reduced or libjpeg fails, so that libavcodec
+ * decodes it as usual
+ */
+static int decode_jpeg_scaled(VIDEODEC *d, AVFrame *frame)
+{
+	uint64_t t0;
+	int w, h, denom;
+
+	if(jpeg_decode_scaled(d->jpeg.data, d->jpeg.datalen, 1, 0, 0, &w, &h))
+		return 0;
+	for(denom = 8; denom > 1; denom /= 2)
+		if((w + denom - 1) / denom >= d->jpeg.minw && (h + denom - 1) / denom >= d->jpeg.minh)
+			break;
+	if(denom == 1)
+		return 0;
+	av_frame_unref(frame);
+	frame->format = AV_PIX_FMT_YUVJ420P;
+	frame->width = (w + denom - 1) / denom;
+	frame->height = (h + denom - 1) / denom;
+	if(av_frame_get_buffer(frame, 32) < 0)
+		return 0;
+	t0 = stage_begin(d);
+	if(jpeg_decode_scaled(d->jpeg.data, d->jpeg.datalen, denom, frame->data, frame->linesize, &w, &h) ||
+		w != frame->width || h != frame->height)
+	{
+		av_frame_unref(frame);
+		return 0;
+	}
+	stage_end(d, ST_DECODE, t0);
+	STATS_ADD(d, frames_decoded, 1);
+	frame->key_frame = 1;
+	frame->pict_type = AV_PICTURE_TYPE_I;
+	return 1;
+}
+
+int read_next_frame(VIDEODEC *d, AVFrame *frame_yuv)
+{
+	AVPacket packet;
+	int rc;
+
+	// The frame reached by seek was already decoded
+	if(d->seek_pending)
+	{
+		av_frame_unref(frame_yuv);
+		av_frame_move_ref(frame_yuv, d->seekframe);
+		d->seek_pending = 0;
+		d->frame_decoded = 1;
 		return 1;
 	}
+	memset(&packet, 0, sizeof(packet));
 	for(;;)
 	{
-		if(!pFormatCtx && !jpeg.data)
-			luaL_error(L, "Call init first\n");
-		if(!stream_ended)
+		if(!d->stream_ended)
 		{
-			int moredata = (pFormatCtx && av_read_frame(pFormatCtx, &packet) >= 0) ||
-				(!pFormatCtx && !mpjpeg_getdata(&jpeg.data, &jpeg.datalen, jpeg.filename, sizeof(jpeg.filename)));
+			int moredata;
+			uint64_t t0 = stage_begin(d);
+
+			if(d->pFormatCtx)
+			{
+				rc = av_read_frame(d->pFormatCtx, &packet);
+				if(rc < 0 && rc != AVERROR_EOF)
+					d->read_error = rc;
+				moredata = rc >= 0;
+			} else moredata = !mpjpeg_getdata(d->mpjpeg, &d->jpeg.data, &d->jpeg.datalen, d->jpeg.filename, sizeof(d->jpeg.filename));
+			stage_end(d, ST_DEMUX, t0);
 			if(!moredata)
-				stream_ended = 1;
+				d->stream_ended = 1;
 		}
-		if(!pFormatCtx)
+		if(!d->pFormatCtx)
 		{
 			// We are getting data from mpjpeg here, not avformat
+			if(!d->stream_ended && d->jpeg.minw && decode_jpeg_scaled(d, frame_yuv))
+			{
+				d->frame_decoded = 1;
+				return 1;
+			}
 			memset(&packet, 0, sizeof(packet));
 			av_init_packet(&packet);
-			packet.data = (unsigned char *)jpeg.data;
-			packet.size = jpeg.datalen;
+			packet.data = (unsigned char *)d->jpeg.data;
+			packet.size = d->jpeg.datalen;
 			packet.flags = AV_PKT_FLAG_KEY;
-			packet.stream_index = stream_idx;
-			pFrame_yuv = avcodec_alloc_frame();
+			packet.stream_index = d->stream_idx;
+		}
+		/* in keyframes-only mode, the other packets are not even given to the decoder */
+		if(!d->stream_ended && d->decode_mode == DECODE_KEYFRAMES && !(packet.flags & AV_PKT_FLAG_KEY))
+		{
+			av_free_packet(&packet);
+			continue;
 		}
 		/* is this a packet from the video stream? */
-		if (stream_ended || packet.stream_index == stream_idx) {
-
+		if(d->stream_ended || packet.stream_index == d->stream_idx)
+		{
 			/* decode video frame */
-			if(stream_ended)
+			if(d->stream_ended)
 			{
 				memset(&packet, 0, sizeof(packet));
-				packet.stream_index = stream_idx;
+				packet.stream_index = d->stream_idx;
 			}
-			avcodec_decode_video2(pCodecCtx, pFrame_yuv, &frame_decoded, &packet);
-			/* check if frame is decoded */
-			if (frame_decoded) {
-
-				if(ToTensor(dst_byte, dst_float, stride, size))
-					luaL_error(L, "<video_decoder>: unsupported codec pixel format %d", pCodecCtx->pix_fmt);
-				if(!stream_ended)
-					av_free_packet(&packet);
-				lua_pushboolean(L, 1);
-				if(!pFormatCtx)
-				{
-					// MJPEG
-					THByteTensor *t = THByteTensor_newWithSize1d(jpeg.datalen);
-					unsigned char *data = THByteTensor_data(t);
-					memcpy(data, jpeg.data, jpeg.datalen);
-					luaT_pushudata(L, t, "torch.ByteTensor");
-					lua_pushstring(L, jpeg.filename);
-					return 3;
-				}
+			decode_video(d, frame_yuv, &d->frame_decoded, &packet);
+			av_free_packet(&packet);
+			if(d->frame_decoded)
 				return 1;
-			} else if(stream_ended)
+			else if(d->stream_ended)
+				return 0;
+		}
+	}
+}
+
+/***************************************
+Prefetch decoding thread
+***************************************/
+
+/* When init is called with the prefetch option, this thread decodes the frames in
+ * advance in a ring of refcounted frames and frame_* only take them from the ring,
+ * so that demuxing and decoding overlap with the processing done by the caller;
+ * the end of the stream or the error is queued after the last decoded frame
+ */
+static void *prefetch_thread(void *arg)
+{
+	VIDEODEC *d = (VIDEODEC *)arg;
+	AVFrame *frame;
+	int rc;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&d->prefetch.mutex);
+		while(d->prefetch.active && d->prefetch.count == d->prefetch.size)
+			pthread_cond_wait(&d->prefetch.cond, &d->prefetch.mutex);
+		if(!d->prefetch.active)
+		{
+			pthread_mutex_unlock(&d->prefetch.mutex);
+			break;
+		}
+		frame = d->prefetch.ring[(d->prefetch.head + d->prefetch.count) % d->prefetch.size];
+		pthread_mutex_unlock(&d->prefetch.mutex);
+		// The slot is not seen by the consumer until count is incremented
+		rc = read_mode_frame(d, frame);
+		pthread_mutex_lock(&d->prefetch.mutex);
+		if(rc)
+			d->prefetch.count++;
+		else d->prefetch.status = d->read_error ? d->read_error : 1;
+		pthread_cond_broadcast(&d->prefetch.cond);
+		pthread_mutex_unlock(&d->prefetch.mutex);
+		if(!rc)
+			break;
+	}
+	return 0;
+}
+
+// Start the prefetch thread with a ring of n frames
+static int prefetch_start(VIDEODEC *d, int n)
+{
+	int i;
+
+	d->prefetch.ring = (AVFrame **)calloc(n, sizeof(AVFrame *));
+	for(i = 0; i < n; i++)
+		d->prefetch.ring[i] = av_frame_alloc();
+	d->prefetch.size = n;
+	d->prefetch.head = d->prefetch.count = d->prefetch.status = 0;
+	d->prefetch.active = 1;
+	if(pthread_create(&d->prefetch.tid, 0, prefetch_thread, d))
+	{
+		for(i = 0; i < n; i++)
+			av_frame_free(&d->prefetch.ring[i]);
+		free(d->prefetch.ring);
+		d->prefetch.ring = 0;
+		d->prefetch.size = 0;
+		return -1;
+	}
+	return 0;
+}
+
+// Stop the prefetch thread and release the frames of the ring
+static void prefetch_stop(VIDEODEC *d)
+{
+	int i;
+
+	if(!d->prefetch.size)
+		return;
+	pthread_mutex_lock(&d->prefetch.mutex);
+	d->prefetch.active = 0;
+	pthread_cond_broadcast(&d->prefetch.cond);
+	pthread_mutex_unlock(&d->prefetch.mutex);
+	pthread_join(d->prefetch.tid, 0);
+	for(i = 0; i < d->prefetch.size; i++)
+		av_frame_free(&d->prefetch.ring[i]);
+	free(d->prefetch.ring);
+	d->prefetch.ring = 0;
+	d->prefetch.size = 0;
+}
+
+// Move the next frame of the ring to frame, waiting for it if necessary
+// Returns 1 if a frame was got, 0 at the end of the stream or the libav error
+static int prefetch_pop(VIDEODEC *d, AVFrame *frame)
+{
+	int rc = 1;
+
+	pthread_mutex_lock(&d->prefetch.mutex);
+	while(!d->prefetch.count && !d->prefetch.status)
+		pthread_cond_wait(&d->prefetch.cond, &d->prefetch.mutex);
+	if(d->prefetch.count)
+	{
+		av_frame_unref(frame);
+		av_frame_move_ref(frame, d->prefetch.ring[d->prefetch.head]);
+		d->prefetch.head = (d->prefetch.head + 1) % d->prefetch.size;
+		d->prefetch.count--;
+		pthread_cond_broadcast(&d->prefetch.cond);
+	} else rc = d->prefetch.status == 1 ? 0 : d->prefetch.status;
+	pthread_mutex_unlock(&d->prefetch.mutex);
+	return rc;
+}
+
+// Get the next decoded frame, from the prefetch ring if enabled
+// Returns 1 if a frame was got, 0 at the end of the stream or a libav error
+int get_next_frame(VIDEODEC *d, AVFrame *frame)
+{
+	if(d->prefetch.size)
+		return prefetch_pop(d, frame);
+	return read_mode_frame(d, frame);
+}
+
+/***************************************
+PTS index and seek
+***************************************/
+
+/* The index contains the PTS of all the frames and of the keyframes of the video stream;
+ * it's built by reading all the packets (without decoding them) the first time a file
+ * is opened and then it's cached in a sidecar file, which is valid as long as the size
+ * and the modification time of the video file do not change
+ */
+struct indexheader {
+	char magic[4];
+	int version;
+	int64_t filesize, mtime;
+	int stream_idx, nframes, nkeys;
+};
+
+#define INDEXVERSION 1
+
+static int cmp_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Return the position of the first element of the sorted array v not less than x, n if none
+static int lower_bound64(const int64_t *v, int n, int64_t x)
+{
+	int lo = 0, hi = n, mid;
+
+	while(lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if(v[mid] < x)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static void index_free(VIDEODEC *d)
+{
+	free(d->index.pts);
+	free(d->index.keypts);
+	memset(&d->index, 0, sizeof(d->index));
+}
+
+static int index_load(VIDEODEC *d, const char *sidecar, const struct stat *st)
+{
+	struct indexheader h;
+	FILE *fp = fopen(sidecar, "rb");
+
+	if(!fp)
+		return -1;
+	if(fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, "VIDX", 4) || h.version != INDEXVERSION ||
+		h.filesize != st->st_size || h.mtime != st->st_mtime || h.stream_idx != d->stream_idx ||
+		h.nframes <= 0 || h.nkeys <= 0)
+	{
+		fclose(fp);
+		return -1;
+	}
+	d->index.pts = (int64_t *)malloc(h.nframes * sizeof(int64_t));
+	d->index.keypts = (int64_t *)malloc(h.nkeys * sizeof(int64_t));
+	d->index.nframes = h.nframes;
+	d->index.nkeys = h.nkeys;
+	if(fread(d->index.pts, sizeof(int64_t), h.nframes, fp) != h.nframes ||
+		fread(d->index.keypts, sizeof(int64_t), h.nkeys, fp) != h.nkeys)
+	{
+		index_free(d);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void index_save(VIDEODEC *d, const char *sidecar, const struct stat *st)
+{
+	struct indexheader h;
+	FILE *fp = fopen(sidecar, "wb");
+
+	if(!fp)
+	{
+		if(loglevel >= 1)
+			fprintf(stderr, "Cannot create the index file %s\n", sidecar);
+		return;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "VIDX", 4);
+	h.version = INDEXVERSION;
+	h.filesize = st->st_size;
+	h.mtime = st->st_mtime;
+	h.stream_idx = d->stream_idx;
+	h.nframes = d->index.nframes;
+	h.nkeys = d->index.nkeys;
+	if(fwrite(&h, sizeof(h), 1, fp) != 1 ||
+		fwrite(d->index.pts, sizeof(int64_t), h.nframes, fp) != h.nframes ||
+		fwrite(d->index.keypts, sizeof(int64_t), h.nkeys, fp) != h.nkeys)
+	{
+		fclose(fp);
+		unlink(sidecar);
+		if(loglevel >= 1)
+			fprintf(stderr, "Error writing the index file %s\n", sidecar);
+		return;
+	}
+	fclose(fp);
+}
+
+// Read all the packets of the video stream and collect their PTS, then rewind
+static int index_build(VIDEODEC *d)
+{
+	AVPacket pkt;
+	int64_t pts;
+	int size = 0, keysize = 0;
+
+	while(av_read_frame(d->pFormatCtx, &pkt) >= 0)
+	{
+		pts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+		if(pkt.stream_index == d->stream_idx && pts != AV_NOPTS_VALUE)
+		{
+			if(d->index.nframes == size)
 			{
-				lua_pushboolean(L, 0);
-				return 1;
+				size = size ? 2 * size : 1024;
+				d->index.pts = (int64_t *)realloc(d->index.pts, size * sizeof(int64_t));
+			}
+			d->index.pts[d->index.nframes++] = pts;
+			if(pkt.flags & AV_PKT_FLAG_KEY)
+			{
+				if(d->index.nkeys == keysize)
+				{
+					keysize = keysize ? 2 * keysize : 64;
+					d->index.keypts = (int64_t *)realloc(d->index.keypts, keysize * sizeof(int64_t));
+				}
+				d->index.keypts[d->index.nkeys++] = pts;
 			}
 		}
-		/* free the packet that was allocated by av_read_frame */
-		av_free_packet(&packet);
+		av_free_packet(&pkt);
+	}
+	if(!d->index.nframes || !d->index.nkeys)
+	{
+		index_free(d);
+		return -1;
 	}
+	// Packets are in decoding order, frames are returned in presentation order
+	qsort(d->index.pts, d->index.nframes, sizeof(int64_t), cmp_int64);
+	qsort(d->index.keypts, d->index.nkeys, sizeof(int64_t), cmp_int64);
+	return av_seek_frame(d->pFormatCtx, d->stream_idx, d->index.keypts[0], AVSEEK_FLAG_BACKWARD) < 0 ? -1 : 0;
+}
 
-	lua_pushboolean(L, 0);
-	return 1;
+// Load the index of the file fpath from sidecar or build it and save it there
+static int index_open(VIDEODEC *d, const char *fpath, const char *sidecar)
+{
+	struct stat st;
+
+	// Only regular files can be indexed
+	if(stat(fpath, &st) || !S_ISREG(st.st_mode))
+		return -1;
+	if(!index_load(d, sidecar, &st))
+	{
+		if(loglevel >= 3)
+			fprintf(stderr, "Loaded index %s, %d frames, %d keyframes\n", sidecar, d->index.nframes, d->index.nkeys);
+		return 0;
+	}
+	if(index_build(d))
+		return -1;
+	if(loglevel >= 3)
+		fprintf(stderr, "Built index %s, %d frames, %d keyframes\n", sidecar, d->index.nframes, d->index.nkeys);
+	index_save(d, sidecar, &st);
+	return 0;
 }
 
-int read_next_frame(AVFrame *frame_yuv)
+// Seek to the last keyframe not after pts and decode up to the first frame with PTS >= pts,
+// which will be returned by the next read; returns 1 if found, 0 at the end of the stream
+// or the libav error
+static int seek_pts(VIDEODEC *d, int64_t pts)
 {
-	AVPacket packet;
+	int64_t keypts = pts, framepts;
+	int i, rc;
 
-	memset(&packet, 0, sizeof(packet));
+	if(d->index.nkeys)
+	{
+		i = lower_bound64(d->index.keypts, d->index.nkeys, pts + 1) - 1;
+		keypts = d->index.keypts[i < 0 ? 0 : i];
+	}
+	rc = av_seek_frame(d->pFormatCtx, d->stream_idx, keypts, AVSEEK_FLAG_BACKWARD);
+	if(rc < 0)
+		return rc;
+	avcodec_flush_buffers(d->pCodecCtx);
+	d->stream_ended = 0;
+	d->read_error = 0;
+	d->seek_pending = 0;
+	d->decode_count = 0;
+	d->decode_nextpts = AV_NOPTS_VALUE;
+	if(!d->seekframe)
+		d->seekframe = av_frame_alloc();
 	for(;;)
 	{
-		if(!stream_ended)
+		if(!read_next_frame(d, d->seekframe))
 		{
-			int moredata = (pFormatCtx && av_read_frame(pFormatCtx, &packet) >= 0) ||
-				(!pFormatCtx && !mpjpeg_getdata(&jpeg.data, &jpeg.datalen, jpeg.filename, sizeof(jpeg.filename)));
-			if(!moredata)
-				stream_ended = 1;
+			av_frame_unref(d->seekframe);
+			return d->read_error;
 		}
-		if(!pFormatCtx)
+		framepts = av_frame_get_best_effort_timestamp(d->seekframe);
+		if(framepts == AV_NOPTS_VALUE || framepts >= pts)
+			break;
+	}
+	d->seek_pending = 1;
+	return 1;
+}
+
+/* Read the next frame to return according to the decode mode; in every-Nth mode the
+ * frames in between have to be decoded, because the next ones depend on them, but if
+ * the index is available and there is a keyframe before the next frame to return,
+ * the packets up to that keyframe are skipped by seeking
+ */
+static int read_mode_frame(VIDEODEC *d, AVFrame *frame)
+{
+	int64_t pts;
+	int i, k, rc;
+
+	if(d->decode_mode != DECODE_EVERYNTH)
+		return read_next_frame(d, frame);
+	if(d->decode_nextpts != AV_NOPTS_VALUE)
+	{
+		rc = seek_pts(d, d->decode_nextpts);
+		if(rc <= 0)
 		{
-			// We are getting data from mpjpeg here, not avformat
-			memset(&packet, 0, sizeof(packet));
-			av_init_packet(&packet);
-			packet.data = (unsigned char *)jpeg.data;
-			packet.size = jpeg.datalen;
-			packet.flags = AV_PKT_FLAG_KEY;
-			packet.stream_index = stream_idx;
+			if(rc < 0)
+				d->read_error = rc;
+			return 0;
 		}
-		/* is this a packet from the video stream? */
-		if(stream_ended || packet.stream_index == stream_idx)
+	}
+	for(;;)
+	{
+		rc = read_next_frame(d, frame);
+		if(rc <= 0)
+			return rc;
+		pts = av_frame_get_best_effort_timestamp(frame);
+		if(!d->index.nframes || pts == AV_NOPTS_VALUE)
 		{
-			/* decode video frame */
-			if(stream_ended)
-			{
-				memset(&packet, 0, sizeof(packet));
-				packet.stream_index = stream_idx;
-			}
-			avcodec_decode_video2(pCodecCtx, frame_yuv, &frame_decoded, &packet);
-			av_free_packet(&packet);
-			if(frame_decoded)
+			if(d->decode_count++ % d->decode_every == 0)
 				return 1;
-			else if(stream_ended)
-				return 0;
+			continue;
+		}
+		i = lower_bound64(d->index.pts, d->index.nframes, pts);
+		if(i % d->decode_every)
+			continue;
+		i += d->decode_every;
+		if(i < d->index.nframes)
+		{
+			k = lower_bound64(d->index.keypts, d->index.nkeys, d->index.pts[i] + 1) - 1;
+			if(k >= 0 && d->index.keypts[k] > pts)
+				d->decode_nextpts = d->index.pts[i];
 		}
+		return 1;
 	}
 }
 
-void SetRescaler(int w, int h)
+// Push the PTS in seconds, nil if unknown
+static void push_pts(lua_State *L, VIDEODEC *d, int64_t pts)
 {
-	if(sws_w == w && sws_h == h)
+	AVRational tb;
+
+	if(!d->pFormatCtx || pts == AV_NOPTS_VALUE)
+	{
+		lua_pushnil(L);
 		return;
-	if(sws_ctx)
+	}
+	tb = d->pFormatCtx->streams[d->stream_idx]->time_base;
+	lua_pushnumber(L, pts * (double)tb.num / tb.den);
+}
+
+// Free pFrame_yuv and the batch frames
+static void free_frames(VIDEODEC *d)
+{
+	int i;
+
+	if(d->pCodecCtx && d->pCodecCtx->refcounted_frames)
+		av_frame_unref(d->pFrame_yuv);
+	av_free(d->pFrame_yuv);
+	for(i = 0; i < d->nbatchframes; i++)
+		av_frame_free(&d->batchframes[i]);
+	free(d->batchframes);
+	d->batchframes = 0;
+	d->nbatchframes = d->nbuffered_frames = 0;
+}
+
+// Keep src in dst: refcounted frames are simply moved, frames owned by the decoder
+// are copied to the buffers of dst, which are reused if they are still suitable
+static int frame_keep(AVFrame *dst, AVFrame *src, int refcounted)
+{
+	if(refcounted)
+	{
+		av_frame_unref(dst);
+		av_frame_move_ref(dst, src);
+		return 0;
+	}
+	if(!dst->buf[0] || dst->width != src->width || dst->height != src->height ||
+		dst->format != src->format || !av_frame_is_writable(dst))
+	{
+		av_frame_unref(dst);
+		dst->width = src->width;
+		dst->height = src->height;
+		dst->format = src->format;
+		if(av_frame_get_buffer(dst, 32) < 0)
+			return -1;
+	}
+	if(av_frame_copy(dst, src) < 0)
+		return -1;
+	return av_frame_copy_props(dst, src);
+}
+
+// Return false and, if rc is a libav error, its description
+static int push_eos(lua_State *L, int rc)
+{
+	char errbuf[100];
+
+	lua_pushboolean(L, 0);
+	if(rc >= 0)
+		return 1;
+	av_strerror(rc, errbuf, sizeof(errbuf));
+	lua_pushstring(L, errbuf);
+	return 2;
+}
+
+/***************************************
+Zero-copy tensor views
+***************************************/
+
+/* frame_rgb and frame_yuv called without a tensor return ByteTensors whose storage is
+ * the buffer of the decoded frame; every storage holds its own reference to the frame,
+ * released when the storage is freed by Torch, so no copy is ever done
+ */
+static void *frameview_malloc(void *ctx, ptrdiff_t size)
+{
+	return 0;
+}
+
+static void *frameview_realloc(void *ctx, void *ptr, ptrdiff_t size)
+{
+	return 0;
+}
+
+static void frameview_free(void *ctx, void *ptr)
+{
+	AVFrame *frame = (AVFrame *)ctx;
+
+	av_frame_unref(frame);
+	av_frame_free(&frame);
+}
+
+static THAllocator frameview_allocator = {frameview_malloc, frameview_realloc, frameview_free};
+
+// Wrap plane c of frame, w x h pixels of bpp bytes each, in a storage with its own frame reference
+static THByteStorage *frameview_storage(AVFrame *frame, int c, int w, int h, int bpp)
+{
+	AVFrame *ref = av_frame_clone(frame);
+	THByteStorage *storage;
+
+	if(!ref)
+		return 0;
+	storage = THByteStorage_newWithDataAndAllocator(ref->data[c],
+		(ptrdiff_t)ref->linesize[c] * (h - 1) + w * bpp, &frameview_allocator, ref);
+	// The buffer belongs to libav and cannot be resized
+	storage->flag &= ~TH_STORAGE_RESIZABLE;
+	return storage;
+}
+
+// Push a (3, height, width) view of a RGB24 frame
+static int push_frameview_rgb(lua_State *L, AVFrame *frame)
+{
+	THByteStorage *storage = frameview_storage(frame, 0, frame->width, frame->height, 3);
+	THByteTensor *t;
+
+	if(!storage)
+		luaL_error(L, "<video_decoder>: out of memory");
+	t = THByteTensor_newWithStorage3d(storage, 0, 3, 1,
+		frame->height, frame->linesize[0], frame->width, 3);
+	THByteStorage_free(storage);
+	luaT_pushudata(L, t, "torch.ByteTensor");
+	return 1;
+}
+
+// Push the Y, U and V planes of a planar YUV frame as 2D views at their own resolution
+static int push_frameview_yuv(lua_State *L, AVFrame *frame, int hshift, int vshift)
+{
+	THByteStorage *storage;
+	THByteTensor *t;
+	int c, w, h;
+
+	for(c = 0; c < 3; c++)
 	{
-		sws_freeContext(sws_ctx);
-		free(sws_rgb);
+		w = c ? (frame->width + (1 << hshift) - 1) >> hshift : frame->width;
+		h = c ? (frame->height + (1 << vshift) - 1) >> vshift : frame->height;
+		storage = frameview_storage(frame, c, w, h, 1);
+		if(!storage)
+			luaL_error(L, "<video_decoder>: out of memory");
+		t = THByteTensor_newWithStorage2d(storage, 0, h, frame->linesize[c], w, 1);
+		THByteStorage_free(storage);
+		luaT_pushudata(L, t, "torch.ByteTensor");
 	}
-	sws_h = h;
-	sws_w = w;
+	return 3;
+}
+
+// Get the next frame and return true followed by its views: one (3, height, width)
+// RGB tensor for RGB24 streams if yuv is 0, otherwise the Y, U and V planes
+static int frame_view(lua_State *L, VIDEODEC *d, int yuv)
+{
+	enum AVPixelFormat fmt;
+	int hshift, vshift, rc;
+
+	if(!d->pCodecCtx)
+		luaL_error(L, "<video_decoder>: tensor views are only available for streams opened with init");
+	fmt = d->pCodecCtx->pix_fmt;
+	if(!yuv)
+	{
+		if(fmt != AV_PIX_FMT_RGB24)
+			luaL_error(L, "<video_decoder>: RGB tensor views need a RGB24 stream, pass a tensor to convert the frame");
+	} else if(fmt == AV_PIX_FMT_YUV420P || fmt == AV_PIX_FMT_YUVJ420P)
+		hshift = vshift = 1;
+	else if(fmt == AV_PIX_FMT_YUV422P || fmt == AV_PIX_FMT_YUVJ422P)
+	{
+		hshift = 1;
+		vshift = 0;
+	} else if(fmt == AV_PIX_FMT_YUV444P || fmt == AV_PIX_FMT_YUVJ444P)
+		hshift = vshift = 0;
+	else luaL_error(L, "<video_decoder>: YUV tensor views need a planar YUV stream, pixel format is %d", fmt);
+	if(d->rx_tid)
+	{
+		AVFrame *frame;
+		unsigned long seq;
+		int wait_new, timeout_ms;
+
+		// Take a reference to the last decoded frame, the receiving thread will decode in another buffer
+		getwaitoptions(L, 2, &wait_new, &timeout_ms);
+		seq = rx_getframe(d, wait_new, timeout_ms);
+		if(!seq)
+			return push_eos(L, 0);
+		frame = av_frame_clone(d->pFrame_yuv);
+		if(!frame)
+			luaL_error(L, "<video_decoder>: out of memory");
+		lua_pushboolean(L, 1);
+		rc = yuv ? push_frameview_yuv(L, frame, hshift, vshift) : push_frameview_rgb(L, frame);
+		push_pts(L, d, av_frame_get_best_effort_timestamp(frame));
+		lua_pushnumber(L, seq);
+		av_frame_free(&frame);
+		return rc + 3;
+	}
+	rc = get_next_frame(d, d->pFrame_yuv);
+	if(rc <= 0)
+		return push_eos(L, rc);
+	lua_pushboolean(L, 1);
+	rc = yuv ? push_frameview_yuv(L, d->pFrame_yuv, hshift, vshift) : push_frameview_rgb(L, d->pFrame_yuv);
+	push_pts(L, d, av_frame_get_best_effort_timestamp(d->pFrame_yuv));
+	return rc + 2;
+}
+
+// Create the rescalers for the first n workers, if they don't exist
+void SetRescalers(VIDEODEC *d, int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++)
+	{
+		if(d->sws_ctx[i])
+			continue;
 #ifdef DOVIDEOCAP
-	if(vcap)
-		sws_ctx = sws_getContext(frame_width, frame_height, AV_PIX_FMT_YUYV422, sws_w, sws_h, AV_PIX_FMT_RGB24, SWS_FAST_BILINEAR, 0, 0, 0);
-	else
+		if(d->vcap)
+			d->sws_ctx[i] = sws_getContext(d->frame_width, d->frame_height, AV_PIX_FMT_YUYV422, d->sws_w, d->sws_h, d->sws_fmt, SWS_FAST_BILINEAR, 0, 0, 0);
+		else
 #endif
-		sws_ctx = sws_getContext(pCodecCtx->width, pCodecCtx->height, pCodecCtx->pix_fmt, sws_w, sws_h, AV_PIX_FMT_RGB24, SWS_FAST_BILINEAR, 0, 0, 0);
-	sws_rgb = (uint8_t *)malloc((sws_w * 3 + 3) / 4 * 4 * sws_h + 3);	// +3 because of a bug in sws_scale? it writes more data than it should in (426x240)->(905x510)
+			d->sws_ctx[i] = sws_getContext(d->frame_width, d->frame_height, d->frame_fmt, d->sws_w, d->sws_h, d->sws_fmt, SWS_FAST_BILINEAR, 0, 0, 0);
+		// GBRP rescalers write to the tensor, they don't need the buffer
+		if(d->sws_fmt == AV_PIX_FMT_RGB24)
+			d->sws_rgb[i] = (uint8_t *)malloc((d->sws_w * 3 + 3) / 4 * 4 * d->sws_h + 3);	// +3 because of a bug in sws_scale? it writes more data than it should in (426x240)->(905x510)
+	}
 }
 
-// This routine resizes the fetched frame
-static int video_decoder_resized(lua_State * L)
+// Set the size and the output format (AV_PIX_FMT_RGB24 or AV_PIX_FMT_GBRP) of the rescalers
+void SetRescaler(VIDEODEC *d, int w, int h, enum AVPixelFormat fmt)
 {
-	int dim = 0;
+	if(d->sws_w != w || d->sws_h != h || d->sws_fmt != fmt)
+	{
+		FreeRescalers(d);
+		d->sws_h = h;
+		d->sws_w = w;
+		d->sws_fmt = fmt;
+	}
+	SetRescalers(d, 1);
+}
+
+// MJPEG images change size and format when they are decoded at reduced scale, so the
+// rescalers and lastframe_raw have to follow the last decoded image; the codec context
+// is left alone, libavcodec keeps its own size there; returns 1 if they changed
+static int mpjpeg_frameformat(VIDEODEC *d, AVFrame *frame)
+{
+	int w = d->sws_w, h = d->sws_h;
+
+	if(frame->width == d->frame_width && frame->height == d->frame_height && frame->format == d->frame_fmt)
+		return 0;
+	d->frame_width = frame->width;
+	d->frame_height = frame->height;
+	d->frame_fmt = frame->format;
+	FreeRescalers(d);
+	d->sws_w = w;
+	d->sws_h = h;
+	if(d->lastframe_raw)
+	{
+		free(d->lastframe_raw);
+		d->lastframe_raw = (uint8_t *)malloc(d->frame_width * d->frame_height * 3 / 2);
+	}
+	return 1;
+}
+
+static void scale_totensor(VIDEODEC *d, uint8_t *dst_byte, float *dst_float, long *stride, long *size, const float *norm, const char *frame, AVFrame *pFrame_yuv)
+{
+	uint64_t t0 = stage_begin(d);
+
+	if(dst_byte)
+		scale_tobyte(d, dst_byte, stride, frame, pFrame_yuv);
+	else if(norm)
+		scale_normalized(d, dst_float, stride, size, frame, pFrame_yuv, norm);
+	else scale_torgb(d, dst_float, stride, frame, pFrame_yuv);
+	stage_end(d, ST_RESCALE, t0);
+}
+
+// Resize the fetched frame to the tensor at index 1, normalizing it if norm is given;
+// byte tensors are written directly by the rescaler
+static int resized(lua_State * L, VIDEODEC *d, const float *norm)
+{
+	int rc, dim = 0, wait_new, timeout_ms;
 	long *stride = NULL;
 	long *size = NULL;
+	uint8_t *dst_byte = NULL;
 	float *dst_float = NULL;
-	THFloatTensor *t;
 
 	const char *tname = luaT_typename(L, 1);
-	if(strcmp("torch.FloatTensor", tname))
-		luaL_error(L, "<video_decoder>: cannot process tensor type %s", tname);
-	t = luaT_toudata(L, 1, luaT_typenameid(L, "torch.FloatTensor"));
-	dst_float = THFloatTensor_data(t);
-	dim = t->nDimension;
-	stride = &t->stride[0];
-	size = &t->size[0];
+	if(tname && !norm && !strcmp("torch.ByteTensor", tname))
+	{
+		THByteTensor *t = luaT_toudata(L, 1, luaT_typenameid(L, "torch.ByteTensor"));
+
+		dst_byte = THByteTensor_data(t);
+		dim = t->nDimension;
+		stride = &t->stride[0];
+		size = &t->size[0];
+	} else if(tname && !strcmp("torch.FloatTensor", tname))
+	{
+		THFloatTensor *t = luaT_toudata(L, 1, luaT_typenameid(L, "torch.FloatTensor"));
+
+		dst_float = THFloatTensor_data(t);
+		dim = t->nDimension;
+		stride = &t->stride[0];
+		size = &t->size[0];
+	} else luaL_error(L, "<video_decoder>: cannot process tensor type %s", tname);
+	getwaitoptions(L, 2, &wait_new, &timeout_ms);
 	if ((3 != dim) || (3 != size[0])) {
 		luaL_error(L, "<video_decoder>: cannot process tensor of this dimension and size");
 	}
+	if(dst_byte && stride[2] != 1)
+		luaL_error(L, "<video_decoder>: the rows of the byte tensor have to be contiguous");
 
-	if(!srvsk && jpeg_buf)
-	{
-		free(jpeg_buf);
-		jpeg_buf = 0;
-	}
-	SetRescaler(size[2], size[1]);
-	if(!lastframe_raw)
-		lastframe_raw = (uint8_t *)malloc((pCodecCtx ? pCodecCtx->width * pCodecCtx->height * 3 / 2 : frame_width * frame_height * 2));
+	SetRescaler(d, size[2], size[1], dst_byte ? AV_PIX_FMT_GBRP : AV_PIX_FMT_RGB24);
+	if(!d->lastframe_raw)
+		d->lastframe_raw = (uint8_t *)malloc((d->pCodecCtx ? d->frame_width * d->frame_height * 3 / 2 : d->frame_width * d->frame_height * 2));
 #ifdef DOVIDEOCAP
-	if(vcap)
+	if(d->vcap)
 	{
-		if(rx_tid)
+		if(d->rx_tid)
 		{
-			// Wait for the first frame to be decoded
-			if(!frame_decoded)
-			{
-				while(rx_tid && !frame_decoded)
-					usleep(10000);
-			}
-			// pFrame_yuv should not be read while it's being written, so lock a mutex
-			pthread_mutex_lock(&readmutex);
-			if(!frame_decoded)
+			// Get the newest frame, the receiving thread will not write it while we read it
+			unsigned long seq = rx_getframe(d, wait_new, timeout_ms);
+			if(!seq)
 			{
-				pthread_mutex_unlock(&readmutex);
 				lua_pushboolean(L, 0);
 				return 1;
 			}
-			scale_torgb(dst_float, stride, vcap_frame, 0);
-			pthread_mutex_unlock(&readmutex);
+			d->vcap_last = d->tb.vcap[d->tb.front];
+			scale_totensor(d, dst_byte, dst_float, stride, size, norm, d->tb.vcap[d->tb.front], 0);
 			lua_pushboolean(L, 1);
-			return 1;
+			lua_pushnil(L);
+			lua_pushnumber(L, seq);
+			return 3;
 		}
 		char *frame;
 		struct timeval tv;
 
 		// Get the frame from the V4L2 device using our videocap library
-		int rc = videocap_getframe(vcap, &frame, &tv);
+		int rc = videocap_getframe(d->vcap, &frame, &tv);
 		if(rc < 0)
 		{
 			luaL_error(L, "videocap_getframe returned error %d", rc);
 		}
+		d->vcap_last = frame;
 		// Convert image from YUYV to RGB torch tensor
-		scale_torgb(dst_float, stride, frame, 0);
+		scale_totensor(d, dst_byte, dst_float, stride, size, norm, frame, 0);
 		lua_pushboolean(L, 1);
 		return 1;
 	}
 #endif
-	if(rx_tid)
+	if(d->rx_tid)
 	{
-		// Wait for the first frame to be decoded
-		if(!frame_decoded)
-		{
-			while(rx_tid && !frame_decoded)
-				usleep(10000);
-		}
-		// pFrame_yuv should not be read while it's being written, so lock a mutex
-		pthread_mutex_lock(&readmutex);
-		if(!frame_decoded)
+		// Get the newest frame, the receiving thread will not write it while we read it
+		unsigned long seq = rx_getframe(d, wait_new, timeout_ms);
+		if(!seq)
 		{
-			pthread_mutex_unlock(&readmutex);
 			lua_pushboolean(L, 0);
 			return 1;
 		}
-		scale_torgb(dst_float, stride, 0, pFrame_yuv);
-		pthread_mutex_unlock(&readmutex);
+		scale_totensor(d, dst_byte, dst_float, stride, size, norm, 0, d->pFrame_yuv);
+		int64_t pts = av_frame_get_best_effort_timestamp(d->pFrame_yuv);
 
 		lua_pushboolean(L, 1);
-		return 1;
+		push_pts(L, d, pts);
+		lua_pushnumber(L, seq);
+		return 3;
 	}
-	if(read_next_frame(pFrame_yuv))
+	// MJPEG images much bigger than the tensor are decoded at reduced scale
+	if(d->mpjpeg && d->jpeg.dctscale)
 	{
-		scale_torgb(dst_float, stride, 0, pFrame_yuv);
+		d->jpeg.minw = size[2];
+		d->jpeg.minh = size[1];
+	}
+	rc = get_next_frame(d, d->pFrame_yuv);
+	d->jpeg.minw = d->jpeg.minh = 0;
+	if(rc > 0)
+	{
+		if(d->mpjpeg && mpjpeg_frameformat(d, d->pFrame_yuv))
+			SetRescalers(d, 1);
+		scale_totensor(d, dst_byte, dst_float, stride, size, norm, 0, d->pFrame_yuv);
 		lua_pushboolean(L, 1);
-		if(!pFormatCtx)
+		if(!d->pFormatCtx)
 		{
 			// MJPEG
-			THByteTensor *t = THByteTensor_newWithSize1d(jpeg.datalen);
+			THByteTensor *t = THByteTensor_newWithSize1d(d->jpeg.datalen);
 			unsigned char *data = THByteTensor_data(t);
-			memcpy(data, jpeg.data, jpeg.datalen);
+			memcpy(data, d->jpeg.data, d->jpeg.datalen);
 			luaT_pushudata(L, t, "torch.ByteTensor");
-			lua_pushstring(L, jpeg.filename);
+			lua_pushstring(L, d->jpeg.filename);
 			return 3;
 		}
-		return 1;
+		push_pts(L, d, av_frame_get_best_effort_timestamp(d->pFrame_yuv));
+		return 2;
 	}
-	lua_pushboolean(L, 0);
-	return 1;
+	return push_eos(L, rc);
+}
+
+// This routine resizes the fetched frame
+static int video_decoder_resized(lua_State * L)
+{
+	VIDEODEC *d = getdec(L);
+
+	return resized(L, d, 0);
+}
+
+// Get mean or std as a number or a table of three numbers
+static void getrgb(lua_State *L, int idx, float *rgb)
+{
+	int c;
+
+	if(lua_istable(L, idx))
+		for(c = 0; c < 3; c++)
+		{
+			lua_rawgeti(L, idx, c + 1);
+			rgb[c] = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+	else if(lua_isnumber(L, idx))
+		rgb[0] = rgb[1] = rgb[2] = lua_tonumber(L, idx);
+	else luaL_error(L, "<video_decoder>: mean and std have to be numbers or tables of three numbers");
 }
 
-// This routine takes a batch of frames and resizes them
+// Resize the fetched frame subtracting mean and dividing by std in the same pass
+static int video_decoder_resized_normalized(lua_State * L)
+{
+	VIDEODEC *d = getdec(L);
+	float mean[3], std[3], norm[6];
+	int c;
+
+	getrgb(L, 2, mean);
+	getrgb(L, 3, std);
+	for(c = 0; c < 3; c++)
+	{
+		if(std[c] == 0)
+			luaL_error(L, "<video_decoder>: std cannot be 0");
+		norm[c] = 1 / (255 * std[c]);
+		norm[c+3] = -mean[c] / std[c];
+	}
+	// Move the options to the position where resized expects them
+	lua_settop(L, 4);
+	lua_replace(L, 2);
+	lua_settop(L, 2);
+	return resized(L, d, norm);
+}
+
+// This routine takes a batch of frames and resizes them to a float or byte tensor
 static int video_decoder_batch_resized(lua_State * L)
 {
+	VIDEODEC *d = getdec(L);
 	int batch = lua_tonumber(L, 1);
 	int w = lua_tonumber(L, 2);
 	int h = lua_tonumber(L, 3);
 	int take = lua_toboolean(L, 4);
-	int i;
+	int isbyte = 0, n, i, j;
 
+	if(lua_istable(L, 5))
+	{
+		lua_getfield(L, 5, "type");
+		if(lua_isstring(L, -1))
+		{
+			if(!strcmp(lua_tostring(L, -1), "byte"))
+				isbyte = 1;
+			else if(strcmp(lua_tostring(L, -1), "float"))
+				luaL_error(L, "<video_decoder>: type has to be byte or float");
+		}
+		lua_pop(L, 1);
+	}
 	if(loglevel >= 5)
 		fprintf(stderr, "frame_batch_resized(%d,%d,%d,%d)\n", batch, w, h, take);
-	if(batch < 1 || batch > 32)
-		luaL_error(L, "batch size can be between 1 and 32");
-	THFloatTensor *t;
-	if(take)
-		t = THFloatTensor_newWithSize4d(batch, 3, h, w);
-	else t = THFloatTensor_newWithSize4d(nbuffered_frames, 3, h, w);
-	float *dst_float = THFloatTensor_data(t);
-	long *stride = &t->stride[0];
-	SetRescaler(w, h);
+	if(batch < 1)
+		luaL_error(L, "batch size has to be at least 1");
+	THByteTensor *tb = 0;
+	THFloatTensor *tf = 0;
+	uint8_t *dst_byte = 0;
+	float *dst_float = 0;
+	long *stride;
+	n = take ? batch : d->nbuffered_frames;
+	if(isbyte)
+	{
+		tb = THByteTensor_newWithSize4d(n, 3, h, w);
+		dst_byte = THByteTensor_data(tb);
+		stride = &tb->stride[0];
+	} else {
+		tf = THFloatTensor_newWithSize4d(n, 3, h, w);
+		dst_float = THFloatTensor_data(tf);
+		stride = &tf->stride[0];
+	}
 	if(take)
 	{
-		if(pFrame_yuv)
-			av_free(pFrame_yuv);
-		pFrame_yuv = av_mallocz(sizeof(AVFrame) * batch);
-		for(i = 0; i < batch; i++)
+		if(batch > d->nbatchframes)
 		{
-			avcodec_get_frame_defaults(pFrame_yuv + i);
-			if(!read_next_frame(pFrame_yuv + i))
-				break;
-			scale_torgb(dst_float + stride[0] * i, stride+1, 0, pFrame_yuv + i);
+			d->batchframes = (AVFrame **)realloc(d->batchframes, batch * sizeof(AVFrame *));
+			for(i = d->nbatchframes; i < batch; i++)
+				d->batchframes[i] = av_frame_alloc();
+			d->nbatchframes = batch;
 		}
-	} else {
-		for(i = 0; i < nbuffered_frames; i++)
-			scale_torgb(dst_float + stride[0] * i, stride+1, 0, pFrame_yuv + i);
-	}
-	nbuffered_frames = i;
+		// Keep a reference to every frame, so that they are still valid after
+		// decoding the next ones and they can be converted all together
+		for(i = 0; i < batch; i++)
+			if(get_next_frame(d, d->pFrame_yuv) <= 0 ||
+				frame_keep(d->batchframes[i], d->pFrame_yuv, d->pCodecCtx->refcounted_frames))
+				break;
+	} else i = d->nbuffered_frames;
+	if(d->mpjpeg && i)
+		mpjpeg_frameformat(d, d->batchframes[i - 1]);
+	// Frames are converted in parallel, every worker with its own rescaler
+	SetRescaler(d, w, h, isbyte ? AV_PIX_FMT_GBRP : AV_PIX_FMT_RGB24);
+	SetRescalers(d, pool.nthreads);
+	scale_torgb_batch(d, dst_byte, dst_float, stride, d->batchframes, i);
+	d->nbuffered_frames = i;
 	if(i == 0)
 	{
+		if(tb)
+			THByteTensor_free(tb);
+		else THFloatTensor_free(tf);
 		lua_pushnil(L);
 		return 1;
 	}
-	if(i < batch)
-		t = THFloatTensor_newNarrow(t, 0, 0, i);
-	luaT_pushudata(L, t, "torch.FloatTensor");
-	return 1;
+	if(tb)
+	{
+		if(i < n)
+		{
+			THByteTensor *narrow = THByteTensor_newNarrow(tb, 0, 0, i);
+
+			THByteTensor_free(tb);
+			tb = narrow;
+		}
+		luaT_pushudata(L, tb, "torch.ByteTensor");
+	} else {
+		if(i < n)
+		{
+			THFloatTensor *narrow = THFloatTensor_newNarrow(tf, 0, 0, i);
+
+			THFloatTensor_free(tf);
+			tf = narrow;
+		}
+		luaT_pushudata(L, tf, "torch.FloatTensor");
+	}
+	lua_createtable(L, i, 0);
+	for(j = 0; j < i; j++)
+	{
+		push_pts(L, d, av_frame_get_best_effort_timestamp(d->batchframes[j]));
+		lua_rawseti(L, -2, j + 1);
+	}
+	return 2;
 }
 
 // This routine only supports regular libav frames, no vcap, no startremux thread
 static int video_decoder_yuv(lua_State * L)
 {
-	AVPacket packet;
+	VIDEODEC *d = getdec(L);
 	int c;
 	int dim = 0;
 	long *stride = NULL;
 	long *size = NULL;
 	unsigned char *dst_byte = NULL;
 
+	if (lua_isnoneornil(L, 1))
+		return frame_view(L, d, 1);
 	const char *tname = luaT_typename(L, 1);
 	if (strcmp("torch.ByteTensor", tname) == 0) {
 		THByteTensor *frame =
@@ -1656,49 +3436,70 @@ static int video_decoder_yuv(lua_State * L)
 		luaL_error(L, "<video_decoder>: cannot process tensor of this dimension and size");
 	}
 
-	/* read frames and save first five frames to disk */
-	while (av_read_frame(pFormatCtx, &packet) >= 0) {
-
-		/* is this a packet from the video stream? */
-		if (packet.stream_index == stream_idx) {
-
-			/* decode video frame */
-			avcodec_decode_video2(pCodecCtx, pFrame_yuv, &frame_decoded, &packet);
+	if(!d->pFormatCtx && !d->jpeg.data)
+		luaL_error(L, "Call init first\n");
+	int rc = get_next_frame(d, d->pFrame_yuv);
+	if(rc <= 0)
+		return push_eos(L, rc);
 
-			/* check if frame is decoded */
-			if (frame_decoded) {
+	/* convert YUV420p to planar YUV */
+	video_decoder_yuv420p_yuvp(d->pFrame_yuv, d->pFrame_intm);
 
-				/* convert YUV420p to planar YUV */
-				video_decoder_yuv420p_yuvp(pFrame_yuv, pFrame_intm);
+	/* copy each channel from av_malloc to DMA_malloc */
+	for (c = 0; c < dim; c++)
+		memcpy(dst_byte + c * stride[0],
+		       d->pFrame_intm->data[c],
+		       size[1] * size[2]);
+	lua_pushboolean(L, 1);
+	push_pts(L, d, av_frame_get_best_effort_timestamp(d->pFrame_yuv));
+	return 2;
+}
 
-				/* copy each channel from av_malloc to DMA_malloc */
-				for (c = 0; c < dim; c++)
-					memcpy(dst_byte + c * stride[0],
-					       pFrame_intm->data[c],
-					       size[1] * size[2]);
+// Return the JPEG of lastframe_raw, encoding it only if neither a previous call
+// nor the JPEG encoder thread have already done it
+static JPEGFRAME *lastframe_jpeg(VIDEODEC *d)
+{
+	JPEGFRAME *f = 0;
+	unsigned char *buf = 0;
+	unsigned long size = 0;
 
-				av_free_packet(&packet);
-				lua_pushboolean(L, 1);
-				return 1;
-			}
+	if(d->jpeglua && d->jpeglua_seq == d->lastframe_seq)
+		return d->jpeglua;
+	if(d->lastframe_rxseq)
+	{
+		f = jpegframe_get(d);
+		if(f && f->frameseq != d->lastframe_rxseq)
+		{
+			jpegframe_unref(f);
+			f = 0;
 		}
-		/* free the packet that was allocated by av_read_frame */
-		av_free_packet(&packet);
 	}
-
-	lua_pushboolean(L, 0);
-	return 1;
+	if(!f)
+	{
+		jpeg_create_buf(&buf, &size, d->lastframe_raw, d->frame_width, d->frame_height, JPEGENC_QUALITY);
+		if(!buf)
+			return 0;
+		f = jpegframe_new(buf, size, d->lastframe_rxseq);
+		free(buf);
+		if(!f)
+			return 0;
+	}
+	jpegframe_unref(d->jpeglua);
+	d->jpeglua = f;
+	d->jpeglua_seq = d->lastframe_seq;
+	return f;
 }
 
 // This routine gets the JPEG of the last got frame; it does not get a new frame!
 static int video_decoder_jpeg(lua_State * L)
 {
-	if(!lastframe_raw)
+	VIDEODEC *d = getdec(L);
+	JPEGFRAME *f;
+
+	if(!d->lastframe_raw || !(f = lastframe_jpeg(d)))
 		return 0;
-	if(!jpeg_buf)
-		jpeg_create_buf(&jpeg_buf, &jpeg_size, lastframe_raw, frame_width, frame_height, 75);
-	THByteTensor *th = THByteTensor_newWithSize1d(jpeg_size);
-	memcpy(THByteTensor_data(th), jpeg_buf, jpeg_size);
+	THByteTensor *th = THByteTensor_newWithSize1d(f->len - f->hdrlen - 2);
+	memcpy(THByteTensor_data(th), f->data + f->hdrlen, f->len - f->hdrlen - 2);
 	luaT_pushudata(L, th, "torch.ByteTensor");
 	return 1;
 }
@@ -1706,26 +3507,25 @@ static int video_decoder_jpeg(lua_State * L)
 // This routine gets the JPEG of the last got frame; it does not get a new frame!
 static int save_jpeg(lua_State * L)
 {
+	VIDEODEC *d = getdec(L);
 	const char *filename = lua_tostring(L, 1);
+	JPEGFRAME *jf;
+
 	if(!filename)
 		luaL_error(L, "save_jpeg: missing filename");
-	if(!lastframe_raw)
+	if(!d->lastframe_raw || !(jf = lastframe_jpeg(d)))
 	{
 		lua_pushboolean(L, 0);
 		return 1;
 	}
-	pthread_mutex_lock(&jpegbufmutex);
-	if(!jpeg_buf)
-		jpeg_create_buf(&jpeg_buf, &jpeg_size, lastframe_raw, frame_width, frame_height, 75);
 	int f = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
 	if(f != -1)
 	{
-		if(write(f, jpeg_buf, jpeg_size) != jpeg_size && loglevel > 0)
+		if(write(f, jf->data + jf->hdrlen, jf->len - jf->hdrlen - 2) != jf->len - jf->hdrlen - 2 && loglevel > 0)
 			fprintf(stderr, "Error saving file %s\n", filename);
 		close(f);
 	} else if(loglevel > 0)
 		fprintf(stderr, "Error saving file %s\n", filename);
-	pthread_mutex_unlock(&jpegbufmutex);
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -1747,7 +3547,7 @@ static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt, cons
 
 // Open an AVFormatContext for output to destpath with optional format destformat
 // Copy most parameters from the already opened input AVFormatContext
-static AVFormatContext *openoutput2(lua_State *L, const char *destformat, const char *path, int width, int height, int fps)
+static AVFormatContext *openoutput2(VIDEODEC *d, lua_State *L, const char *destformat, const char *path, int width, int height, int fps)
 {
 	AVFormatContext *ofmt_ctx;
 	int i, ret;
@@ -1760,11 +3560,11 @@ static AVFormatContext *openoutput2(lua_State *L, const char *destformat, const
 	tm = *localtime(&t);
 	if(path)
 		strcpy(destpath, path);
-	else if(fragmentsize_seconds != -1)
-		sprintf(destpath, "%s_%04d%02d%02d-%02d%02d%02d.%s", destfile, 1900 + tm.tm_year, tm.tm_mon+1, tm.tm_mday,
-			tm.tm_hour, tm.tm_min, tm.tm_sec, destext);
-	else strcpy(destpath, destfile);
-	reencode_stream = -1;
+	else if(d->fragmentsize_seconds != -1)
+		sprintf(destpath, "%s_%04d%02d%02d-%02d%02d%02d.%s", d->destfile, 1900 + tm.tm_year, tm.tm_mon+1, tm.tm_mday,
+			tm.tm_hour, tm.tm_min, tm.tm_sec, d->destext);
+	else strcpy(destpath, d->destfile);
+	d->reencode_stream = -1;
 	ofmt_ctx = avformat_alloc_context();
 	if(!ofmt_ctx)
 	{
@@ -1795,13 +3595,13 @@ static AVFormatContext *openoutput2(lua_State *L, const char *destformat, const
 		avformat_free_context(ofmt_ctx);
 		return 0;
 	}
-	if(pFormatCtx && !width)
+	if(d->pFormatCtx && !width)
 	{
 		// Copy the stream contexts
-		for (i = 0; i < pFormatCtx->nb_streams; i++) {
+		for (i = 0; i < d->pFormatCtx->nb_streams; i++) {
 			AVStream *in_stream, *out_stream;
 
-			in_stream = pFormatCtx->streams[i];
+			in_stream = d->pFormatCtx->streams[i];
 			// If we output in the mp4 container, it's supposed that we will put
 			// audio in AAC, so force it
 			if(in_stream->codec->codec_type == AVMEDIA_TYPE_AUDIO &&
@@ -1817,7 +3617,7 @@ static AVFormatContext *openoutput2(lua_State *L, const char *destformat, const
 				out_stream->codec->codec_type = AVMEDIA_TYPE_AUDIO;
 				out_stream->codec->frame_size = 1024;
 				out_stream->codec->sample_fmt = in_stream->codec->sample_fmt;
-				reencode_stream  = i;
+				d->reencode_stream  = i;
 				decoder = avcodec_find_decoder(in_stream->codec->codec_id);
 				if(decoder == NULL)
 				{
@@ -1900,19 +3700,19 @@ static AVFormatContext *openoutput2(lua_State *L, const char *destformat, const
 		if(!width)
 		{
 			// vcap case
-			width = frame_width;
-			height = frame_height;
-			fps = vcap_fps;
+			width = d->frame_width;
+			height = d->frame_height;
+			fps = d->vcap_fps;
 		} else {
 			// generic case
 			generic = 1;
 		}
 #ifdef DOVIDEOCAP
-		vcodec_writeextradata = 1;
+		d->vcodec_writeextradata = 1;
 		if(destformat)
 		{
 			if(!strcmp(destformat, "mp4"))
-				vcodec_writeextradata = 0;
+				d->vcodec_writeextradata = 0;
 		}
 #endif
 		enum AVCodecID codec_id;
@@ -1944,9 +3744,9 @@ static AVFormatContext *openoutput2(lua_State *L, const char *destformat, const
 		stream->codec->sample_aspect_ratio.den = 1;
 		stream->sample_aspect_ratio = stream->codec->sample_aspect_ratio;
 #ifdef DOVIDEOCAP
-		stream->codec->extradata = av_malloc(vcodec_extradata_size);
-		stream->codec->extradata_size = vcodec_extradata_size;
-		memcpy(stream->codec->extradata, vcodec_extradata, vcodec_extradata_size);
+		stream->codec->extradata = av_malloc(d->vcodec_extradata_size);
+		stream->codec->extradata_size = d->vcodec_extradata_size;
+		memcpy(stream->codec->extradata, d->vcodec_extradata, d->vcodec_extradata_size);
 #endif
 		if(generic)
 		{
@@ -1973,14 +3773,14 @@ static AVFormatContext *openoutput2(lua_State *L, const char *destformat, const
 	return ofmt_ctx;
 }
 
-static AVFormatContext *openoutput(lua_State *L, const char *destformat, const char *path)
+static AVFormatContext *openoutput(VIDEODEC *d, lua_State *L, const char *destformat, const char *path)
 {
-	if(ofmt_ctx)
+	if(d->ofmt_ctx)
 	{
-		avformat_free_context(ofmt_ctx);
-		ofmt_ctx = 0;
+		avformat_free_context(d->ofmt_ctx);
+		d->ofmt_ctx = 0;
 	}
-	return openoutput2(L, destformat, path, 0, 0, 0);
+	return openoutput2(d, L, destformat, path, 0, 0, 0);
 }
 
 static void renametmp(const char *path)
@@ -1993,7 +3793,7 @@ static void renametmp(const char *path)
 }
 
 // Write the input packet pkt to the output stream
-static int write_packet(struct AVPacket *pkt, AVRational time_base)
+static int write_packet(VIDEODEC *d, struct AVPacket *pkt, AVRational time_base)
 {
 	AVStream *out_stream;
 	int ret = 0;
@@ -2003,55 +3803,55 @@ static int write_packet(struct AVPacket *pkt, AVRational time_base)
 	// Calculate the packet parameters for the output stream
 	if(pkt->dts == AV_NOPTS_VALUE)
 		pkt->dts = 0;
-	if(start_dts == -1)
-		start_dts = pkt->dts;
-	if(pkt->stream_index != reencode_stream)
+	if(d->start_dts == -1)
+		d->start_dts = pkt->dts;
+	if(pkt->stream_index != d->reencode_stream)
 	{
 		if(loglevel >= 5)
-			fprintf(stderr, "Write dts=%ld start=%ld size=%ld\n", (long)pkt->dts, (long)start_dts, (long)fragmentsize);
+			fprintf(stderr, "Write dts=%ld start=%ld size=%ld\n", (long)pkt->dts, (long)d->start_dts, (long)d->fragmentsize);
 		// If the desired fragment size has been reached and the frame is a key (intra) frame,
 		// create a new fragment (we want each fragment to start with a key frame, since
 		// inter (non-intra) frames cannot be decoded without a starting key frame
-		if(fragmentsize && fragmentsize != -1 &&
-			pkt->stream_index == stream_idx && pkt->dts > start_dts + fragmentsize && pkt->flags & AV_PKT_FLAG_KEY)
+		if(d->fragmentsize && d->fragmentsize != -1 &&
+			pkt->stream_index == d->stream_idx && pkt->dts > d->start_dts + d->fragmentsize && pkt->flags & AV_PKT_FLAG_KEY)
 		{
 			if(loglevel >= 4)
-				fprintf(stderr, "Close (dts=%ld start=%ld size=%ld)\n", (long)pkt->dts, (long)start_dts, (long)fragmentsize);
+				fprintf(stderr, "Close (dts=%ld start=%ld size=%ld)\n", (long)pkt->dts, (long)d->start_dts, (long)d->fragmentsize);
 			// Write the trailer and close the file
-			av_write_trailer(ofmt_ctx);
+			av_write_trailer(d->ofmt_ctx);
 
 			/* close output */
-			if (ofmt_ctx && !(ofmt_ctx->flags & AVFMT_NOFILE))
+			if (d->ofmt_ctx && !(d->ofmt_ctx->flags & AVFMT_NOFILE))
 			{
-				avio_close(ofmt_ctx->pb);
-				renametmp(ofmt_ctx->filename);
+				avio_close(d->ofmt_ctx->pb);
+				renametmp(d->ofmt_ctx->filename);
 			}
-			avformat_free_context(ofmt_ctx);
-			ofmt_ctx = 0;
+			avformat_free_context(d->ofmt_ctx);
+			d->ofmt_ctx = 0;
 
 			// Only if we are continuously creating files, create the new file
-			if(fragmentsize_seconds)
+			if(d->fragmentsize_seconds)
 			{
 				// Open the new file
-				ofmt_ctx = openoutput(0, destformat, 0);
-				if(!ofmt_ctx)
+				d->ofmt_ctx = openoutput(d, 0, d->destformat, 0);
+				if(!d->ofmt_ctx)
 					return 0;
-				start_dts = pkt->dts;
-			} else fragmentsize = 0;
+				d->start_dts = pkt->dts;
+			} else d->fragmentsize = 0;
 		}
-		if(ofmt_ctx)
+		if(d->ofmt_ctx)
 		{
 			// Change timing to output stream requirements
-			out_stream = ofmt_ctx->streams[pkt->stream_index];
+			out_stream = d->ofmt_ctx->streams[pkt->stream_index];
 			pkt->duration = av_rescale_q(pkt->duration, time_base, out_stream->time_base);
-			if(pFormatCtx)
-				ss = av_rescale_q(start_dts, pFormatCtx->streams[stream_idx]->time_base, time_base);
-			else ss = start_dts;
+			if(d->pFormatCtx)
+				ss = av_rescale_q(d->start_dts, d->pFormatCtx->streams[d->stream_idx]->time_base, time_base);
+			else ss = d->start_dts;
 			pkt->pts = av_rescale_q(pkt->pts - ss, time_base, out_stream->time_base);
 			pkt->dts = av_rescale_q(pkt->dts - ss, time_base, out_stream->time_base);
 			pkt->pos = -1;
 #ifdef DOVIDEOCAP
-			if(vcodec_writeextradata && (pkt->flags & AV_PKT_FLAG_KEY))
+			if(d->vcodec_writeextradata && (pkt->flags & AV_PKT_FLAG_KEY))
 			{
 				// Streaming formats need extradata to be written periodically
 				AVPacket pkt2;
@@ -2059,18 +3859,18 @@ static int write_packet(struct AVPacket *pkt, AVRational time_base)
 				pkt2 = *pkt;
 				pkt->dts++;
 				pkt->pts++;
-				pkt2.data = vcodec_extradata;
-				pkt2.size = vcodec_extradata_size;
-				log_packet(ofmt_ctx, &pkt2, "extra");
-				ret = av_write_frame(ofmt_ctx, &pkt2);
+				pkt2.data = d->vcodec_extradata;
+				pkt2.size = d->vcodec_extradata_size;
+				log_packet(d->ofmt_ctx, &pkt2, "extra");
+				ret = av_write_frame(d->ofmt_ctx, &pkt2);
 				if (ret < 0) {
 					av_strerror(ret, s, sizeof(s));
 					fprintf(stderr, "Error muxing packet: %s\n", s);
 				}
 			}
 #endif
-			log_packet(ofmt_ctx, pkt, "out");
-			ret = av_write_frame(ofmt_ctx, pkt);
+			log_packet(d->ofmt_ctx, pkt, "out");
+			ret = av_write_frame(d->ofmt_ctx, pkt);
 			if (ret < 0) {
 				av_strerror(ret, s, sizeof(s));
 				fprintf(stderr, "Error muxing packet: %s\n", s);
@@ -2081,236 +3881,555 @@ static int write_packet(struct AVPacket *pkt, AVRational time_base)
 		int got;
 
 		memset(&frame, 0, sizeof(frame));
-		if(avcodec_decode_audio4(pFormatCtx->streams[reencode_stream]->codec, &frame, &got, pkt) >= 0 && got)
+		if(avcodec_decode_audio4(d->pFormatCtx->streams[d->reencode_stream]->codec, &frame, &got, pkt) >= 0 && got)
 		{
 			AVPacket pkt2;
 			int rc;
 
-			memcpy(audiobuf + audiobuflen, frame.data[0], frame.nb_samples * 2);
-			audiobuflen += frame.nb_samples;
+			memcpy(d->audiobuf + d->audiobuflen, frame.data[0], frame.nb_samples * 2);
+			d->audiobuflen += frame.nb_samples;
 			memset(&pkt2, 0, sizeof(pkt2));
-			if(audiobuflen >= 1024)
+			if(d->audiobuflen >= 1024)
 			{
-				frame.data[0] = (uint8_t *)audiobuf;
+				frame.data[0] = (uint8_t *)d->audiobuf;
 				frame.nb_samples = 1024;
-				rc = avcodec_encode_audio2(ofmt_ctx->streams[reencode_stream]->codec, &pkt2, &frame, &got);
+				rc = avcodec_encode_audio2(d->ofmt_ctx->streams[d->reencode_stream]->codec, &pkt2, &frame, &got);
 				if(!rc && got)
 				{
 					// Change timing to output stream requirements
-					out_stream = ofmt_ctx->streams[pkt->stream_index];
-					ss = av_rescale_q(start_dts, pFormatCtx->streams[stream_idx]->time_base, time_base);
+					out_stream = d->ofmt_ctx->streams[pkt->stream_index];
+					ss = av_rescale_q(d->start_dts, d->pFormatCtx->streams[d->stream_idx]->time_base, time_base);
 					pkt2.dts = pkt2.pts = av_rescale_q(pkt->dts - ss, time_base, out_stream->time_base);
 					pkt2.duration = 1024 * 90000 / 8000;
 					pkt2.stream_index = pkt->stream_index;
-					log_packet(ofmt_ctx, &pkt2, "out");
+					log_packet(d->ofmt_ctx, &pkt2, "out");
 					// Write the packet
-					ret = av_write_frame(ofmt_ctx, &pkt2);
+					ret = av_write_frame(d->ofmt_ctx, &pkt2);
 					if (ret < 0) {
 						av_strerror(ret, s, sizeof(s));
 						fprintf(stderr, "Error muxing packet: %s\n", s);
 					}
 					av_free_packet(&pkt2);
 				}
-				audiobuflen -= 1024;
-				memmove(audiobuf, audiobuf + 1024, audiobuflen * 2);
+				d->audiobuflen -= 1024;
+				memmove(d->audiobuf, d->audiobuf + 1024, d->audiobuflen * 2);
 			}
 		}
 	}
 	return ret;
 }
 
-// Remuxing thread
-void *rxthread(void *dummy)
+/***************************************
+Pre-roll buffer
+
+While startremux is only receiving, the packets are kept here for savenow.
+Packet data goes to a fixed byte ring (the arena), the descriptors to a ring indexed
+by packet number and the video keyframes to a ring of packet numbers, sorted by time,
+so that savenow finds its start with a binary search. The oldest packets are dropped
+when the arena is full or when they are older than the configured duration; the
+descriptor rings only grow until the steady state is reached, so there are no
+allocations per packet
+***************************************/
+
+#define PREROLL_SECONDS 60
+#define PREROLL_MB 32
+#define PREROLL_INITPACKETS 1024
+
+static void preroll_free(VIDEODEC *d)
 {
-	AVPacket pkt;
-	int ret = 0;
-	char s[300];
+	free(d->preroll.arena);
+	free(d->preroll.pkts);
+	free(d->preroll.keys);
+	memset(&d->preroll, 0, sizeof(d->preroll));
+}
 
-	start_dts = -1;
-	// Calculate the fragment size in time base units
-	audiobuflen = 0;
-	if(fragmentsize_seconds == -1)	// Special case, infinite fragment size (streaming)
-		fragmentsize = -1;
-	else fragmentsize = fragmentsize_seconds * pFormatCtx->streams[stream_idx]->time_base.den /
-		pFormatCtx->streams[stream_idx]->time_base.num;
+static void preroll_clear(VIDEODEC *d)
+{
+	d->preroll.first = d->preroll.next = 0;
+	d->preroll.kfirst = d->preroll.knext = 0;
+	d->preroll.wpos = 0;
+}
 
-	// While it's allowed to run
-    while (rx_active)
+// Allocate the arena of size bytes and set the maximum duration in video stream time base units
+static int preroll_init(VIDEODEC *d, long size, int64_t maxdur)
+{
+	if(d->preroll.arenasize != size)
 	{
-		// Read frame
-        ret = av_read_frame(pFormatCtx, &pkt);
-        if (ret < 0)
-            break;
+		free(d->preroll.arena);
+		d->preroll.arena = (uint8_t *)malloc(size);
+		d->preroll.arenasize = d->preroll.arena ? size : 0;
+	}
+	if(!d->preroll.pkts)
+	{
+		d->preroll.pkts = (PREROLLPKT *)malloc(PREROLL_INITPACKETS * sizeof(*d->preroll.pkts));
+		d->preroll.keys = (int64_t *)malloc(PREROLL_INITPACKETS * sizeof(*d->preroll.keys));
+		d->preroll.cap = d->preroll.pkts && d->preroll.keys ? PREROLL_INITPACKETS : 0;
+	}
+	d->preroll.maxdur = maxdur;
+	preroll_clear(d);
+	return d->preroll.arenasize && d->preroll.cap ? 0 : -1;
+}
 
-		log_packet(pFormatCtx, &pkt, "in");
-		// If video, decode it
-		if(pkt.stream_index == stream_idx) {
-			/* decode video frame */
-			pthread_mutex_lock(&readmutex);
-			avcodec_decode_video2(pCodecCtx, pFrame_yuv, &frame_decoded, &pkt);
-			pthread_mutex_unlock(&readmutex);
-		}
-		if(fragmentsize == 0)
-		{
-			// We are only receiving and not saving, save the received packets in a FIFO buffer
-			struct AVPacket pkt2;
-
-			// We have to copy the contents to a new packet, because
-			// libav only has a limited amount of packets and after a while
-			// they start to cycle and we overrun
-			av_new_packet(&pkt2, pkt.size);
-			pkt2.stream_index = pkt.stream_index;
-			pkt2.dts = pkt.dts;
-			pkt2.pts = pkt.pts;
-			pkt2.flags = pkt.flags;
-			memcpy(pkt2.data, pkt.data, pkt.size);
-			rxfifo[rxfifo_tail] = pkt2;
-			rxfifo_tail = (rxfifo_tail+1) % RXFIFOQUEUESIZE;
-			if(rxfifo_tail == rxfifo_head)
-			{
-				av_free_packet(&rxfifo[rxfifo_tail]);
-				rxfifo_head = (rxfifo_head+1) % RXFIFOQUEUESIZE;
-			}
-			if((savenow_seconds_before || savenow_seconds_after) && pkt.stream_index == stream_idx)
-			{
-				int i = rxfifo_tail;
-				uint64_t last_dts;
-
-				// Go backward for savenow_seconds_before seconds
-				uint64_t sdts = pkt.dts - savenow_seconds_before * pFormatCtx->streams[stream_idx]->time_base.den /
-					pFormatCtx->streams[stream_idx]->time_base.num;
-				if((int64_t)sdts < 0)
-					sdts = 0;
-				i = rxfifo_tail;
-				start_dts = pkt.dts;
-				while(i != rxfifo_head)
-				{
-					i = (i + RXFIFOQUEUESIZE-1) % RXFIFOQUEUESIZE;
-					log_packet(pFormatCtx, &rxfifo[i], "going_back");
-					if(rxfifo[i].stream_index == stream_idx && rxfifo[i].dts <= sdts)
-						break;
-				}
-				// Go backward until a keyframe is found
-				if(!(rxfifo[i].flags & AV_PKT_FLAG_KEY))
-				{
-					while(i != rxfifo_head)
-					{
-						i = (i + RXFIFOQUEUESIZE-1) % RXFIFOQUEUESIZE;
-						log_packet(pFormatCtx, &rxfifo[i], "going_back_key");
-						if(rxfifo[i].stream_index == stream_idx && rxfifo[i].flags & AV_PKT_FLAG_KEY)
-							break;
-					}
-					// If there is no keyframe, go forward and find first keyframe
-					while(i != rxfifo_tail && rxfifo[i].stream_index == stream_idx &&
-						!(rxfifo[i].flags & AV_PKT_FLAG_KEY))
-					{
-						log_packet(pFormatCtx, &rxfifo[i], "going_forward");
-						i = (i + 1) % RXFIFOQUEUESIZE;
-					}
-				}
+#define PREROLL_PKT(d, n) (&(d)->preroll.pkts[(n) % (d)->preroll.cap])
+#define PREROLL_KEY(d, n) (d)->preroll.keys[(n) % (d)->preroll.cap]
 
-				// Open the new file
-				ofmt_ctx = openoutput(0, destformat, savenow_path);
-				if(!ofmt_ctx)
-					return 0;
-				if(i != rxfifo_tail)
-					start_dts = rxfifo[i].dts;
-				last_dts = start_dts;
-
-				if(loglevel >= 4)
-					fprintf(stderr, "Went back %d seconds, saving %d frames\n", savenow_seconds_before,
-						(rxfifo_tail - i + RXFIFOQUEUESIZE) % RXFIFOQUEUESIZE);
-				// Write out the buffer
-				fragmentsize = 0;
-				while(i != rxfifo_tail)
-				{
-					last_dts = rxfifo[i].dts;
-					write_packet(&rxfifo[i], pFormatCtx->streams[rxfifo[i].stream_index]->time_base);
-					i = (i + 1) % RXFIFOQUEUESIZE;
-				}
+// Drop the oldest packet
+static void preroll_pop(VIDEODEC *d)
+{
+	if(d->preroll.kfirst < d->preroll.knext && PREROLL_KEY(d, d->preroll.kfirst) == d->preroll.first)
+		d->preroll.kfirst++;
+	d->preroll.first++;
+}
 
-				// Clear the FIFO
-				while(rxfifo_head != rxfifo_tail)
-				{
-					av_free_packet(&rxfifo[rxfifo_head]);
-					rxfifo_head = (rxfifo_head+1) % RXFIFOQUEUESIZE;
-				}
-				rxfifo_head = rxfifo_tail = 0;
-
-				// Work done, clear the request
-				fragmentsize = savenow_seconds_after * pFormatCtx->streams[stream_idx]->time_base.den /
-					pFormatCtx->streams[stream_idx]->time_base.num + (last_dts - start_dts);
-				if(loglevel >= 4)
-					fprintf(stderr, "Savenow: start_dts = %ld, last_dts = %ld, fragmentsize = %ld\n",
-						(long)start_dts, (long)last_dts, (long)fragmentsize);
-				savenow_seconds_before = savenow_seconds_after = 0;
-			}
-			av_free_packet(&pkt);
-		} else {
-			if(savenow_seconds_after && pkt.stream_index == stream_idx)
+// Double the capacity of the descriptor rings, keeping their contents
+static int preroll_grow(VIDEODEC *d)
+{
+	int cap = d->preroll.cap * 2;
+	PREROLLPKT *pkts = (PREROLLPKT *)malloc(cap * sizeof(*pkts));
+	int64_t *keys = (int64_t *)malloc(cap * sizeof(*keys));
+	int64_t n;
+
+	if(!pkts || !keys)
+	{
+		free(pkts);
+		free(keys);
+		return -1;
+	}
+	for(n = d->preroll.first; n < d->preroll.next; n++)
+		pkts[n % cap] = *PREROLL_PKT(d, n);
+	for(n = d->preroll.kfirst; n < d->preroll.knext; n++)
+		keys[n % cap] = PREROLL_KEY(d, n);
+	free(d->preroll.pkts);
+	free(d->preroll.keys);
+	d->preroll.pkts = pkts;
+	d->preroll.keys = keys;
+	d->preroll.cap = cap;
+	return 0;
+}
+
+// Find the arena offset where size bytes can be stored without overwriting
+// the data of the buffered packets, -1 if there is no space
+static long preroll_place(VIDEODEC *d, int size)
+{
+	long r, w = d->preroll.wpos;
+
+	if(d->preroll.first == d->preroll.next)
+		return size <= d->preroll.arenasize ? 0 : -1;
+	r = PREROLL_PKT(d, d->preroll.first)->offset;
+	if(PREROLL_PKT(d, d->preroll.next - 1)->offset >= r)
+	{
+		// Data is contiguous from r to w, the free space is after w and before r
+		if(d->preroll.arenasize - w >= size)
+			return w;
+		if(r > size)
+			return 0;
+		return -1;
+	}
+	// Data wraps around the end of the arena, the free space is between w and r
+	return r - w > size ? w : -1;
+}
+
+// Store a copy of pkt; t is its dts in the video stream time base
+static void preroll_push(VIDEODEC *d, const AVPacket *pkt, int64_t t)
+{
+	PREROLLPKT *p;
+	long offset;
+
+	if(pkt->size > d->preroll.arenasize)
+	{
+		// It will never fit, and without it the following packets cannot be decoded
+		preroll_clear(d);
+		return;
+	}
+	// Drop the packets that are too old
+	while(d->preroll.first < d->preroll.next && t - PREROLL_PKT(d, d->preroll.first)->t > d->preroll.maxdur)
+		preroll_pop(d);
+	// Make space for the data
+	while((offset = preroll_place(d, pkt->size)) < 0)
+		preroll_pop(d);
+	if(d->preroll.next - d->preroll.first == d->preroll.cap && preroll_grow(d))
+		preroll_pop(d);
+	memcpy(d->preroll.arena + offset, pkt->data, pkt->size);
+	d->preroll.wpos = offset + pkt->size;
+	p = PREROLL_PKT(d, d->preroll.next);
+	p->offset = offset;
+	p->size = pkt->size;
+	p->stream_index = pkt->stream_index;
+	p->flags = pkt->flags;
+	p->duration = pkt->duration;
+	p->dts = pkt->dts;
+	p->pts = pkt->pts;
+	p->t = t;
+	if(pkt->stream_index == d->stream_idx && pkt->flags & AV_PKT_FLAG_KEY)
+	{
+		PREROLL_KEY(d, d->preroll.knext) = d->preroll.next;
+		d->preroll.knext++;
+	}
+	d->preroll.next++;
+}
+
+// Packet number of the last keyframe not after t, or of the first keyframe if all of them
+// come after t; preroll.next if there are no keyframes
+static int64_t preroll_findstart(VIDEODEC *d, int64_t t)
+{
+	int64_t lo = d->preroll.kfirst, hi = d->preroll.knext;
+
+	if(lo == hi)
+		return d->preroll.next;
+	// Find the first keyframe after t
+	while(lo < hi)
+	{
+		int64_t mid = lo + (hi - lo) / 2;
+		if(PREROLL_PKT(d, PREROLL_KEY(d, mid))->t <= t)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	if(lo > d->preroll.kfirst)
+		lo--;
+	return PREROLL_KEY(d, lo);
+}
+
+static AVRational mux_time_base(VIDEODEC *d, int stream_index);
+
+// Open savenow_path and write the buffered packets starting from the last keyframe
+// not after t, then clear the buffer
+static int preroll_save(VIDEODEC *d, int64_t t, uint64_t *last_dts)
+{
+	int64_t n = preroll_findstart(d, t);
+
+	d->ofmt_ctx = openoutput(d, 0, d->destformat, d->savenow_path);
+	if(!d->ofmt_ctx)
+		return -1;
+	if(n != d->preroll.next)
+		d->start_dts = PREROLL_PKT(d, n)->dts;
+	*last_dts = d->start_dts;
+	if(loglevel >= 4)
+		fprintf(stderr, "Went back %d seconds, saving %ld packets\n", d->savenow_seconds_before,
+			(long)(d->preroll.next - n));
+	// Write out the buffer
+	d->fragmentsize = 0;
+	for(; n < d->preroll.next; n++)
+	{
+		PREROLLPKT *p = PREROLL_PKT(d, n);
+		AVPacket pkt;
+
+		// The packet points to the arena, the muxer does not keep it
+		av_init_packet(&pkt);
+		pkt.data = d->preroll.arena + p->offset;
+		pkt.size = p->size;
+		pkt.stream_index = p->stream_index;
+		pkt.flags = p->flags;
+		pkt.duration = p->duration;
+		pkt.dts = p->dts;
+		pkt.pts = p->pts;
+		*last_dts = p->dts;
+		write_packet(d, &pkt, mux_time_base(d, p->stream_index));
+	}
+	preroll_clear(d);
+	return 0;
+}
+
+/***************************************
+Muxing thread
+
+The receiving thread only queues the packets, the muxing thread saves them to the
+pre-roll buffer or writes them to the output, so that a slow disk does not stall
+the reception; when the queue is full, the packets are dropped or the receiving
+thread waits, according to the overflow policy given to startremux
+***************************************/
+
+#define MUX_QUEUESIZE 256
+
+// Time base of the packets of the given stream
+static AVRational mux_time_base(VIDEODEC *d, int stream_index)
+{
+#ifdef DOVIDEOCAP
+	if(d->vcap)
+	{
+		AVRational time_base = {1, d->vcap_fps};
+		return time_base;
+	}
+#endif
+	return d->pFormatCtx->streams[stream_index]->time_base;
+}
+
+// Save pkt in the pre-roll buffer or write it to the output, handling the savenow requests
+static int mux_packet(VIDEODEC *d, AVPacket *pkt)
+{
+	AVRational vtb = mux_time_base(d, d->stream_idx);
+
+	if(d->fragmentsize == 0)
+	{
+		// We are only receiving and not saving, save the received packets in the pre-roll buffer
+		if(pkt->dts != AV_NOPTS_VALUE)
+			d->mux.t = av_rescale_q(pkt->dts, mux_time_base(d, pkt->stream_index), vtb);
+		preroll_push(d, pkt, d->mux.t);
+		if((d->savenow_seconds_before || d->savenow_seconds_after) && pkt->stream_index == d->stream_idx)
+		{
+			uint64_t last_dts;
+
+			d->start_dts = pkt->dts;
+			// Start from the last keyframe savenow_seconds_before seconds ago
+			if(preroll_save(d, d->mux.t - (int64_t)d->savenow_seconds_before * vtb.den / vtb.num, &last_dts))
+				return -1;
+
+			// Work done, clear the request
+			d->fragmentsize = (int64_t)d->savenow_seconds_after * vtb.den / vtb.num + (last_dts - d->start_dts);
+			if(loglevel >= 4)
+				fprintf(stderr, "Savenow: start_dts = %ld, last_dts = %ld, fragmentsize = %ld\n",
+					(long)d->start_dts, (long)last_dts, (long)d->fragmentsize);
+			d->savenow_seconds_before = d->savenow_seconds_after = 0;
+		}
+	} else {
+		if(d->savenow_seconds_after && pkt->stream_index == d->stream_idx)
+		{
+			d->fragmentsize = (int64_t)d->savenow_seconds_after * vtb.den / vtb.num + (pkt->dts - d->start_dts);
+			if(loglevel >= 4)
+				fprintf(stderr, "Updating savenow: start_dts = %ld, last_dts = %ld, fragmentsize = %ld\n",
+					(long)d->start_dts, (long)pkt->dts, (long)d->fragmentsize);
+			d->savenow_seconds_before = d->savenow_seconds_after = 0;
+		}
+		write_packet(d, pkt, mux_time_base(d, pkt->stream_index));
+	}
+	return 0;
+}
+
+static void *muxthread(void *arg)
+{
+	VIDEODEC *d = (VIDEODEC *)arg;
+	AVRational vtb = mux_time_base(d, d->stream_idx);
+	AVPacket pkt;
+	int failed = 0;
+	double ms;
+
+	d->start_dts = -1;
+	d->audiobuflen = 0;
+	d->mux.t = 0;
+	// Calculate the fragment size in time base units
+	if(d->fragmentsize_seconds == -1)	// Special case, infinite fragment size (streaming)
+		d->fragmentsize = -1;
+	else d->fragmentsize = (int64_t)d->fragmentsize_seconds * vtb.den / vtb.num;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&d->mux.mutex);
+		while(!d->mux.n && !d->mux.eos)
+			pthread_cond_wait(&d->mux.cond, &d->mux.mutex);
+		if(!d->mux.n)
+		{
+			pthread_mutex_unlock(&d->mux.mutex);
+			break;
+		}
+		pkt = d->mux.pkts[d->mux.head];
+		d->mux.head = (d->mux.head + 1) % d->mux.size;
+		d->mux.n--;
+		// Wake up the receiving thread if it's waiting for space
+		pthread_cond_broadcast(&d->mux.cond);
+		pthread_mutex_unlock(&d->mux.mutex);
+		if(!failed)
+		{
+			ms = now_ms();
+			if(mux_packet(d, &pkt))
 			{
-				fragmentsize = savenow_seconds_after * pFormatCtx->streams[stream_idx]->time_base.den /
-					pFormatCtx->streams[stream_idx]->time_base.num + (pkt.dts - start_dts);
-				if(loglevel >= 4)
-					fprintf(stderr, "Updating savenow: start_dts = %ld, last_dts = %ld, fragmentsize = %ld\n",
-						(long)start_dts, (long)pkt.dts, (long)fragmentsize);
-				savenow_seconds_before = savenow_seconds_after = 0;
+				// Cannot open the output, stop receiving
+				failed = 1;
+				d->rx_active = 0;
 			}
-			write_packet(&pkt, pFormatCtx->streams[pkt.stream_index]->time_base);
-			av_free_packet(&pkt);
+			ms = now_ms() - ms;
+			pthread_mutex_lock(&d->mux.mutex);
+			d->mux.written++;
+			d->mux.write_ms_last = ms;
+			d->mux.write_ms_total += ms;
+			if(ms > d->mux.write_ms_max)
+				d->mux.write_ms_max = ms;
+			pthread_mutex_unlock(&d->mux.mutex);
+			if(d->stats.enabled)
+				stats_record(&d->stats.stage[ST_MUXWRITE], ms * 1000);
 		}
-    }
+		av_free_packet(&pkt);
+	}
 
-	if(ofmt_ctx)
+	if(d->ofmt_ctx)
 	{
 		// Write the trailer of the file
-		av_write_trailer(ofmt_ctx);
+		av_write_trailer(d->ofmt_ctx);
 
 		/* close output */
-		if (ofmt_ctx && !(ofmt_ctx->flags & AVFMT_NOFILE))
+		if (d->ofmt_ctx && !(d->ofmt_ctx->flags & AVFMT_NOFILE))
 		{
-			avio_close(ofmt_ctx->pb);
-			renametmp(ofmt_ctx->filename);
+			avio_close(d->ofmt_ctx->pb);
+			renametmp(d->ofmt_ctx->filename);
 		}
-		avformat_free_context(ofmt_ctx);
-		ofmt_ctx = 0;
+		avformat_free_context(d->ofmt_ctx);
+		d->ofmt_ctx = 0;
+	}
+	preroll_clear(d);
+	return 0;
+}
 
-		if (ret < 0 && ret != AVERROR_EOF) {
-			av_strerror(ret, s, sizeof(s));
-			fprintf(stderr, "Error %d occurred: %s\n", ret, s);
-			return 0;
+// Drop the queued packets up to the second video keyframe, so that the queue
+// starts with a keyframe; the lock has to be held
+static void mux_dropgop(VIDEODEC *d)
+{
+	int i = 0;
+
+	do {
+		av_free_packet(&d->mux.pkts[d->mux.head]);
+		d->mux.head = (d->mux.head + 1) % d->mux.size;
+		d->mux.n--;
+		i++;
+	} while(d->mux.n && !(d->mux.pkts[d->mux.head].stream_index == d->stream_idx &&
+		d->mux.pkts[d->mux.head].flags & AV_PKT_FLAG_KEY));
+	d->mux.dropped += i;
+	// No keyframe was queued, the next video packets cannot be decoded without one
+	if(!d->mux.n)
+		d->mux.skip_to_key = 1;
+}
+
+// Queue pkt for the muxing thread, which will free it
+static void mux_queue(VIDEODEC *d, AVPacket *pkt)
+{
+	int video = pkt->stream_index == d->stream_idx;
+	int key = video && pkt->flags & AV_PKT_FLAG_KEY;
+
+	pthread_mutex_lock(&d->mux.mutex);
+	if(key)
+		d->mux.skip_to_key = 0;
+	else if(video && d->mux.skip_to_key)
+	{
+		d->mux.dropped++;
+		pthread_mutex_unlock(&d->mux.mutex);
+		av_free_packet(pkt);
+		return;
+	}
+	while(d->mux.n == d->mux.size)
+	{
+		if(d->mux.overflow == MUX_DROPNONKEY && !key)
+		{
+			// Drop this packet and, if it's video, the following ones up to the next keyframe
+			d->mux.dropped++;
+			if(video)
+				d->mux.skip_to_key = 1;
+			pthread_mutex_unlock(&d->mux.mutex);
+			av_free_packet(pkt);
+			return;
 		}
+		if(d->mux.overflow == MUX_DROPGOP)
+		{
+			mux_dropgop(d);
+			if(!key && video && d->mux.skip_to_key)
+			{
+				d->mux.dropped++;
+				pthread_mutex_unlock(&d->mux.mutex);
+				av_free_packet(pkt);
+				return;
+			}
+		} else pthread_cond_wait(&d->mux.cond, &d->mux.mutex);
+	}
+	d->mux.pkts[(d->mux.head + d->mux.n) % d->mux.size] = *pkt;
+	d->mux.n++;
+	if(d->mux.n > d->mux.max_n)
+		d->mux.max_n = d->mux.n;
+	pthread_cond_broadcast(&d->mux.cond);
+	pthread_mutex_unlock(&d->mux.mutex);
+}
+
+// Allocate the queue and start the muxing thread
+static int mux_start(VIDEODEC *d, int size, int overflow)
+{
+	if(d->mux.size != size)
+	{
+		free(d->mux.pkts);
+		d->mux.pkts = (AVPacket *)malloc(size * sizeof(*d->mux.pkts));
+		d->mux.size = d->mux.pkts ? size : 0;
+		if(!d->mux.pkts)
+			return -1;
 	}
+	d->mux.overflow = overflow;
+	d->mux.head = d->mux.n = d->mux.max_n = 0;
+	d->mux.skip_to_key = d->mux.eos = 0;
+	d->mux.dropped = d->mux.written = 0;
+	d->mux.write_ms_last = d->mux.write_ms_max = d->mux.write_ms_total = 0;
+	if(pthread_create(&d->mux.tid, 0, muxthread, d))
+	{
+		d->mux.tid = 0;
+		return -1;
+	}
+	return 0;
+}
+
+// Let the muxing thread write the queued packets and wait for it to end
+static void mux_stop(VIDEODEC *d)
+{
+	void *retval;
+
+	if(!d->mux.tid)
+		return;
+	pthread_mutex_lock(&d->mux.mutex);
+	d->mux.eos = 1;
+	pthread_cond_broadcast(&d->mux.cond);
+	pthread_mutex_unlock(&d->mux.mutex);
+	pthread_join(d->mux.tid, &retval);
+	d->mux.tid = 0;
+}
+
+// Remuxing thread
+void *rxthread(void *arg)
+{
+	VIDEODEC *d = (VIDEODEC *)arg;
+	AVPacket pkt;
+	int ret = 0;
+	char s[300];
 
-	// Clear the FIFO
-	while(rxfifo_head != rxfifo_tail)
+	// While it's allowed to run
+    while (d->rx_active)
 	{
-		av_free_packet(&rxfifo[rxfifo_head]);
-		rxfifo_head = (rxfifo_head+1) % RXFIFOQUEUESIZE;
+		// Read frame
+		uint64_t t0 = stage_begin(d);
+        ret = av_read_frame(d->pFormatCtx, &pkt);
+		stage_end(d, ST_DEMUX, t0);
+        if (ret < 0)
+            break;
+
+		log_packet(d->pFormatCtx, &pkt, "in");
+		// If video, decode it
+		if(pkt.stream_index == d->stream_idx) {
+			/* decode video frame */
+			int got = 0;
+
+			// Decode in the back slot, consumers never see it until it's published
+			decode_video(d, d->tb.frame[d->tb.back], &got, &pkt);
+			if(got)
+			{
+				jpegenc_feed(d, d->tb.frame[d->tb.back], 0, d->frame_seq + 1);
+				tb_publish(d);
+			}
+		}
+		// The packet will be used by the muxing thread after the next av_read_frame
+		if(av_dup_packet(&pkt) < 0)
+		{
+			av_free_packet(&pkt);
+			continue;
+		}
+		mux_queue(d, &pkt);
+    }
+
+	if (ret < 0 && ret != AVERROR_EOF) {
+		av_strerror(ret, s, sizeof(s));
+		fprintf(stderr, "Error %d occurred: %s\n", ret, s);
 	}
-	rxfifo_head = rxfifo_tail = 0;
     return 0;
 }
 
 #ifdef DOVIDEOCAP
 // Remuxing thread, vcap case
-void *rxthread_vcap(void *dummy)
+void *rxthread_vcap(void *arg)
 {
-	AVRational time_base;
-	int ret = 0;
-	char s[300];
+	VIDEODEC *d = (VIDEODEC *)arg;
 	long nframes = 0;
 
-	start_dts = -1;
-	time_base.num = 1;
-	time_base.den = vcap_fps;
-	// Calculate the fragment size in frames
-	if(fragmentsize_seconds == -1)	// Special case, infinite fragment size (streaming)
-		fragmentsize = -1;
-	else fragmentsize = fragmentsize_seconds * vcap_fps;
-
 	// While it's allowed to run
-    while (rx_active)
+    while (d->rx_active)
 	{
 		// Read frame
 		char *frame;
@@ -2321,40 +4440,27 @@ void *rxthread_vcap(void *dummy)
 		struct AVPacket pkt;
 
 		// Get the frame from the V4L2 device using our videocap library
-		rc = videocap_getframe(vcap, &frame, &tv);
+		uint64_t t0 = stage_begin(d);
+		rc = videocap_getframe(d->vcap, &frame, &tv);
+		stage_end(d, ST_DEMUX, t0);
 		if(rc < 0)
 		{
 			fprintf(stderr, "videocap_getframe returned error %d\n", rc);
 			break;
 		}
-		// Save frame for the getframe function
-		pthread_mutex_lock(&readmutex);
-		memcpy(vcap_frame, frame, frame_width * frame_height * 2);
-		frame_decoded = 1;
-		pthread_mutex_unlock(&readmutex);
-		if(jpegserver_nclients > 0 && lastframe_raw)
-		{
-			uint8_t *jpeg_buf_tmp = 0;
-			unsigned long jpeg_size_tmp = 0;
-
-			yuyv_toyuv420(vcap_frame);
-			jpeg_create_buf(&jpeg_buf_tmp, &jpeg_size_tmp, lastframe_raw, frame_width, frame_height, 75);
-			pthread_mutex_lock(&jpegbufmutex);
-			if(jpeg_buf)
-			{
-				free(jpeg_buf);
-				jpeg_buf = 0;
-			}
-			jpeg_buf = jpeg_buf_tmp;
-			jpeg_size = jpeg_size_tmp;
-			pthread_mutex_unlock(&jpegbufmutex);
-			sendjpeg(jpeg_buf, jpeg_size);
-		}
-		if(!vcodec)
+		// Save frame for the getframe function; after being published, the slot
+		// will not be written again before the next frame
+		char *saved = d->tb.vcap[d->tb.back];
+		memcpy(saved, frame, d->frame_width * d->frame_height * 2);
+		jpegenc_feed(d, 0, saved, d->frame_seq + 1);
+		tb_publish(d);
+		if(!d->vcodec)
 			continue;
 
 		// Encode the frame to H.264
-		rc = videocodec_process(vcodec, frame, frame_width * frame_height * 2, &outframe, &outframelen, &keyframe);
+		t0 = stage_begin(d);
+		rc = videocodec_process(d->vcodec, frame, d->frame_width * d->frame_height * 2, &outframe, &outframelen, &keyframe);
+		stage_end(d, ST_ENCODE, t0);
 		// keyframe returned by the encoder is totally wrong,
 		// so we force a GOP size of 12 and we know that every 12th frame is a keyframe
 		if(rc < 0)
@@ -2364,148 +4470,23 @@ void *rxthread_vcap(void *dummy)
 		}
 		if(!outframelen)
 			continue;
-		keyframe = vcap_nframes % vcodec_gopsize == 0;
-		vcap_nframes++;
+		keyframe = d->vcap_nframes % vcodec_gopsize == 0;
+		d->vcap_nframes++;
 
 		// Put it in a standard libav packet
-		av_new_packet(&pkt, outframelen);
+		// We have to copy data, because outframe is a pointer to the driver memory,
+		// which is no longer valid after the next videocodec_process
+		if(av_new_packet(&pkt, outframelen) < 0)
+			continue;
 		pkt.stream_index = 0;
 		pkt.duration = 1;
 		pkt.dts = pkt.pts = nframes++;
 		pkt.flags = keyframe ? AV_PKT_FLAG_KEY : 0;
-		// We have to copy data, because outframe is a pointer to the driver memory,
-		// which is no longer valid after the next videocodec_process
 		memcpy(pkt.data, outframe, outframelen);
 
 		log_packet(0, &pkt, "in");
-
-		if(fragmentsize == 0)
-		{
-			// We are only receiving and not saving, save the received packets in a FIFO buffer
-			rxfifo[rxfifo_tail] = pkt;
-			rxfifo_tail = (rxfifo_tail+1) % RXFIFOQUEUESIZE;
-			if(rxfifo_tail == rxfifo_head)
-			{
-				av_free_packet(&rxfifo[rxfifo_tail]);
-				rxfifo_head = (rxfifo_head+1) % RXFIFOQUEUESIZE;
-			}
-			if(savenow_seconds_before || savenow_seconds_after)
-			{
-				int i = rxfifo_tail;
-				uint64_t last_dts;
-
-				// Go backward for savenow_seconds_before seconds
-				uint64_t sdts = pkt.dts - savenow_seconds_before * vcap_fps;
-				if((int64_t)sdts < 0)
-					sdts = 0;
-				i = rxfifo_tail;
-				start_dts = pkt.dts;
-				while(i != rxfifo_head)
-				{
-					i = (i + RXFIFOQUEUESIZE-1) % RXFIFOQUEUESIZE;
-					log_packet(0, &rxfifo[i], "going_back");
-					if(rxfifo[i].stream_index == stream_idx && rxfifo[i].dts <= sdts)
-						break;
-				}
-				// Go backward until a keyframe is found
-				if(!(rxfifo[i].flags & AV_PKT_FLAG_KEY))
-				{
-					while(i != rxfifo_head)
-					{
-						i = (i + RXFIFOQUEUESIZE-1) % RXFIFOQUEUESIZE;
-						log_packet(0, &rxfifo[i], "going_back_key");
-						if(rxfifo[i].stream_index == stream_idx && rxfifo[i].flags & AV_PKT_FLAG_KEY)
-							break;
-					}
-					// If there is no keyframe, go forward and find first keyframe
-					while(i != rxfifo_tail && rxfifo[i].stream_index == stream_idx &&
-						!(rxfifo[i].flags & AV_PKT_FLAG_KEY))
-					{
-						log_packet(0, &rxfifo[i], "going_forward");
-						i = (i + 1) % RXFIFOQUEUESIZE;
-					}
-				}
-
-				// Open the new file
-				ofmt_ctx = openoutput(0, destformat, savenow_path);
-				if(!ofmt_ctx)
-					return 0;
-				if(i != rxfifo_tail)
-					start_dts = rxfifo[i].dts;
-				last_dts = start_dts;
-				if(loglevel >= 5)
-					fprintf(stderr, "openoutput %s last_dts=%ld\n", savenow_path, (long)start_dts);
-
-				if(loglevel >= 4)
-					fprintf(stderr, "Went back %d seconds, saving %d frames\n", savenow_seconds_before,
-						(rxfifo_tail - i + RXFIFOQUEUESIZE) % RXFIFOQUEUESIZE);
-
-				// Write out the buffer
-				fragmentsize = 0;
-				while(i != rxfifo_tail)
-				{
-					last_dts = rxfifo[i].dts;
-					write_packet(&rxfifo[i], time_base);
-					i = (i + 1) % RXFIFOQUEUESIZE;
-				}
-
-				// Clear the FIFO
-				while(rxfifo_head != rxfifo_tail)
-				{
-					av_free_packet(&rxfifo[rxfifo_head]);
-					rxfifo_head = (rxfifo_head+1) % RXFIFOQUEUESIZE;
-				}
-				rxfifo_head = rxfifo_tail = 0;
-
-				// Work done, clear the request
-				fragmentsize = savenow_seconds_after * vcap_fps + (last_dts - start_dts);
-				if(loglevel >= 4)
-					fprintf(stderr, "Savenow: start_dts = %ld, last_dts = %ld, fragmentsize = %ld\n",
-						(long)start_dts, (long)last_dts, (long)fragmentsize);
-				savenow_seconds_before = savenow_seconds_after = 0;
-			}
-		} else {
-			if(savenow_seconds_after)
-			{
-				fragmentsize = savenow_seconds_after * vcap_fps + (pkt.dts - start_dts);
-				if(loglevel >= 4)
-					fprintf(stderr, "Updating savenow: start_dts = %ld, last_dts = %ld, fragmentsize = %ld\n",
-						(long)start_dts, (long)pkt.dts, (long)fragmentsize);
-				savenow_seconds_before = savenow_seconds_after = 0;
-			}
-			write_packet(&pkt, time_base);
-			av_free_packet(&pkt);
-		}
+		mux_queue(d, &pkt);
     }
-
-	if(ofmt_ctx)
-	{
-		// Write the trailer of the file
-		av_write_trailer(ofmt_ctx);
-
-		/* close output */
-		if (ofmt_ctx && !(ofmt_ctx->flags & AVFMT_NOFILE))
-		{
-			avio_close(ofmt_ctx->pb);
-			renametmp(ofmt_ctx->filename);
-		}
-		avformat_free_context(ofmt_ctx);
-		ofmt_ctx = 0;
-
-		if (ret < 0 && ret != AVERROR_EOF) {
-			av_strerror(ret, s, sizeof(s));
-			fprintf(stderr, "Error %d occurred: %s\n", ret, s);
-			return 0;
-		}
-	}
-
-	// Clear the FIFO
-	while(rxfifo_head != rxfifo_tail)
-	{
-		av_free_packet(&rxfifo[rxfifo_head]);
-		rxfifo_head = (rxfifo_head+1) % RXFIFOQUEUESIZE;
-	}
-	rxfifo_head = rxfifo_tail = 0;
     return 0;
 }
 #endif
@@ -2513,54 +4494,122 @@ void *rxthread_vcap(void *dummy)
 // Start a thread that reads frames from the input AVFormatContext and remuxes
 // them to the specified file
 
+// Run the receiving thread and wake up the consumers waiting for a frame when it ends
+static void *rxthread_run(void *arg)
+{
+	VIDEODEC *d = (VIDEODEC *)arg;
+
+#ifdef DOVIDEOCAP
+	if(d->vcap)
+		rxthread_vcap(d);
+	else
+#endif
+	rxthread(d);
+	mux_stop(d);
+	pthread_mutex_lock(&d->readmutex);
+	d->rx_running = 0;
+	pthread_cond_broadcast(&d->framecond);
+	pthread_mutex_unlock(&d->readmutex);
+	return 0;
+}
+
 static int startremux(lua_State *L)
 {
-	if(rx_tid)
+	VIDEODEC *d = getdec(L);
+	int i, muxqueue = MUX_QUEUESIZE, overflow = MUX_DROPGOP;
+	const char *p;
+
+	if(d->rx_tid)
 	{
 		luaL_error(L, "Another startremux already in progress");
 	}
+	if(d->prefetch.size)
+		luaL_error(L, "startremux cannot be used with prefetch");
 #ifdef DOVIDEOCAP
-	if(!pFormatCtx && !vcap)
+	if(!d->pFormatCtx && !d->vcap)
 	{
 		luaL_error(L, "Call init or capture first");
 #else
-	if(!pFormatCtx)
+	if(!d->pFormatCtx)
 	{
 		luaL_error(L, "Call init first");
 #endif
 	}
-	strcpy(destfile, lua_tostring(L, 1));
-	strcpy(destformat, lua_tostring(L, 2));
-	fragmentsize_seconds = lua_tointeger(L, 3);
-	if(fragmentsize_seconds != -1)
+	strcpy(d->destfile, lua_tostring(L, 1));
+	strcpy(d->destformat, lua_tostring(L, 2));
+	d->fragmentsize_seconds = lua_tointeger(L, 3);
+	if(lua_istable(L, 4))
+	{
+		lua_getfield(L, 4, "mux_queue");
+		if(lua_isnumber(L, -1))
+			muxqueue = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if(muxqueue <= 0)
+			luaL_error(L, "mux_queue has to be positive");
+		lua_getfield(L, 4, "mux_overflow");
+		p = lua_tostring(L, -1);
+		if(p)
+		{
+			if(!strcmp(p, "block"))
+				overflow = MUX_BLOCK;
+			else if(!strcmp(p, "nonkey"))
+				overflow = MUX_DROPNONKEY;
+			else if(!strcmp(p, "gop"))
+				overflow = MUX_DROPGOP;
+			else luaL_error(L, "mux_overflow has to be block, nonkey or gop");
+		}
+		lua_pop(L, 1);
+	}
+	if(d->fragmentsize_seconds != -1)
 	{
-		destext = strrchr(destfile, '.');
-		if(!destext)
-			destext = "";
-		else *destext++ = 0;
-	} else destext = "";
+		d->destext = strrchr(d->destfile, '.');
+		if(!d->destext)
+			d->destext = "";
+		else *d->destext++ = 0;
+	} else d->destext = "";
 	// Generated files will be in the form destfile_timestamp.extension
 	// Create the first fragment and start the decoding thread
-	if(fragmentsize_seconds)
+	if(d->fragmentsize_seconds)
 	{
-		ofmt_ctx = openoutput(L, destformat, 0);
-		if(!ofmt_ctx)
+		d->ofmt_ctx = openoutput(d, L, d->destformat, 0);
+		if(!d->ofmt_ctx)
 		{
 			lua_pushboolean(L, 0);
 			return 1;
 		}
 	}
-	rx_active = 1;
-	savenow_seconds_before = savenow_seconds_after = 0;
-#ifdef DOVIDEOCAP
-	if(vcap)
+	if(!d->fragmentsize_seconds)
 	{
-		pthread_create(&rx_tid, 0, rxthread_vcap, 0);
-		lua_pushboolean(L, 1);
-		return 1;
+		// Only receiving, keep the last packets for savenow
+		int seconds = PREROLL_SECONDS, mb = PREROLL_MB;
+		AVRational vtb = mux_time_base(d, d->stream_idx);
+
+		if(lua_istable(L, 4))
+		{
+			lua_getfield(L, 4, "preroll_seconds");
+			if(lua_isnumber(L, -1))
+				seconds = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			lua_getfield(L, 4, "preroll_mb");
+			if(lua_isnumber(L, -1))
+				mb = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+		if(seconds <= 0 || mb <= 0)
+			luaL_error(L, "preroll_seconds and preroll_mb have to be positive");
+		if(preroll_init(d, (long)mb << 20, (int64_t)seconds * vtb.den / vtb.num))
+			luaL_error(L, "Not enough memory for the pre-roll buffer");
 	}
-#endif
-	pthread_create(&rx_tid, 0, rxthread, 0);
+	d->rx_active = 1;
+	d->rx_running = 1;
+	d->savenow_seconds_before = d->savenow_seconds_after = 0;
+	if(d->pCodecCtx)
+		for(i = 0; i < 3; i++)
+			if(!d->tb.frame[i])
+				d->tb.frame[i] = av_frame_alloc();
+	if(mux_start(d, muxqueue, overflow))
+		luaL_error(L, "Cannot start the muxing thread");
+	pthread_create(&d->rx_tid, 0, rxthread_run, d);
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -2568,16 +4617,17 @@ static int startremux(lua_State *L)
 // Stop the remuxing thread
 static int stopremux(lua_State *L)
 {
+	VIDEODEC *d = getdec(L);
 	void *retval;
 
-	if(!rx_tid)
+	if(!d->rx_tid)
 	{
 		luaL_error(L, "Call startremux first");
 	}
 	// Tell the thread to stop and wait for it
-	rx_active = 0;
-	pthread_join(rx_tid, &retval);
-	rx_tid = 0;
+	d->rx_active = 0;
+	pthread_join(d->rx_tid, &retval);
+	d->rx_tid = 0;
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -2585,24 +4635,310 @@ static int stopremux(lua_State *L)
 // Stop the remuxing thread
 static int savenow(lua_State *L)
 {
+	VIDEODEC *d = getdec(L);
 	const char *p;
 
-	if(!rx_tid)
+	if(!d->rx_tid)
 	{
 		luaL_error(L, "Call startremux first");
 	}
-	savenow_seconds_before = lua_tointeger(L, 1);
-	savenow_seconds_after = lua_tointeger(L, 2);
+	d->savenow_seconds_before = lua_tointeger(L, 1);
+	d->savenow_seconds_after = lua_tointeger(L, 2);
 	p = lua_tostring(L, 3);
 	if(!p)
 		luaL_error(L, "Missing save path");
-	strcpy(savenow_path, p);
+	strcpy(d->savenow_path, p);
 	if(loglevel >= 5)
-		fprintf(stderr, "savenow(%d,%d,%s)\n", savenow_seconds_before, savenow_seconds_after, savenow_path);
+		fprintf(stderr, "savenow(%d,%d,%s)\n", d->savenow_seconds_before, d->savenow_seconds_after, d->savenow_path);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// Return the statistics of the muxing thread queue
+static int muxstats(lua_State *L)
+{
+	VIDEODEC *d = getdec(L);
+
+	lua_createtable(L, 0, 8);
+	pthread_mutex_lock(&d->mux.mutex);
+	lua_pushinteger(L, d->mux.n);
+	lua_setfield(L, -2, "queued");
+	lua_pushinteger(L, d->mux.max_n);
+	lua_setfield(L, -2, "max_queued");
+	lua_pushinteger(L, d->mux.size);
+	lua_setfield(L, -2, "queue_size");
+	lua_pushinteger(L, d->mux.dropped);
+	lua_setfield(L, -2, "dropped");
+	lua_pushinteger(L, d->mux.written);
+	lua_setfield(L, -2, "written");
+	lua_pushnumber(L, d->mux.write_ms_last);
+	lua_setfield(L, -2, "write_ms_last");
+	lua_pushnumber(L, d->mux.written ? d->mux.write_ms_total / d->mux.written : 0);
+	lua_setfield(L, -2, "write_ms_avg");
+	lua_pushnumber(L, d->mux.write_ms_max);
+	lua_setfield(L, -2, "write_ms_max");
+	pthread_mutex_unlock(&d->mux.mutex);
+	return 1;
+}
+
+/***************************************
+Per-stage statistics
+***************************************/
+
+static const char *const counter_names[] = {"frames_decoded", "frames_skipped", "packets_dropped",
+	"jpeg_frames", "jpeg_skipped", "jpeg_clients", "mux_queued", "mux_max_queued", "prefetch_queued", "encoder_queued"};
+#define NCOUNTERS (int)(sizeof(counter_names) / sizeof(*counter_names))
+
+// Get the counters in the order of counter_names
+static void stats_counters(VIDEODEC *d, long *v)
+{
+	v[0] = __atomic_load_n(&d->stats.frames_decoded, __ATOMIC_RELAXED);
+	v[1] = __atomic_load_n(&d->stats.frames_skipped, __ATOMIC_RELAXED);
+	v[3] = __atomic_load_n(&d->stats.jpeg_frames, __ATOMIC_RELAXED);
+	v[4] = __atomic_load_n(&d->stats.jpeg_skipped, __ATOMIC_RELAXED);
+	v[5] = __atomic_load_n(&d->jpegserver_nclients, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&d->mux.mutex);
+	v[2] = d->mux.dropped;
+	v[6] = d->mux.n;
+	v[7] = d->mux.max_n;
+	pthread_mutex_unlock(&d->mux.mutex);
+	pthread_mutex_lock(&d->prefetch.mutex);
+	v[8] = d->prefetch.count;
+	pthread_mutex_unlock(&d->prefetch.mutex);
+	pthread_mutex_lock(&d->enc.mutex);
+	v[9] = d->enc.n;
+	pthread_mutex_unlock(&d->enc.mutex);
+}
+
+// Append one row for every stage and every counter to the CSV file
+static void stats_writecsv(VIDEODEC *d)
+{
+	double t = (stats_now_us() - d->stats.start_us) * 1e-6;
+	STATSUMMARY sum;
+	long v[NCOUNTERS];
+	int i;
+
+	for(i = 0; i < ST_N; i++)
+	{
+		stats_summary(&d->stats.stage[i], &sum);
+		fprintf(d->stats.csv, "%.3f,%s,%lu,%.1f,%.1f,%.1f,%.1f,%.1f\n", t, stage_names[i], (unsigned long)sum.count,
+			sum.avg_us, sum.p50_us, sum.p95_us, sum.p99_us, sum.max_us);
+	}
+	stats_counters(d, v);
+	for(i = 0; i < NCOUNTERS; i++)
+		fprintf(d->stats.csv, "%.3f,%s,%ld,,,,,\n", t, counter_names[i], v[i]);
+	fflush(d->stats.csv);
+}
+
+static void *stats_thread(void *arg)
+{
+	VIDEODEC *d = (VIDEODEC *)arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&d->stats.mutex);
+	while(!d->stats.stop)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += (time_t)d->stats.interval;
+		ts.tv_nsec += (long)((d->stats.interval - (time_t)d->stats.interval) * 1e9);
+		if(ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while(!d->stats.stop && pthread_cond_timedwait(&d->stats.cond, &d->stats.mutex, &ts) != ETIMEDOUT);
+		if(!d->stats.stop)
+			stats_writecsv(d);
+	}
+	pthread_mutex_unlock(&d->stats.mutex);
+	return 0;
+}
+
+static void stats_csvstop(VIDEODEC *d)
+{
+	if(!d->stats.tid)
+		return;
+	pthread_mutex_lock(&d->stats.mutex);
+	d->stats.stop = 1;
+	pthread_cond_signal(&d->stats.cond);
+	pthread_mutex_unlock(&d->stats.mutex);
+	pthread_join(d->stats.tid, 0);
+	d->stats.tid = 0;
+	// The last row has the final values
+	stats_writecsv(d);
+	fclose(d->stats.csv);
+	d->stats.csv = 0;
+}
+
+static int stats_csvstart(VIDEODEC *d, const char *path, double interval)
+{
+	d->stats.csv = fopen(path, "a");
+	if(!d->stats.csv)
+		return -1;
+	if(!ftell(d->stats.csv))
+		fprintf(d->stats.csv, "time_s,name,count,avg_us,p50_us,p95_us,p99_us,max_us\n");
+	d->stats.interval = interval;
+	d->stats.stop = 0;
+	if(pthread_create(&d->stats.tid, 0, stats_thread, d))
+	{
+		d->stats.tid = 0;
+		fclose(d->stats.csv);
+		d->stats.csv = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* Return the latency histograms summary of every stage and the counters; the options
+ * can enable or disable the timing, reset the statistics and start or stop the CSV dump
+ */
+static int lua_stats(lua_State *L)
+{
+	VIDEODEC *d = getdec(L);
+	STATSUMMARY sum;
+	long v[NCOUNTERS];
+	int i;
+
+	if(lua_istable(L, 1))
+	{
+		lua_getfield(L, 1, "enable");
+		if(!lua_isnil(L, -1))
+			__atomic_store_n(&d->stats.enabled, lua_toboolean(L, -1), __ATOMIC_RELAXED);
+		lua_pop(L, 1);
+		lua_getfield(L, 1, "reset");
+		if(lua_toboolean(L, -1))
+		{
+			// Samples recorded by other threads meanwhile can be partially lost
+			memset(d->stats.stage, 0, sizeof(d->stats.stage));
+			__atomic_store_n(&d->stats.frames_decoded, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&d->stats.frames_skipped, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&d->stats.jpeg_frames, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&d->stats.jpeg_skipped, 0, __ATOMIC_RELAXED);
+			d->stats.start_us = stats_now_us();
+		}
+		lua_pop(L, 1);
+		lua_getfield(L, 1, "csv");
+		if(!lua_isnil(L, -1))
+		{
+			const char *path = lua_tostring(L, -1);
+			double interval = getoptnumber(L, 1, "interval", 10);
+
+			if(interval <= 0)
+				luaL_error(L, "<video_decoder>: the CSV interval has to be positive");
+			stats_csvstop(d);
+			if(lua_toboolean(L, -1) && path && stats_csvstart(d, path, interval))
+				luaL_error(L, "<video_decoder>: cannot write %s", path);
+		}
+		lua_pop(L, 1);
+	}
+	lua_createtable(L, 0, ST_N + NCOUNTERS + 1);
+	lua_pushnumber(L, (stats_now_us() - d->stats.start_us) * 1e-6);
+	lua_setfield(L, -2, "uptime_s");
+	for(i = 0; i < ST_N; i++)
+	{
+		stats_summary(&d->stats.stage[i], &sum);
+		lua_createtable(L, 0, 6);
+		lua_pushnumber(L, sum.count);
+		lua_setfield(L, -2, "count");
+		lua_pushnumber(L, sum.avg_us);
+		lua_setfield(L, -2, "avg_us");
+		lua_pushnumber(L, sum.p50_us);
+		lua_setfield(L, -2, "p50_us");
+		lua_pushnumber(L, sum.p95_us);
+		lua_setfield(L, -2, "p95_us");
+		lua_pushnumber(L, sum.p99_us);
+		lua_setfield(L, -2, "p99_us");
+		lua_pushnumber(L, sum.max_us);
+		lua_setfield(L, -2, "max_us");
+		lua_setfield(L, -2, stage_names[i]);
+	}
+	stats_counters(d, v);
+	for(i = 0; i < NCOUNTERS; i++)
+	{
+		lua_pushinteger(L, v[i]);
+		lua_setfield(L, -2, counter_names[i]);
+	}
+	return 1;
+}
+
+// Seek to the frame at the given frame number or time in seconds
+static int video_decoder_seek(lua_State *L)
+{
+	VIDEODEC *d = getdec(L);
+	double pos = luaL_checknumber(L, 1);
+	const char *unit = luaL_optstring(L, 2, "frame");
+	int prefetch = d->prefetch.size;
+	int64_t pts, start;
+	AVStream *st;
+	int i, rc;
+
+	if(!d->pFormatCtx || !d->pCodecCtx)
+		luaL_error(L, "<video_decoder>: seek is only available for files opened with init");
+	if(d->rx_tid)
+		luaL_error(L, "<video_decoder>: seek is not available after startremux");
+	if(pos < 0)
+		luaL_error(L, "<video_decoder>: cannot seek before the beginning");
+	st = d->pFormatCtx->streams[d->stream_idx];
+	start = d->index.nframes ? d->index.pts[0] : st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+	if(!strcmp(unit, "frame"))
+	{
+		if(d->index.nframes)
+		{
+			if(pos >= d->index.nframes)
+				return push_eos(L, 0);
+			pts = d->index.pts[(int)pos];
+		} else if(st->avg_frame_rate.num && st->avg_frame_rate.den)
+			pts = start + av_rescale((int64_t)pos, (int64_t)st->avg_frame_rate.den * st->time_base.den,
+				(int64_t)st->avg_frame_rate.num * st->time_base.num);
+		else luaL_error(L, "<video_decoder>: cannot seek to a frame without the frame rate or the index");
+	} else if(!strcmp(unit, "seconds"))
+	{
+		pts = start + (int64_t)(pos * st->time_base.den / st->time_base.num);
+		if(d->index.nframes)
+		{
+			i = lower_bound64(d->index.pts, d->index.nframes, pts);
+			if(i == d->index.nframes)
+				return push_eos(L, 0);
+			pts = d->index.pts[i];
+		}
+	} else luaL_error(L, "<video_decoder>: unit has to be frame or seconds");
+	// Frames already decoded by the prefetch thread are discarded
+	prefetch_stop(d);
+	rc = seek_pts(d, pts);
+	if(prefetch && prefetch_start(d, prefetch))
+		luaL_error(L, "<video_decoder>: could not restart the prefetch thread");
+	if(rc <= 0)
+		return push_eos(L, rc);
 	lua_pushboolean(L, 1);
 	return 1;
 }
 
+// Return the threading configuration of the decoder after it has been opened
+static int decoderinfo(lua_State *L)
+{
+	VIDEODEC *d = getdec(L);
+	AVCodecContext *c = d->pCodecCtx;
+	int delay;
+
+	if(!c)
+		luaL_error(L, "<video_decoder>: no decoder is open");
+	// Frames that enter the decoder before the first one comes out
+	delay = c->has_b_frames;
+	if(c->active_thread_type & FF_THREAD_FRAME)
+		delay += c->thread_count - 1;
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, c->thread_count);
+	lua_setfield(L, -2, "thread_count");
+	lua_pushstring(L, c->active_thread_type & FF_THREAD_FRAME ? "frame" :
+		c->active_thread_type & FF_THREAD_SLICE ? "slice" : "none");
+	lua_setfield(L, -2, "thread_type");
+	lua_pushinteger(L, delay);
+	lua_setfield(L, -2, "frame_delay");
+	lua_pushboolean(L, (c->flags & CODEC_FLAG_LOW_DELAY) != 0);
+	lua_setfield(L, -2, "low_delay");
+	return 1;
+}
+
 // Set the logging level
 static int lua_loglevel(lua_State *L)
 {
@@ -2610,6 +4946,31 @@ static int lua_loglevel(lua_State *L)
 	return 0;
 }
 
+static int lua_setthreads(lua_State *L)
+{
+	int n = lua_tointeger(L, 1);
+
+	if(n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n > MAXTHREADS)
+		n = MAXTHREADS;
+	if(n < 1)
+		n = 1;
+	pool_setthreads(n);
+	lua_pushinteger(L, pool.nthreads);
+	return 1;
+}
+
+static int lua_simd(lua_State *L)
+{
+	int simd = lua_isnoneornil(L, 1) || lua_toboolean(L, 1);
+
+	motion_select(simd);
+	rgbrow_select(simd, &rgbrow_byte, &rgbrow_float);
+	lua_pushstring(L, yuvlut_select(simd));
+	return 1;
+}
+
 static int lua_diffimages(lua_State * L)
 {
 	int c, x, y;
@@ -2688,6 +5049,127 @@ static int lua_diffimages(lua_State * L)
 	return 1;
 }
 
+// Last frame returned by frame_*: frame_batch_resized with take moves the frames
+// from pFrame_yuv to batchframes, so then it's the last frame of the batch
+static AVFrame *lastframe(VIDEODEC *d)
+{
+	if(d->pFrame_yuv && d->pFrame_yuv->data[0])
+		return d->pFrame_yuv;
+	if(d->nbuffered_frames > 0 && d->batchframes[d->nbuffered_frames - 1]->data[0])
+		return d->batchframes[d->nbuffered_frames - 1];
+	return 0;
+}
+
+// Get the luma plane of the last frame returned by frame_*, 0 if there is none
+static const uint8_t *lastframe_luma(VIDEODEC *d, int *w, int *h, int *linesize, int *step)
+{
+	AVFrame *frame;
+
+#ifdef DOVIDEOCAP
+	if(d->vcap)
+	{
+		*w = d->frame_width;
+		*h = d->frame_height;
+		*linesize = 2 * d->frame_width;
+		*step = 2;
+		return (const uint8_t *)d->vcap_last;
+	}
+#endif
+	if(!(frame = lastframe(d)))
+		return 0;
+	switch(frame->format)
+	{
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+	case AV_PIX_FMT_YUV422P:
+	case AV_PIX_FMT_YUVJ422P:
+	case AV_PIX_FMT_YUV444P:
+	case AV_PIX_FMT_YUVJ444P:
+	case AV_PIX_FMT_NV12:
+	case AV_PIX_FMT_NV21:
+	case AV_PIX_FMT_GRAY8:
+		*step = 1;
+		break;
+	case AV_PIX_FMT_YUYV422:
+		*step = 2;
+		break;
+	default:
+		return 0;
+	}
+	*w = frame->width;
+	*h = frame->height;
+	*linesize = frame->linesize[0];
+	return frame->data[0];
+}
+
+/* Compare the luma of the last returned frame with the background of the motion
+ * detector; the detector is created at the first call and recreated when the frame
+ * size or the options that change its grid are different
+ */
+static int lua_motion(lua_State *L)
+{
+	VIDEODEC *d = getdec(L);
+	MOTIONDET *m = &d->motion;
+	const uint8_t *luma;
+	int w, h, linesize, step, scale, block, full = 0, active, maxactive, nblocks, i;
+	double area, rate;
+	THByteTensor *t;
+
+	luma = lastframe_luma(d, &w, &h, &linesize, &step);
+	if(!luma)
+	{
+		if(!lastframe(d))
+			return 0;
+		luaL_error(L, "<video_decoder>: motion needs a YUV or gray frame, pixel format is %d", lastframe(d)->format);
+	}
+	scale = getoptnumber(L, 1, "scale", 2);
+	block = getoptnumber(L, 1, "block", 16);
+	area = getoptnumber(L, 1, "area", 0.01);
+	rate = getoptnumber(L, 1, "learning_rate", 1.0 / 32);
+	if(scale != 1 && scale != 2 && scale != 4)
+		luaL_error(L, "<video_decoder>: motion scale has to be 1, 2 or 4");
+	if(block < 16 || block % 16)
+		luaL_error(L, "<video_decoder>: motion block has to be a multiple of 16");
+	if(rate <= 0 || rate > 1)
+		luaL_error(L, "<video_decoder>: motion learning_rate has to be between 0 and 1");
+	if(lua_istable(L, 1))
+	{
+		lua_getfield(L, 1, "full");
+		full = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 1, "reset");
+		if(lua_toboolean(L, -1))
+			m->nframes = 0;
+		lua_pop(L, 1);
+	}
+	if(!m->map || m->width != w || m->height != h || m->scale != scale || m->block != block)
+	{
+		motion_free(m);
+		m->width = w;
+		m->height = h;
+		m->scale = scale;
+		m->block = block;
+		if(motion_init(m))
+			luaL_error(L, "<video_decoder>: out of memory");
+	}
+	m->sensitivity = getoptnumber(L, 1, "sensitivity", 20);
+	m->block_percent = getoptnumber(L, 1, "block_area", 0.25) * 100 + 0.5;
+	// The learning rate is rounded to a power of 2, from 1 to 1/128
+	for(m->shift = 0; m->shift < MOTION_FRACBITS && rate < 0.75 / (1 << m->shift); m->shift++);
+	nblocks = m->bw * m->bh;
+	maxactive = full ? 0 : (int)(area * nblocks + 0.999);
+	if(!full && maxactive < 1)
+		maxactive = 1;
+	active = motion_detect(m, luma, linesize, step, maxactive);
+	lua_pushboolean(L, active && active >= area * nblocks);
+	lua_pushnumber(L, nblocks ? (double)active / nblocks : 0);
+	t = THByteTensor_newWithSize2d(m->bh, m->bw);
+	for(i = 0; i < m->bh; i++)
+		memcpy(THByteTensor_data(t) + i * t->stride[0], m->map + i * m->bw, m->bw);
+	luaT_pushudata(L, t, "torch.ByteTensor");
+	return 3;
+}
+
 #ifdef DOVIDEOCAP
 // Open the capture device and start it with the given parameters
 static int videocap_init(lua_State *L)
@@ -2698,66 +5180,68 @@ static int videocap_init(lua_State *L)
 	int nbuffers = lua_tointeger(L, 5);
 	const char *codec = lua_tostring(L, 6);
 	int q = lua_tointeger(L, 7);
-	int rc;
+	int i, rc;
 	int dummy_keyframe;
 	char *extradata;
+	VIDEODEC *d = newdec(L);
 
-	if(vcap)
-		videocap_close(vcap);
-	vcap_nframes = 0;
-	vcap = videocap_open(device);
-	vcap_fps = lua_tointeger(L, 4);
+	d->vcap_nframes = 0;
+	d->vcap = videocap_open(device);
+	d->vcap_fps = lua_tointeger(L, 4);
 	if(!q)
 		q = 25;
-	if(!vcap)
+	if(!d->vcap)
 	{
 		luaL_error(L, "Error opening device %s", device);
 	}
 	if(loglevel >= 3)
-		fprintf(stderr, "Starting camera capture at %dx%d, fps=%d, nbuffers=%d\n", w, h, vcap_fps, nbuffers ? nbuffers : 1);
-	rc = videocap_startcapture(vcap, w, h, V4L2_PIX_FMT_YUYV, vcap_fps, nbuffers ? nbuffers : 1);
+		fprintf(stderr, "Starting camera capture at %dx%d, fps=%d, nbuffers=%d\n", w, h, d->vcap_fps, nbuffers ? nbuffers : 1);
+	rc = videocap_startcapture(d->vcap, w, h, V4L2_PIX_FMT_YUYV, d->vcap_fps, nbuffers ? nbuffers : 1);
 	if(rc < 0)
 	{
-		videocap_close(vcap);
-		vcap = 0;
+		videocap_close(d->vcap);
+		d->vcap = 0;
 		luaL_error(L, "Error %d starting capture", rc);
 	}
 	if(codec && *codec)
 	{
-		vcodec = videocodec_open(codec);
-		if(!vcodec)
+		d->vcodec = videocodec_open(codec);
+		if(!d->vcodec)
 		{
-			videocap_close(vcap);
-			vcap = 0;
+			videocap_close(d->vcap);
+			d->vcap = 0;
 			luaL_error(L, "Error opening codec device %s", codec);
 		}
-		rc = videocodec_setcodec(vcodec, V4L2_PIX_FMT_H264);
+		rc = videocodec_setcodec(d->vcodec, V4L2_PIX_FMT_H264);
 		// Quantizer, 1-51, lower value means better quality
 		// For inter frames, we decrease the quality slightly
-		rc = videocodec_setcodecparam(vcodec, V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP, q);
-		rc |= videocodec_setcodecparam(vcodec, V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP, q+5);
-		rc |= videocodec_setcodecparam(vcodec, V4L2_CID_MPEG_VIDEO_H264_B_FRAME_QP, q+5);
-		rc |= videocodec_setcodecparam(vcodec, V4L2_CID_MPEG_VIDEO_GOP_SIZE, vcodec_gopsize);
-		rc |= videocodec_setcodecparam(vcodec, V4L2_CID_MPEG_VIDEO_H264_LEVEL, V4L2_MPEG_VIDEO_H264_LEVEL_4_0);
-		rc |= videocodec_setformat(vcodec, w, h, V4L2_PIX_FMT_YUYV, vcap_fps);
-		rc |= videocodec_process(vcodec, (const char *)-1, 0,
-			&extradata, (unsigned *)&vcodec_extradata_size, &dummy_keyframe);
+		rc = videocodec_setcodecparam(d->vcodec, V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP, q);
+		rc |= videocodec_setcodecparam(d->vcodec, V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP, q+5);
+		rc |= videocodec_setcodecparam(d->vcodec, V4L2_CID_MPEG_VIDEO_H264_B_FRAME_QP, q+5);
+		rc |= videocodec_setcodecparam(d->vcodec, V4L2_CID_MPEG_VIDEO_GOP_SIZE, vcodec_gopsize);
+		rc |= videocodec_setcodecparam(d->vcodec, V4L2_CID_MPEG_VIDEO_H264_LEVEL, V4L2_MPEG_VIDEO_H264_LEVEL_4_0);
+		rc |= videocodec_setformat(d->vcodec, w, h, V4L2_PIX_FMT_YUYV, d->vcap_fps);
+		rc |= videocodec_process(d->vcodec, (const char *)-1, 0,
+			&extradata, (unsigned *)&d->vcodec_extradata_size, &dummy_keyframe);
 		if(rc)
 		{
-			videocap_close(vcap);
-			vcap = 0;
-			videocodec_close(vcodec);
-			vcodec = 0;
+			videocap_close(d->vcap);
+			d->vcap = 0;
+			videocodec_close(d->vcodec);
+			d->vcodec = 0;
 			luaL_error(L, "Error setting encoding parameters");
 		}
-		vcodec_extradata = malloc(vcodec_extradata_size);
-		memcpy(vcodec_extradata, extradata, vcodec_extradata_size);
+		d->vcodec_extradata = malloc(d->vcodec_extradata_size);
+		memcpy(d->vcodec_extradata, extradata, d->vcodec_extradata_size);
 	}
-	vcap_frame = malloc(w * h * 2);
-	frame_width = w;
-	frame_height = h;
-	stream_idx = 0; // Required by write_packet
-	lua_pushboolean(L, 1);
+	// Three slots for the triple buffer
+	d->vcap_frame = malloc(w * h * 2 * 3);
+	for(i = 0; i < 3; i++)
+		d->tb.vcap[i] = (char *)d->vcap_frame + i * w * h * 2;
+	d->frame_width = w;
+	d->frame_height = h;
+	d->stream_idx = 0; // Required by write_packet
+	setdefdec(L, d);
 	return 1;
 }
 #endif
@@ -2767,113 +5251,269 @@ struct PD {
 	const char *dirpath, *url, *auth, *device;
 };
 
-static int encoderclose(lua_State *L);
+// Convert, encode and write one frame of the queue
+static void encoder_frame(VIDEODEC *d, ENCFRAME *f)
+{
+	AVFrame *yuv = d->enc.pFrame_yuv;
+	int w = d->enc.width, h = d->enc.height;
+	int c, i, i1, got, rc;
+	long plane = (long)w * h;
+	uint64_t t0 = stage_begin(d);
+	char s[300];
+
+	// The encoder never resizes, so the planes are converted directly to yuv420p two rows at a time
+	for(i = 0; i < h; i += 2)
+	{
+		uint8_t *y0 = yuv->data[0] + yuv->linesize[0] * i, *u = yuv->data[1] + yuv->linesize[1] * (i/2);
+		uint8_t *v = yuv->data[2] + yuv->linesize[2] * (i/2);
+
+		i1 = i + 1 < h ? i + 1 : i;
+		if(f->isfloat)
+		{
+			const float *rgb[6];
+
+			for(c = 0; c < 3; c++)
+			{
+				rgb[c] = (const float *)f->data + plane * c + (long)w * i;
+				rgb[c+3] = (const float *)f->data + plane * c + (long)w * i1;
+			}
+			rgbrow_float(rgb, y0, yuv->data[0] + yuv->linesize[0] * i1, u, v, w);
+		} else {
+			const uint8_t *rgb[6];
+
+			for(c = 0; c < 3; c++)
+			{
+				rgb[c] = (const uint8_t *)f->data + plane * c + (long)w * i;
+				rgb[c+3] = (const uint8_t *)f->data + plane * c + (long)w * i1;
+			}
+			rgbrow_byte(rgb, y0, yuv->data[0] + yuv->linesize[0] * i1, u, v, w);
+		}
+	}
+	AVRational invfps = {1, d->enc.fps};
+	d->enc.pFrame_yuv->pts = av_rescale_q(d->enc.curframe, invfps, d->enc.fmt_ctx->streams[0]->time_base);
+	d->enc.curframe++;
+	rc = avcodec_encode_video2(d->enc.fmt_ctx->streams[0]->codec, &d->enc.pkt, d->enc.pFrame_yuv, &got);
+	stage_end(d, ST_ENCODE, t0);
+	if(rc >= 0 && got)
+	{
+		int ret = av_write_frame(d->enc.fmt_ctx, &d->enc.pkt);
+		if (ret < 0)
+		{
+			av_strerror(ret, s, sizeof(s));
+			fprintf(stderr, "Error muxing packet: %s\n", s);
+		}
+		av_free_packet(&d->enc.pkt);
+	} else if(rc < 0)
+	{
+		av_strerror(rc, s, sizeof(s));
+		fprintf(stderr, "Error encoding frame: %s\n", s);
+	}
+}
+
+// Encoding thread, converts, encodes and writes the queued frames until the queue is
+// empty and encoder_close has asked it to stop
+static void *encoderthread(void *arg)
+{
+	VIDEODEC *d = (VIDEODEC *)arg;
+	ENCFRAME *f;
+
+	pthread_mutex_lock(&d->enc.mutex);
+	for(;;)
+	{
+		while(!d->enc.n && !d->enc.stop)
+			pthread_cond_wait(&d->enc.cond, &d->enc.mutex);
+		if(!d->enc.n)
+			break;
+		f = &d->enc.queue[d->enc.head];
+		pthread_mutex_unlock(&d->enc.mutex);
+		// The slot is not reused until it's removed from the queue
+		encoder_frame(d, f);
+		pthread_mutex_lock(&d->enc.mutex);
+		d->enc.head = (d->enc.head + 1) % d->enc.depth;
+		d->enc.n--;
+		pthread_cond_broadcast(&d->enc.cond);
+	}
+	pthread_mutex_unlock(&d->enc.mutex);
+	return 0;
+}
 
 static int encoderopen(lua_State *L)
 {
-	encoderclose(L);
+	VIDEODEC *d = getdec(L);
+	encoder_close(d);
 	const char *destformat = lua_tostring(L, 1);
 	const char *destpath = lua_tostring(L, 2);
-	enc.width = lua_tointeger(L, 3);
-	enc.height = lua_tointeger(L, 4);
-	enc.fps = lua_tointeger(L, 5);
-	enc.curframe = 0;
-	enc.fmt_ctx = openoutput2(L, destformat, destpath, enc.width, enc.height, enc.fps);
-	enc.sws_ctx = sws_getContext(enc.width, enc.height, AV_PIX_FMT_RGB24, enc.width, enc.height, AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, 0, 0, 0);
-	enc.sws_rgb = (uint8_t *)malloc((3 * enc.width + 3) / 4 * 4 * enc.height);
-	enc.pFrame_yuv = avcodec_alloc_frame();
-	enc.pFrame_yuv->height = enc.height;
-	enc.pFrame_yuv->width = enc.width;
-	enc.pFrame_yuv->data[0] = av_malloc((enc.width + 3) / 4 * 4 * enc.height);
-	enc.pFrame_yuv->data[1] = av_malloc((enc.width/2 + 3) / 4 * 4 * (enc.height/2));
-	enc.pFrame_yuv->data[2] = av_malloc((enc.width/2 + 3) / 4 * 4 * (enc.height/2));
-	enc.pFrame_yuv->linesize[0] = enc.width;
-	enc.pFrame_yuv->linesize[1] = enc.width/2;
-	enc.pFrame_yuv->linesize[2] = enc.width/2;
-	enc.pFrame_yuv->format = AV_PIX_FMT_YUV420P;
+	int depth = 8;
+
+	if(lua_istable(L, 6))
+	{
+		lua_getfield(L, 6, "queue");
+		if(!lua_isnil(L, -1))
+			depth = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if(depth < 1)
+			luaL_error(L, "<video_decoder>: the encoder queue needs at least one frame");
+	}
+	d->enc.width = lua_tointeger(L, 3);
+	d->enc.height = lua_tointeger(L, 4);
+	d->enc.fps = lua_tointeger(L, 5);
+	d->enc.curframe = 0;
+	d->enc.fmt_ctx = openoutput2(d, L, destformat, destpath, d->enc.width, d->enc.height, d->enc.fps);
+	d->enc.pFrame_yuv = avcodec_alloc_frame();
+	d->enc.pFrame_yuv->height = d->enc.height;
+	d->enc.pFrame_yuv->width = d->enc.width;
+	d->enc.pFrame_yuv->data[0] = av_malloc((d->enc.width + 3) / 4 * 4 * d->enc.height);
+	// Odd sizes have a last chroma column and row for the last luma column and row
+	d->enc.pFrame_yuv->data[1] = av_malloc(((d->enc.width + 1)/2 + 3) / 4 * 4 * ((d->enc.height + 1)/2));
+	d->enc.pFrame_yuv->data[2] = av_malloc(((d->enc.width + 1)/2 + 3) / 4 * 4 * ((d->enc.height + 1)/2));
+	d->enc.pFrame_yuv->linesize[0] = d->enc.width;
+	d->enc.pFrame_yuv->linesize[1] = (d->enc.width + 1)/2;
+	d->enc.pFrame_yuv->linesize[2] = (d->enc.width + 1)/2;
+	d->enc.pFrame_yuv->format = AV_PIX_FMT_YUV420P;
+	d->enc.queue = (ENCFRAME *)calloc(depth, sizeof(ENCFRAME));
+	if(!d->enc.queue)
+	{
+		encoder_close(d);
+		luaL_error(L, "<video_decoder>: out of memory");
+	}
+	d->enc.depth = depth;
+	d->enc.head = d->enc.n = d->enc.stop = 0;
+	if(pthread_create(&d->enc.tid, 0, encoderthread, d))
+	{
+		d->enc.tid = 0;
+		encoder_close(d);
+		luaL_error(L, "<video_decoder>: cannot create the encoding thread");
+	}
 	return 0;
 }
 
+// Copy the planes of a (3, height, width) tensor to contiguous planes
+static void copy_planes(uint8_t *dst, const uint8_t *src, int elsize, const long *stride, int w, int h)
+{
+	int c, i, j;
+
+	for(c = 0; c < 3; c++)
+		for(i = 0; i < h; i++)
+		{
+			const uint8_t *row = src + (stride[0] * c + stride[1] * i) * elsize;
+
+			if(stride[2] == 1)
+				memcpy(dst, row, w * elsize);
+			else for(j = 0; j < w; j++)
+				memcpy(dst + j * elsize, row + stride[2] * j * elsize, elsize);
+			dst += w * elsize;
+		}
+}
+
+/* Queue a (3, height, width) frame or a (N, 3, height, width) batch of frames to the
+ * encoding thread; the tensors are copied, so they can be reused as soon as this returns,
+ * and the call only blocks when the queue is full
+ */
 static int encoderwrite(lua_State *L)
 {
-	int dim = 0;
-	const uint8_t *srcslice[3];
-	int srcstride[3];
-	int got;
+	VIDEODEC *d = getdec(L);
+	const char *tname = luaT_typename(L, 1);
+	const uint8_t *data;
+	long *size, *stride;
+	int dim, isfloat, elsize, nframes, i;
+	long framesize;
 
-	if(!enc.fmt_ctx)
+	if(!d->enc.fmt_ctx)
 		luaL_error(L, "<video_decoder>: call encoderopen first");
-	const char *tname = luaT_typename(L, 1);
-	if (strcmp("torch.ByteTensor", tname) == 0)
+	if (tname && strcmp("torch.ByteTensor", tname) == 0)
 	{
-		unsigned char *src_byte = NULL;
 		THByteTensor *frame = luaT_toudata(L, 1, luaT_typenameid(L, "torch.ByteTensor"));
-		src_byte = THByteTensor_data(frame);
+		data = THByteTensor_data(frame);
 		dim = frame->nDimension;
-		if((3 != dim) || (3 != frame->size[0]))
-			luaL_error(L, "<video_decoder>: cannot process tensor of this dimension and size");
-		rgb_frombyte(src_byte, frame->stride[0], frame->stride[1], frame->size[2], frame->size[1], enc.sws_rgb);
-	} else if (strcmp("torch.FloatTensor", tname) == 0)
+		size = frame->size;
+		stride = frame->stride;
+		isfloat = 0;
+		elsize = 1;
+	} else if (tname && strcmp("torch.FloatTensor", tname) == 0)
 	{
-		float *src_float = NULL;
 		THFloatTensor *frame = luaT_toudata(L, 1, luaT_typenameid(L, "torch.FloatTensor"));
-		// get tensor's Info
-		src_float = THFloatTensor_data(frame);
+		data = (const uint8_t *)THFloatTensor_data(frame);
 		dim = frame->nDimension;
-		if((3 != dim) || (3 != frame->size[0]))
-			luaL_error(L, "<video_decoder>: cannot process tensor of this dimension and size");
-		rgb_fromfloat(src_float, frame->stride[0], frame->stride[1], frame->size[2], frame->size[1], enc.sws_rgb);
+		size = frame->size;
+		stride = frame->stride;
+		isfloat = 1;
+		elsize = sizeof(float);
 	} else luaL_error(L, "<video_decoder>: cannot process tensor type %s", tname);
-	srcslice[0] = enc.sws_rgb;
-	srcslice[1] = srcslice[2] = 0;
-	srcstride[0] = (enc.width * 3 + 3) / 4 * 4;
-	srcstride[1] = srcstride[2] = 0;
-	sws_scale(enc.sws_ctx, srcslice, srcstride, 0, enc.height, enc.pFrame_yuv->data, enc.pFrame_yuv->linesize);
-	AVRational invfps = {1, enc.fps};
-	enc.pFrame_yuv->pts = av_rescale_q(enc.curframe, invfps, enc.fmt_ctx->streams[0]->time_base);
-	enc.curframe++;
-	int rc;
-	if((rc = avcodec_encode_video2(enc.fmt_ctx->streams[0]->codec, &enc.pkt, enc.pFrame_yuv, &got)) >= 0 && got)
+	if(dim == 3)
+		nframes = 1;
+	else if(dim == 4)
 	{
-		char s[300];
-
-		int ret = av_write_frame(enc.fmt_ctx, &enc.pkt);
-		if (ret < 0)
+		nframes = size[0];
+		size++;
+	} else luaL_error(L, "<video_decoder>: cannot process tensor of this dimension and size");
+	if(size[0] != 3 || size[1] != d->enc.height || size[2] != d->enc.width)
+		luaL_error(L, "<video_decoder>: the frames have to be 3x%dx%d", d->enc.height, d->enc.width);
+	framesize = 3L * d->enc.width * d->enc.height * elsize;
+	for(i = 0; i < nframes; i++)
+	{
+		ENCFRAME *f;
+
+		pthread_mutex_lock(&d->enc.mutex);
+		while(d->enc.n == d->enc.depth)
+			pthread_cond_wait(&d->enc.cond, &d->enc.mutex);
+		f = &d->enc.queue[(d->enc.head + d->enc.n) % d->enc.depth];
+		pthread_mutex_unlock(&d->enc.mutex);
+		// The slot is free, the thread only reads the slots in the queue
+		if(f->size < framesize)
 		{
-			av_strerror(ret, s, sizeof(s));
-			fprintf(stderr, "Error muxing packet: %s\n", s);
+			free(f->data);
+			f->data = malloc(framesize);
+			f->size = f->data ? framesize : 0;
+			if(!f->data)
+				luaL_error(L, "<video_decoder>: out of memory");
 		}
-		av_free_packet(&enc.pkt);
+		f->isfloat = isfloat;
+		copy_planes(f->data, data + (dim == 4 ? stride[0] * i * elsize : 0), elsize,
+			dim == 4 ? stride + 1 : stride, d->enc.width, d->enc.height);
+		pthread_mutex_lock(&d->enc.mutex);
+		d->enc.n++;
+		pthread_cond_broadcast(&d->enc.cond);
+		pthread_mutex_unlock(&d->enc.mutex);
 	}
 	return 0;
 }
 
-static int encoderclose(lua_State *L)
+static void encoder_close(VIDEODEC *d)
 {
-	if(enc.sws_ctx)
+	int i;
+
+	// Let the thread encode the queued frames
+	if(d->enc.tid)
 	{
-		sws_freeContext(enc.sws_ctx);
-		enc.sws_ctx = 0;
+		pthread_mutex_lock(&d->enc.mutex);
+		d->enc.stop = 1;
+		pthread_cond_broadcast(&d->enc.cond);
+		pthread_mutex_unlock(&d->enc.mutex);
+		pthread_join(d->enc.tid, 0);
+		d->enc.tid = 0;
 	}
-	if(enc.sws_rgb)
+	if(d->enc.queue)
 	{
-		free(enc.sws_rgb);
-		enc.sws_rgb = 0;
+		for(i = 0; i < d->enc.depth; i++)
+			free(d->enc.queue[i].data);
+		free(d->enc.queue);
+		d->enc.queue = 0;
+		d->enc.depth = 0;
 	}
-	if(enc.pFrame_yuv)
+	if(d->enc.pFrame_yuv)
 	{
-		av_free(enc.pFrame_yuv->data[0]);
-		av_free(enc.pFrame_yuv->data[1]);
-		av_free(enc.pFrame_yuv->data[2]);
-		avcodec_free_frame(&enc.pFrame_yuv);
+		av_free(d->enc.pFrame_yuv->data[0]);
+		av_free(d->enc.pFrame_yuv->data[1]);
+		av_free(d->enc.pFrame_yuv->data[2]);
+		avcodec_free_frame(&d->enc.pFrame_yuv);
 	}
-	if(enc.fmt_ctx)
+	if(d->enc.fmt_ctx)
 	{
 		int got;
 
-		while(avcodec_encode_video2(enc.fmt_ctx->streams[0]->codec, &enc.pkt, 0, &got) >= 0 && got)
+		while(avcodec_encode_video2(d->enc.fmt_ctx->streams[0]->codec, &d->enc.pkt, 0, &got) >= 0 && got)
 		{
-			int ret = av_write_frame(enc.fmt_ctx, &enc.pkt);
+			int ret = av_write_frame(d->enc.fmt_ctx, &d->enc.pkt);
 			if (ret < 0)
 			{
 				char s[300];
@@ -2881,71 +5521,211 @@ static int encoderclose(lua_State *L)
 				av_strerror(ret, s, sizeof(s));
 				fprintf(stderr, "Error muxing packet: %s\n", s);
 			}
-			av_free_packet(&enc.pkt);
+			av_free_packet(&d->enc.pkt);
 		}
-		av_write_trailer(enc.fmt_ctx);
-		if (enc.fmt_ctx && !(enc.fmt_ctx->flags & AVFMT_NOFILE))
-			avio_close(enc.fmt_ctx->pb);
-		avcodec_close(enc.fmt_ctx->streams[0]->codec);
-		avformat_free_context(enc.fmt_ctx);
-		enc.fmt_ctx = 0;
+		av_write_trailer(d->enc.fmt_ctx);
+		if (d->enc.fmt_ctx && !(d->enc.fmt_ctx->flags & AVFMT_NOFILE))
+			avio_close(d->enc.fmt_ctx->pb);
+		avcodec_close(d->enc.fmt_ctx->streams[0]->codec);
+		avformat_free_context(d->enc.fmt_ctx);
+		d->enc.fmt_ctx = 0;
 	}
+}
+
+static int encoderclose(lua_State *L)
+{
+	encoder_close(getdec(L));
 	return 0;
 }
 
+/***************************************
+Sliding window max of expandconvresult
+***************************************/
+
+#define EXPAND_PAD -1e38f
+
+static inline float maxf(float a, float b)
+{
+	return a > b ? a : b;
+}
+
+/* van Herk/Gil-Werman running max with a window of w vectors on the n vectors of m floats
+ * of src (vector i is at src + i * sstride), padded with w - 1 vectors of EXPAND_PAD on both
+ * sides: output vector i is the max of the padded vectors from i to i + w - 1, for the n + w - 1
+ * windows; the padded vectors are split in blocks of w, g is the running max from the start
+ * of every block and h from its end, so every output is max(h[i], g[i + w - 1]) and the cost
+ * does not depend on w; g and h have room for nblocks * w * m floats (see runmax_size)
+ */
+static void runmax(const float *src, long sstride, int n, int m, int w, float *dst, long dstride, float *g, float *h)
+{
+	int nblk = (n + 2 * (w - 1) + w - 1) / w * w, i, j;
+
+	for(i = 0; i < nblk; i++)
+	{
+		const float *x = i >= w - 1 && i < n + w - 1 ? src + (long)(i - w + 1) * sstride : 0;
+		float *gi = g + (long)i * m, *gp = gi - m;
+
+		if(i % w == 0)
+		{
+			if(x)
+				memcpy(gi, x, m * sizeof(float));
+			else for(j = 0; j < m; j++)
+				gi[j] = EXPAND_PAD;
+		} else if(x)
+		{
+			for(j = 0; j < m; j++)
+				gi[j] = maxf(gp[j], x[j]);
+		} else memcpy(gi, gp, m * sizeof(float));
+	}
+	for(i = nblk - 1; i >= 0; i--)
+	{
+		const float *x = i >= w - 1 && i < n + w - 1 ? src + (long)(i - w + 1) * sstride : 0;
+		float *hi = h + (long)i * m, *hn = hi + m;
+
+		if(i % w == w - 1)
+		{
+			if(x)
+				memcpy(hi, x, m * sizeof(float));
+			else for(j = 0; j < m; j++)
+				hi[j] = EXPAND_PAD;
+		} else if(x)
+		{
+			for(j = 0; j < m; j++)
+				hi[j] = maxf(hn[j], x[j]);
+		} else memcpy(hi, hn, m * sizeof(float));
+	}
+	for(i = 0; i < n + w - 1; i++)
+	{
+		const float *hi = h + (long)i * m, *gi = g + (long)(i + w - 1) * m;
+		float *y = dst + (long)i * dstride;
+
+		for(j = 0; j < m; j++)
+			y[j] = maxf(hi[j], gi[j]);
+	}
+}
+
+// Floats needed by g or h of runmax
+static long runmax_size(int n, int m, int w)
+{
+	return (long)(n + 2 * (w - 1) + w - 1) / w * w * m;
+}
+
+struct expandjob {
+	const float *in;
+	float *out;
+	long istride, ostride;	// Distance between two planes
+	int h, w, expand;
+	long gsize;	// Size of g and h of runmax
+	float **scratch;	// One for every worker
+};
+
+// Expand one plane: running max on every row to tmp, then on the columns of tmp,
+// which are processed together as vectors of whole rows
+static void expand_plane(void *ctx, int plane, int worker)
+{
+	struct expandjob *job = (struct expandjob *)ctx;
+	int i, w = job->expand + 1, ow = job->w + job->expand;
+	float *tmp = job->scratch[worker], *g = tmp + (long)job->h * ow, *h = g + job->gsize;
+	const float *in = job->in + job->istride * plane;
+
+	for(i = 0; i < job->h; i++)
+		runmax(in + (long)i * job->w, 1, job->w, 1, w, tmp + (long)i * ow, 1, g, h);
+	runmax(tmp, ow, job->h, ow, w, job->out + job->ostride * plane, ow, g, h);
+}
+
 int lua_expandconvresult(lua_State *L)
 {
-	int j, k, l, ki, k1, k2, li, l1, l2;
 	const char *tname = luaT_typename(L, 1);
+	struct expandjob job;
+	THFloatTensor *intens, *outtens;
+	float *scratch[MAXTHREADS];
+	int i, nworkers, ow, w;
+
 	if(strcmp("torch.FloatTensor", tname) != 0)
 		luaL_error(L, "<video_decoder>: cannot process tensor type %s", tname);
-	int expand = lua_tointeger(L, 2);
-	THFloatTensor *intens = luaT_toudata(L, 1, luaT_typenameid(L, "torch.FloatTensor"));
+	job.expand = lua_tointeger(L, 2);
+	intens = luaT_toudata(L, 1, luaT_typenameid(L, "torch.FloatTensor"));
 	if(intens->nDimension != 3)
 		luaL_error(L, "<video_decoder>: cannot process tensor of dimension %d (only 3)", intens->nDimension);
-	float *indata = THFloatTensor_data(intens);
-	THFloatTensor *outtens = THFloatTensor_newWithSize3d(intens->size[0], intens->size[1] + expand, intens->size[2] + expand);
-	float *outdata = THFloatTensor_data(outtens);
-	int istr = intens->stride[1];
-	int ostr = outtens->stride[1];
-	for(j = 0; j < outtens->size[0]; j++)
-	{
-		float *ind = indata + intens->stride[0] * j;
-		float *outd = outdata + outtens->stride[0] * j;
-		for(k = 0; k < outtens->size[1]; k++)
-		{
-			k1 = k < expand ? 0 : k - expand;
-			k2 = k >= intens->size[1] ? intens->size[1] - 1 : k;
-			for(l = 0; l < outtens->size[2]; l++)
-			{
-				l1 = l < expand ? 0 : l - expand;
-				l2 = l >= intens->size[2] ? intens->size[2] - 1 : l;
-				float max = -1e38;
-				for(ki = k1; ki <= k2; ki++)
-					for(li = l1; li <= l2; li++)
-						if(ind[ki * istr + li] > max)
-							max = ind[ki * istr + li];
-				outd[k * ostr + l] = max;
-			}
-		}
+	if(job.expand < 0)
+		luaL_error(L, "<video_decoder>: expand cannot be negative");
+	outtens = THFloatTensor_newWithSize3d(intens->size[0], intens->size[1] + job.expand, intens->size[2] + job.expand);
+	if(!intens->size[0] || !intens->size[1] || !intens->size[2])
+	{
+		THFloatTensor_fill(outtens, EXPAND_PAD);
+		luaT_pushudata(L, outtens, "torch.FloatTensor");
+		return 1;
 	}
+	intens = THFloatTensor_newContiguous(intens);
+	job.in = THFloatTensor_data(intens);
+	job.out = THFloatTensor_data(outtens);
+	job.h = intens->size[1];
+	job.w = intens->size[2];
+	job.istride = intens->stride[0];
+	job.ostride = outtens->stride[0];
+	// Every worker needs the row maxima of a plane and g and h for the columns
+	w = job.expand + 1;
+	ow = job.w + job.expand;
+	job.gsize = runmax_size(job.h, ow, w);
+	if(runmax_size(job.w, 1, w) > job.gsize)
+		job.gsize = runmax_size(job.w, 1, w);
+	// Any worker can take a plane when there are more of them
+	nworkers = intens->size[0] > 1 ? pool.nthreads : 1;
+	for(i = 0; i < nworkers; i++)
+		if(!(scratch[i] = (float *)malloc(((long)job.h * ow + 2 * job.gsize) * sizeof(float))))
+		{
+			while(i--)
+				free(scratch[i]);
+			THFloatTensor_free(intens);
+			THFloatTensor_free(outtens);
+			luaL_error(L, "<video_decoder>: out of memory");
+		}
+	job.scratch = scratch;
+	parallel_for(expand_plane, &job, intens->size[0]);
+	for(i = 0; i < nworkers; i++)
+		free(scratch[i]);
+	THFloatTensor_free(intens);
 	luaT_pushudata(L, outtens, "torch.FloatTensor");
 	return 1;
 }
 
 /* Availabe functions:
 
-init(file to open, optional path), returns
-    status (1=ok, 0=failed)
+Every function working on a stream can be called as a method of the decoder object
+returned by init, capture or new (for example d:frame_rgb(tensor)), so that more streams
+can be decoded at the same time; if called as a library function (video.frame_rgb(tensor)),
+it works on the decoder returned by the last init or capture
+
+init(file to open, optional format[, options]), returns
+	decoder object (nil=failed)
 	width
 	height
 	number of present frames
 	frame rate
 
 	Opens a file/stream with libavformat
+	options is a table with these optional fields:
+	prefetch: number of frames decoded in advance by a separate thread;
+		frame_* then only take the frames from this queue and return
+		false and the error message if the stream ended with an error
+	index: true or the path of the index file (default: file to open.idx);
+		the PTS of every frame are collected when the file is opened the
+		first time and saved in the index file, so that seek is exact
+		and the number of present frames is the real one
+	decode: "all" (default), "nonref-skip" (non reference frames are not
+		decoded), "keyframes-only" (only keyframes are read and decoded)
+		or "every-Nth" (only one frame every <every> is returned; with
+		the index, the packets before a keyframe are skipped by seeking)
+	every: N of the every-Nth decode mode
+	thread_count: number of decoding threads, 0=one for every CPU
+	thread_type: "frame", "slice" or "frame+slice"
+	low_delay: true to ask the decoder to return the frames as soon as possible
+	dct_scaling: only for MPJPEG, false to always decode the JPEGs at full size;
+		by default frame_resized decodes them with libjpeg reduced by 1/2, 1/4
+		or 1/8 if the result is still not smaller than the tensor
 
 capture(device_path, width, height[, fps[, nbuffers[, encoder_path, encoder_quality]]]), returns
-    status (1=ok, 0=failed)
+	decoder object (nil=failed)
 
 	Opens a video capture device with the videocap library
 	This function is only available on Linux
@@ -2956,34 +5736,74 @@ capture(device_path, width, height[, fps[, nbuffers[, encoder_path, encoder_qual
 	encoder_quality is the quality of the generated stream (suggested:20-30)
 	These two optional parameters are necessary if startremux will be used
 
-frame_rgb(tensor), returns
+new(), returns
+	decoder object
+
+	Creates an empty decoder object, useful to use the encoder functions only
+
+frame_rgb(tensor[, options]), returns
 	status (1=ok, 0=failed)
+	PTS of the frame in seconds (not for capture and MPJPEG)
+	sequence number of the frame, only after startremux
 
 	Gets the next frame in RGB format from the file/stream/device
 	tensor has to be torch.ByteTensor or torch.FloatTensor and have dimension 3
 	and the first size has to be 3
+	After startremux, the last received frame is returned; options is a table with:
+	wait_new: wait for a frame newer than the last returned one
+	timeout_ms: maximum time to wait, after that false is returned
+
+frame_rgb([nil, options]), returns
+	status, (3, height, width) torch.ByteTensor, PTS[, sequence number]
+
+	Only for RGB24 streams: the tensor is a view of the decoded frame, no copy is done
+	and the frame is released when the tensor is garbage collected
 
 frame_yuv(tensor), returns
 	status (1=ok, 0=failed)
+	PTS of the frame in seconds
 
 	Gets the next frame in YUV format from the file/stream
 	tensor has to be torch.ByteTensor and have dimension 3 and the first size has to be 3
 
-frame_resized(tensor), returns
+frame_yuv([nil, options]), returns
+	status, Y, U, V torch.ByteTensors, PTS[, sequence number]
+
+	Only for yuv420p, yuv422p and yuv444p streams: the three planes are returned at their
+	own resolution as views of the decoded frame, no copy is done
+
+frame_resized(tensor[, options]), returns
 	status (1=ok, 0=failed)
+	PTS of the frame in seconds (not for capture and MPJPEG)
+	sequence number of the frame, only after startremux
 
 	Gets the next frame in RGB format from the file/stream/device
-	tensor has to be torch.FloatTensor and have dimension 3
+	tensor has to be torch.ByteTensor or torch.FloatTensor and have dimension 3
 	and the first size has to be 3. The image is resized to the tensor size
 	and before being resized, is saved to a temporary buffer for subsequent JPEG encoding
+	Byte tensors are written directly by the rescaler, without an intermediate RGB buffer
+	options are the same of frame_rgb
 
-frame_batch_resized(batch, width, height, take), returns
+frame_resized_normalized(tensor, mean, std[, options]), returns
+	status (1=ok, 0=failed)
+	PTS of the frame in seconds (not for capture and MPJPEG)
+	sequence number of the frame, only after startremux
+
+	Like frame_resized, but every channel c is (value - mean[c]) / std[c];
+	mean and std can be numbers or tables of three numbers; yuv420p, yuv422p
+	and YUYV frames are resampled with bilinear interpolation directly from
+	the YUV planes in one pass, without the intermediate packed RGB image
+
+frame_batch_resized(batch, width, height, take[, options]), returns
 	4D image tensor
+	table with the PTS of the frames in seconds
 
 	If take is true, gets the next batch frames in RGB format from the file or stream,
 	otherwise the images are taken from the internal buffer
 	Rescale them to width x height and return them in a 4D (batch, 3, height, width) tensor
-	batch can be max 32 because frames are buffered by libavcodec, which has 32 buffers
+	Frames are kept in a pool of refcounted frames, so batch is not limited
+	options is a table with:
+	type: 'float' (default) or 'byte'; byte tensors are written directly by the rescaler
 
 frame_jpeg(), returns
 	status (true=ok, false=nothing to encode (frame_resized never called))
@@ -2991,19 +5811,27 @@ frame_jpeg(), returns
 
 	Encodes in JPEG the frame previously received with frame_resized
 	It will not be encoded again (the cached copy will be used) if frame_jpeg() or
-	save_jpeg() has been already called for that frame
+	save_jpeg() has been already called for that frame or, after startremux,
+	if the JPEG server encoder has already encoded it
 
 save_jpeg(filename), returns
 	status (true=ok, false=nothing to encode (frame_resized never called))
 
 	Encodes in JPEG the frame previously received with frame_resized and saves it to filename
 	It will not be encoded again (the cached copy will be used) if frame_jpeg() or
-	save_jpeg() has been already called for that frame
+	save_jpeg() has been already called for that frame or, after startremux,
+	if the JPEG server encoder has already encoded it
+
+jpegserver_init(port, options)
+	Starts an HTTP server on port that streams the received frames as multipart JPEG
+	options is an optional table with fps, the maximum frame rate of the JPEG encoder
+	thread (default no limit), and quality (default 75)
 
 exit()
 	Stops and closes the decoder/video capture device/receiving thread
+	The encoder and the JPEG server are closed when the object is garbage collected
 
-startremux(fragment_base_path, format, fragment_size), returns
+startremux(fragment_base_path, format, fragment_size, options), returns
 	status (1=ok, 0=failed)
 
 	Starts to receive from the stream opened with init and starts to
@@ -3013,6 +5841,14 @@ startremux(fragment_base_path, format, fragment_size), returns
 	fragment_base_path in the form A.B is changed to A_timestamp.B
 	format is the file format (optional), if it cannot be deduced
 	from the file extension
+	options is an optional table with the limits of the pre-roll buffer
+	used by savenow when fragment_size is 0: preroll_seconds (default 60)
+	and preroll_mb (default 32); the oldest packets are dropped when
+	either is exceeded. Packets are written by a separate thread through
+	a queue of mux_queue packets (default 256); mux_overflow says what
+	to do when it's full: "block" waits, "nonkey" drops the new packet
+	(and the video packets up to the next keyframe), "gop" (default)
+	drops the oldest queued GOP
 
 savenow(seconds before, seconds after, destfilename), returns
 	status (1=ok, 0=failed)
@@ -3028,10 +5864,55 @@ savenow(seconds before, seconds after, destfilename), returns
 stopremux(), returns
 	status (1=ok, 0=failed)
 
+muxstats(), returns
+	a table with the statistics of the muxing queue of startremux:
+	queued, max_queued, queue_size, dropped and written packets and
+	write_ms_last, write_ms_avg, write_ms_max, the time spent
+	writing a packet in milliseconds
+
+stats([options]), returns
+	a table with uptime_s (seconds since the decoder object was created
+	or the statistics were reset), a table for every stage (demux, decode,
+	convert, rescale, jpeg_encode, mux_write, encode) with count, avg_us,
+	p50_us, p95_us, p99_us and max_us, and the counters frames_decoded,
+	frames_skipped, packets_dropped, jpeg_frames, jpeg_skipped,
+	jpeg_clients, mux_queued, mux_max_queued, prefetch_queued and
+	encoder_queued; options is a table with the optional fields enable
+	(time the stages, default true), reset, csv (path of a CSV file to
+	which the statistics are appended every interval seconds, false to
+	stop) and interval (default 10)
+
+decoderinfo(), returns
+	table with the effective thread_count, thread_type ("frame", "slice" or
+	"none"), frame_delay (frames that enter the decoder before the first one
+	comes out) and low_delay of the decoder
+
+seek(position[, unit]), returns
+	status (true=ok, false=past the end or error, followed by the error message)
+
+	Seeks the file opened with init, so that the next frame got by frame_* is
+	the one at position, which is a frame number starting from 0 if unit is
+	"frame" (default) or a time in seconds if unit is "seconds"; decoding
+	starts from the previous keyframe. Without the index, frame numbers are
+	converted to times with the frame rate
+
 loglevel(level), no return value
 
 	Sets the logging level (0=no logging)
 
+setthreads(n), returns the number of threads
+
+	Sets the number of threads used for color space conversion and rescaling
+	(default 1, 0 means one for every CPU); frames are split in horizontal
+	bands and the results are the same regardless of the number of threads
+
+simd([enable]), returns implementation
+
+	Enables (default) or disables the SIMD color space conversion and
+	returns the name of the implementation in use ("avx2", "sse2", "neon"
+	or "lut"); the results are the same, so this is only useful for testing;
+	the SIMD kernels of motion follow the same setting
+
 diffimages(tensor1, tensor2, sensitivity, area), return bool
 
 	Calculates if there was a significant change between the two images
@@ -3039,17 +5920,36 @@ diffimages(tensor1, tensor2, sensitivity, area), return bool
 	have to different, where a pixel is considered different when the absolute
 	difference between the two is higher of sensitivity.
 
-encoderopen(format,path,width,height,fps)
+motion([options]), returns moved, score, map
+
+	Compares the luma of the last frame returned by frame_* with a running
+	average background, block by block; options is a table with:
+	scale: the luma is averaged on scale x scale squares, 1, 2 (default) or 4
+	block: side of the blocks in downsampled pixels, multiple of 16 (default 16)
+	sensitivity: minimum luma difference of a changed pixel (default 20)
+	block_area: fraction of changed pixels of an active block (default 0.25)
+	area: fraction of active blocks to return moved=true (default 0.01)
+	learning_rate: the background moves by this fraction of the difference
+		every frame, rounded to a power of 2 (default 1/32)
+	full: compare all the blocks, otherwise it stops when moved is true
+	reset: set the background to this frame
+	score is the fraction of active blocks and map a (rows, columns) ByteTensor
+	with the percentage of changed pixels of every block
+
+encoderopen(format,path,width,height,fps[,options])
 
 	Opens the encoder, tested formats are "mp4", "avi" and "mpeg"
+	The frames are encoded by a separate thread; options is a table with:
+	queue: maximum number of frames waiting to be encoded (default 8)
 
 encoderwrite(frame)
 
-	Sends a frame to the encoder
+	Queues a (3,height,width) frame or a (N,3,height,width) batch of frames
+	to the encoder; the tensor is copied, this only waits if the queue is full
 
 encoderclose()
 
-	Closes the encoder
+	Encodes the queued frames and closes the encoder
 
 expandconvresult(tensor, expand), returns expanded_tensor
 
@@ -3057,7 +5957,8 @@ expandconvresult(tensor, expand), returns expanded_tensor
 	dimensions are higher for the given expand amount. The input tensor represents
 	squares of (expand+1) x (expand+1) size in the second and third dimensions
 	in an array of size (size(2) + expand) x (size(3) + expand), so the maximums
-	of those squares are taken
+	of those squares are taken; the cost does not depend on expand and the
+	planes are processed in parallel by the threads set with setthreads
 
 */
 
@@ -3067,9 +5968,11 @@ static const struct luaL_reg video_decoder[] = {
 #ifdef DOVIDEOCAP
 	{"capture", videocap_init},
 #endif
+	{"new", video_decoder_new},
 	{"frame_rgb", video_decoder_rgb},
 	{"frame_yuv", video_decoder_yuv},
 	{"frame_resized", video_decoder_resized},
+	{"frame_resized_normalized", video_decoder_resized_normalized},
 	{"frame_batch_resized", video_decoder_batch_resized},
 	{"frame_jpeg", video_decoder_jpeg},
 	{"save_jpeg", save_jpeg},
@@ -3077,8 +5980,15 @@ static const struct luaL_reg video_decoder[] = {
 	{"startremux", startremux},
 	{"stopremux", stopremux},
 	{"savenow", savenow},
+	{"muxstats", muxstats},
+	{"stats", lua_stats},
+	{"seek", video_decoder_seek},
+	{"decoderinfo", decoderinfo},
 	{"loglevel", lua_loglevel},
+	{"setthreads", lua_setthreads},
+	{"simd", lua_simd},
 	{"diffimages", lua_diffimages},
+	{"motion", lua_motion},
 	{"jpegserver_init", jpegserver_init},
 	{"localhostaddr", getlocalhostaddr},
 	{"encoderopen", encoderopen},
@@ -3088,12 +5998,48 @@ static const struct luaL_reg video_decoder[] = {
 	{NULL, NULL}
 };
 
+// Methods of the decoder objects returned by init, capture and new
+static const struct luaL_reg video_decoder_methods[] = {
+	{"frame_rgb", video_decoder_rgb},
+	{"frame_yuv", video_decoder_yuv},
+	{"frame_resized", video_decoder_resized},
+	{"frame_resized_normalized", video_decoder_resized_normalized},
+	{"frame_batch_resized", video_decoder_batch_resized},
+	{"frame_jpeg", video_decoder_jpeg},
+	{"save_jpeg", save_jpeg},
+	{"exit", video_decoder_exit},
+	{"startremux", startremux},
+	{"stopremux", stopremux},
+	{"savenow", savenow},
+	{"muxstats", muxstats},
+	{"stats", lua_stats},
+	{"seek", video_decoder_seek},
+	{"decoderinfo", decoderinfo},
+	{"motion", lua_motion},
+	{"jpegserver_init", jpegserver_init},
+	{"encoderopen", encoderopen},
+	{"encoderwrite", encoderwrite},
+	{"encoderclose", encoderclose},
+	{NULL, NULL}
+};
+
 // Initialize the library
 int luaopen_libvideo_decoder(lua_State * L)
 {
+	luaL_newmetatable(L, VIDEODEC_MT);
+	lua_pushcfunction(L, decoder_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	luaL_register(L, 0, video_decoder_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
 	luaL_register(L, "libvideo_decoder", video_decoder);
 	/* pre-calculate lookup table */
 	video_decoder_yuv420p_rgbp_LUT();
+	/* use the fastest SIMD converters available on this CPU */
+	yuvlut_select(1);
+	rgbrow_select(1, &rgbrow_byte, &rgbrow_float);
+	motion_select(1);
 	/* register libav */
 	av_register_all();
 	avformat_network_init();
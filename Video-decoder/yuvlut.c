@@ -0,0 +1,497 @@
+/*
+ * File:
+ *  yuvlut.c
+ *
+ * Description:
+ *  Lookup table converters from yuv420p, yuv422p and YUYV to planar RGB bytes or
+ *  floats and from the packed RGB of the rescalers to planar floats, used by
+ *  video_decoder.c and timed by bench.c; the planar YUV converters use the SIMD
+ *  row converters of yuvrgb.c when they are selected, which give the same results
+ */
+
+#include <stdint.h>
+#include <libavcodec/avcodec.h>
+#include "yuvrgb.h"
+#include "yuvlut.h"
+
+/* yuv420p-to-rgbp lookup table */
+static short TB_YUR[256], TB_YUB[256], TB_YUGU[256], TB_YUGV[256], TB_Y[256];
+static uint8_t TB_SAT[1024 + 1024 + 256];
+
+/* SIMD row converters selected by yuvlut_select (see yuvrgb.c), 0 to use the lookup table */
+static YUVROW_BYTE yuvrow_byte;
+static YUVROW_FLOAT yuvrow_float;
+
+/* This function calculates a lookup table for yuv420p-to-rgbp conversion
+ * Written by Marko Vitez.
+ */
+void video_decoder_yuv420p_rgbp_LUT()
+{
+	int i;
+
+	/* calculate lookup table for yuv420p */
+	for (i = 0; i < 256; i++) {
+		TB_YUR[i]  =  459 * (i-128) / 256;
+		TB_YUB[i]  =  541 * (i-128) / 256;
+		TB_YUGU[i] = -137 * (i-128) / 256;
+		TB_YUGV[i] = - 55 * (i-128) / 256;
+		TB_Y[i]    = (i-16) * 298 / 256;
+	}
+	for (i = 0; i < 1024; i++) {
+		TB_SAT[i] = 0;
+		TB_SAT[i + 1024 + 256] = 255;
+	}
+	for (i = 0; i < 256; i++)
+		TB_SAT[i + 1024] = i;
+}
+
+const char *yuvlut_select(int simd)
+{
+	return yuvrow_select(simd, &yuvrow_byte, &yuvrow_float);
+}
+
+/* This function is a main function for converting color space from yuv420p to planar RGB.
+ * It utilizes a lookup table method for fast conversion. Written by Marko Vitez.
+ * The SIMD row converters of yuvrgb.c, when available, give the same result faster.
+ */
+void video_decoder_yuv420p_rgbp(AVFrame * yuv, AVFrame * rgb)
+{
+	int i, j, U, V, Y, YUR, YUG, YUB;
+	int h = yuv->height;
+	int w = yuv->width;
+	int wy = yuv->linesize[0];
+	int wu = yuv->linesize[1];
+	int wv = yuv->linesize[2];
+	uint8_t *r = rgb->data[0];
+	uint8_t *g = rgb->data[1];
+	uint8_t *b = rgb->data[2];
+	uint8_t *y = yuv->data[0];
+	uint8_t *u = yuv->data[1];
+	uint8_t *v = yuv->data[2];
+	uint8_t *r1, *g1, *b1, *y1;
+
+	if(yuvrow_byte)
+	{
+		w &= ~1;
+		for (i = 0; i < (h & ~1); i++)
+			yuvrow_byte(y + i*wy, u + i/2*wu, v + i/2*wv, r + i*w, g + i*w, b + i*w, w);
+		return;
+	}
+	w /= 2;
+	h /= 2;
+
+	/* convert for R channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + 2*i*wy + 2*j;
+			V     = v[j + i * wv];
+			YUR   = TB_YUR[V];
+			r1    = (uint8_t *) r + 4*w*i + 2*j;
+
+			Y     = TB_Y[y1[0]];
+			*r1++ = TB_SAT[Y + YUR + 1024];
+			Y     = TB_Y[y1[1]];
+			*r1   = TB_SAT[Y + YUR + 1024];
+			y1   += wy;
+			r1   += 2*w - 1;
+			Y     = TB_Y[y1[0]];
+			*r1++ = TB_SAT[Y + YUR + 1024];
+			Y     = TB_Y[y1[1]];
+			*r1   = TB_SAT[Y + YUR + 1024];
+		}
+	}
+
+	/* convert for G channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + 2*i*wy + 2*j;
+			U     = u[j + i * wu];
+			V     = v[j + i * wv];
+			YUG   = TB_YUGU[U] + TB_YUGV[V];
+			g1    = (uint8_t *) g + 4*w*i + 2*j;
+
+			Y     = TB_Y[y1[0]];
+			*g1++ = TB_SAT[Y + YUG + 1024];
+			Y     = TB_Y[y1[1]];
+			*g1   = TB_SAT[Y + YUG + 1024];
+			y1   += wy;
+			g1   += 2*w - 1;
+			Y     = TB_Y[y1[0]];
+			*g1++ = TB_SAT[Y + YUG + 1024];
+			Y     = TB_Y[y1[1]];
+			*g1   = TB_SAT[Y + YUG + 1024];
+		}
+	}
+
+	/* convert for B channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + 2*i*wy + 2*j;
+			U     = u[j + i * wu];
+			YUB   = TB_YUB[U];
+			b1    = (uint8_t *) b + 4*w*i + 2*j;
+
+			Y     = TB_Y[y1[0]];
+			*b1++ = TB_SAT[Y + YUB + 1024];
+			Y     = TB_Y[y1[1]];
+			*b1   = TB_SAT[Y + YUB + 1024];
+			y1   += wy;
+			b1   += 2*w - 1;
+			Y     = TB_Y[y1[0]];
+			*b1++ = TB_SAT[Y + YUB + 1024];
+			Y     = TB_Y[y1[1]];
+			*b1   = TB_SAT[Y + YUB + 1024];
+		}
+	}
+}
+
+/* This function is a main function for converting color space from yuv420p to planar RGB
+ * directly in torch float tensor
+ * It utilizes a lookup table method for fast conversion. Written by Marko Vitez.
+ * The SIMD row converters of yuvrgb.c, when available, give the same result faster.
+ */
+void yuv420p_floatrgbp(AVFrame * yuv, float *dst_float, int imgstride, int rowstride, int w, int h)
+{
+	int i, j, U, V, Y, YUR, YUG, YUB;
+	int wy = yuv->linesize[0];
+	int wu = yuv->linesize[1];
+	int wv = yuv->linesize[2];
+	float *r = dst_float;
+	float *g = dst_float + imgstride;
+	float *b = dst_float + 2*imgstride;
+	uint8_t *y = yuv->data[0];
+	uint8_t *u = yuv->data[1];
+	uint8_t *v = yuv->data[2];
+	uint8_t *y1;
+	float *r1, *g1, *b1;
+
+	if(yuvrow_float)
+	{
+		for (i = 0; i < (h & ~1); i++)
+			yuvrow_float(y + i*wy, u + i/2*wu, v + i/2*wv, r + i*rowstride, g + i*rowstride, b + i*rowstride, w & ~1);
+		return;
+	}
+	w /= 2;
+	h /= 2;
+
+	/* convert for R channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + 2*i*wy + 2*j;
+			V     = v[j + i * wv];
+			YUR   = TB_YUR[V];
+			r1    = r + 2*(rowstride*i + j);
+
+			Y     = TB_Y[y1[0]];
+			*r1++ = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
+			Y     = TB_Y[y1[1]];
+			*r1   = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
+			y1   += wy;
+			r1   += 2*w - 1;
+			Y     = TB_Y[y1[0]];
+			*r1++ = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
+			Y     = TB_Y[y1[1]];
+			*r1   = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
+		}
+	}
+
+	/* convert for G channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + 2*i*wy + 2*j;
+			U     = u[j + i * wu];
+			V     = v[j + i * wv];
+			YUG   = TB_YUGU[U] + TB_YUGV[V];
+			g1    = g + 2*(rowstride*i + j);
+
+			Y     = TB_Y[y1[0]];
+			*g1++ = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
+			Y     = TB_Y[y1[1]];
+			*g1   = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
+			y1   += wy;
+			g1   += 2*w - 1;
+			Y     = TB_Y[y1[0]];
+			*g1++ = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
+			Y     = TB_Y[y1[1]];
+			*g1   = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
+		}
+	}
+
+	/* convert for B channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + 2*i*wy + 2*j;
+			U     = u[j + i * wu];
+			YUB   = TB_YUB[U];
+			b1    = b + 2*(rowstride*i + j);
+
+			Y     = TB_Y[y1[0]];
+			*b1++ = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
+			Y     = TB_Y[y1[1]];
+			*b1   = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
+			y1   += wy;
+			b1   += 2*w - 1;
+			Y     = TB_Y[y1[0]];
+			*b1++ = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
+			Y     = TB_Y[y1[1]];
+			*b1   = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
+		}
+	}
+}
+
+/* This function is a main function for converting color space from yuv422p to planar RGB.
+ * It utilizes a lookup table method for fast conversion. Written by Marko Vitez.
+ * The SIMD row converters of yuvrgb.c, when available, give the same result faster.
+ */
+void video_decoder_yuv422p_rgbp(AVFrame * yuv, AVFrame * rgb)
+{
+	int i, j, U, V, Y, YUR, YUG, YUB;
+	int h = yuv->height;
+	int w = yuv->width;
+	int wy = yuv->linesize[0];
+	int wu = yuv->linesize[1];
+	int wv = yuv->linesize[2];
+	uint8_t *r = rgb->data[0];
+	uint8_t *g = rgb->data[1];
+	uint8_t *b = rgb->data[2];
+	uint8_t *y = yuv->data[0];
+	uint8_t *u = yuv->data[1];
+	uint8_t *v = yuv->data[2];
+	uint8_t *r1, *g1, *b1, *y1;
+
+	if(yuvrow_byte)
+	{
+		w &= ~1;
+		for (i = 0; i < h; i++)
+			yuvrow_byte(y + i*wy, u + i*wu, v + i*wv, r + i*w, g + i*w, b + i*w, w);
+		return;
+	}
+	w /= 2;
+
+	/* convert for R channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + i*wy + 2*j;
+			V     = v[j + i * wv];
+			YUR   = TB_YUR[V];
+			r1    = (uint8_t *) r + 2*(w*i + j);
+
+			Y     = TB_Y[y1[0]];
+			*r1++ = TB_SAT[Y + YUR + 1024];
+			Y     = TB_Y[y1[1]];
+			*r1   = TB_SAT[Y + YUR + 1024];
+		}
+	}
+
+	/* convert for G channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + i*wy + 2*j;
+			U     = u[j + i * wu];
+			V     = v[j + i * wv];
+			YUG   = TB_YUGU[U] + TB_YUGV[V];
+			g1    = (uint8_t *) g + 2*(w*i + j);
+
+			Y     = TB_Y[y1[0]];
+			*g1++ = TB_SAT[Y + YUG + 1024];
+			Y     = TB_Y[y1[1]];
+			*g1   = TB_SAT[Y + YUG + 1024];
+		}
+	}
+
+	/* convert for B channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + i*wy + 2*j;
+			U     = u[j + i * wu];
+			YUB   = TB_YUB[U];
+			b1    = (uint8_t *) b + 2*(w*i + j);
+
+			Y     = TB_Y[y1[0]];
+			*b1++ = TB_SAT[Y + YUB + 1024];
+			Y     = TB_Y[y1[1]];
+			*b1   = TB_SAT[Y + YUB + 1024];
+		}
+	}
+}
+
+/* This function is a main function for converting color space from yuv422p to planar RGB
+ * directly in torch float tensor
+ * It utilizes a lookup table method for fast conversion. Written by Marko Vitez.
+ * The SIMD row converters of yuvrgb.c, when available, give the same result faster.
+ */
+void yuv422p_floatrgbp(AVFrame * yuv, float *dst_float, int imgstride, int rowstride, int w, int h)
+{
+	int i, j, U, V, Y, YUR, YUG, YUB;
+	int wy = yuv->linesize[0];
+	int wu = yuv->linesize[1];
+	int wv = yuv->linesize[2];
+	float *r = dst_float;
+	float *g = dst_float + imgstride;
+	float *b = dst_float + 2*imgstride;
+	uint8_t *y = yuv->data[0];
+	uint8_t *u = yuv->data[1];
+	uint8_t *v = yuv->data[2];
+	uint8_t *y1;
+	float *r1, *g1, *b1;
+
+	if(yuvrow_float)
+	{
+		for (i = 0; i < h; i++)
+			yuvrow_float(y + i*wy, u + i*wu, v + i*wv, r + i*rowstride, g + i*rowstride, b + i*rowstride, w & ~1);
+		return;
+	}
+	w /= 2;
+
+	/* convert for R channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + i*wy + 2*j;
+			V     = v[j + i * wv];
+			YUR   = TB_YUR[V];
+			r1    = r + i*rowstride + 2*j;
+
+			Y     = TB_Y[y1[0]];
+			*r1++ = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
+			Y     = TB_Y[y1[1]];
+			*r1   = TB_SAT[Y + YUR + 1024] * BYTE2FLOAT;
+		}
+	}
+
+	/* convert for G channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + i*wy + 2*j;
+			U     = u[j + i * wu];
+			V     = v[j + i * wv];
+			YUG   = TB_YUGU[U] + TB_YUGV[V];
+			g1    = g + i*rowstride + 2*j;
+
+			Y     = TB_Y[y1[0]];
+			*g1++ = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
+			Y     = TB_Y[y1[1]];
+			*g1   = TB_SAT[Y + YUG + 1024] * BYTE2FLOAT;
+		}
+	}
+
+	/* convert for B channel */
+	for (i = 0; i < h; i++) {
+		for (j = 0; j < w; j++) {
+			y1    = y + i*wy + 2*j;
+			U     = u[j + i * wu];
+			YUB   = TB_YUB[U];
+			b1    = b + i*rowstride + 2*j;
+
+			Y     = TB_Y[y1[0]];
+			*b1++ = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
+			Y     = TB_Y[y1[1]];
+			*b1   = TB_SAT[Y + YUB + 1024] * BYTE2FLOAT;
+		}
+	}
+}
+
+/* This function is a main function for converting color space from YUYV to planar RGB.
+ * It can fill directly a torch byte tensor
+ * Written by Marko Vitez.
+ */
+void yuyv2torchRGB(const unsigned char *frame, unsigned char *dst_byte, int imgstride, int rowstride, int w, int h)
+{
+	int i, j, w2 = w / 2;
+	uint8_t *dst;
+	const uint8_t *src;
+
+	/* convert for R channel */
+	src = frame;
+	for (i = 0; i < h; i++) {
+		dst = dst_byte + i * rowstride;
+		for (j = 0; j < w2; j++) {
+			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUR[ src[3] ] + 1024];
+			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUR[ src[3] ] + 1024];
+			src += 4;
+		}
+	}
+
+	/* convert for G channel */
+	src = frame;
+	for (i = 0; i < h; i++) {
+		dst = dst_byte + i * rowstride + imgstride;
+		for (j = 0; j < w2; j++) {
+			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUGU[ src[1] ] + TB_YUGV[ src[3] ] + 1024];
+			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUGU[ src[1] ] + TB_YUGV[ src[3] ] + 1024];
+			src += 4;
+		}
+	}
+
+	/* convert for B channel */
+	src = frame;
+	for (i = 0; i < h; i++) {
+		dst = dst_byte + i * rowstride + 2*imgstride;
+		for (j = 0; j < w2; j++) {
+			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUB[ src[1] ] + 1024];
+			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUB[ src[1] ] + 1024];
+			src += 4;
+		}
+	}
+}
+
+/* This function is a main function for converting color space from YUYV to planar RGB.
+ * It can fill directly a torch float tensor
+ * Written by Marko Vitez.
+ */
+void yuyv2torchfloatRGB(const unsigned char *frame, float *dst_float, int imgstride, int rowstride, int w, int h)
+{
+	int i, j, w2 = w / 2;
+	float *dst;
+	const uint8_t *src;
+
+	/* convert for R channel */
+	src = frame;
+	for (i = 0; i < h; i++) {
+		dst = dst_float + i * rowstride;
+		for (j = 0; j < w2; j++) {
+			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUR[ src[3] ] + 1024] * BYTE2FLOAT;
+			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUR[ src[3] ] + 1024] * BYTE2FLOAT;
+			src += 4;
+		}
+	}
+
+	/* convert for G channel */
+	src = frame;
+	for (i = 0; i < h; i++) {
+		dst = dst_float + i * rowstride + imgstride;
+		for (j = 0; j < w2; j++) {
+			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUGU[ src[1] ] + TB_YUGV[ src[3] ] + 1024] * BYTE2FLOAT;
+			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUGU[ src[1] ] + TB_YUGV[ src[3] ] + 1024] * BYTE2FLOAT;
+			src += 4;
+		}
+	}
+
+	/* convert for B channel */
+	src = frame;
+	for (i = 0; i < h; i++) {
+		dst = dst_float + i * rowstride + 2*imgstride;
+		for (j = 0; j < w2; j++) {
+			*dst++ = TB_SAT[ TB_Y[ src[0] ] + TB_YUB[ src[1] ] + 1024] * BYTE2FLOAT;
+			*dst++ = TB_SAT[ TB_Y[ src[2] ] + TB_YUB[ src[1] ] + 1024] * BYTE2FLOAT;
+			src += 4;
+		}
+	}
+}
+
+// Convert packed RGB produced by the rescaler (rows aligned to 4 bytes) to planar float,
+// every channel c becomes rgb * norm[c] + norm[c+3] if norm is given (see scale_normalized)
+void rgb_tofloat(const uint8_t *rgb, int width, int height, float *dst_float, int imgstride, int linestride, const float *norm)
+{
+	int c, i, j, srcstride;
+
+	srcstride = (width * 3 + 3) / 4 * 4;
+	for(c = 0; c < 3; c++)
+	{
+		float scale = norm ? norm[c] : BYTE2FLOAT, bias = norm ? norm[c+3] : 0;
+
+		for(i = 0; i < height; i++)
+			for(j = 0; j < width; j++)
+				dst_float[j + i * linestride + c * imgstride] =
+					rgb[c + 3*j + srcstride*i] * scale + bias;
+	}
+}
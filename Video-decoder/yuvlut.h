@@ -0,0 +1,31 @@
+#ifndef _YUVLUT_H_INCLUDED_
+#define _YUVLUT_H_INCLUDED_
+
+#include <stdint.h>
+
+struct AVFrame;
+
+// Calculate the lookup tables, before any conversion
+void video_decoder_yuv420p_rgbp_LUT();
+
+// Select the SIMD row converters of yuvrgb.c (see yuvrow_select) for the planar YUV
+// conversions and return their name, "lut" if the lookup tables are used
+const char *yuvlut_select(int simd);
+
+// yuv420p and yuv422p to the planes of rgb, whose rows are yuv->width & ~1 bytes long
+void video_decoder_yuv420p_rgbp(struct AVFrame *yuv, struct AVFrame *rgb);
+void video_decoder_yuv422p_rgbp(struct AVFrame *yuv, struct AVFrame *rgb);
+
+// yuv420p and yuv422p to planar float in [0, 1], imgstride and rowstride in floats
+void yuv420p_floatrgbp(struct AVFrame *yuv, float *dst_float, int imgstride, int rowstride, int w, int h);
+void yuv422p_floatrgbp(struct AVFrame *yuv, float *dst_float, int imgstride, int rowstride, int w, int h);
+
+// YUYV of the capture devices to planar RGB bytes or floats in [0, 1]
+void yuyv2torchRGB(const unsigned char *frame, unsigned char *dst_byte, int imgstride, int rowstride, int w, int h);
+void yuyv2torchfloatRGB(const unsigned char *frame, float *dst_float, int imgstride, int rowstride, int w, int h);
+
+// Packed RGB produced by the rescaler (rows aligned to 4 bytes) to planar float,
+// every channel c becomes rgb * norm[c] + norm[c+3] if norm is given, else rgb / 255
+void rgb_tofloat(const uint8_t *rgb, int width, int height, float *dst_float, int imgstride, int linestride, const float *norm);
+
+#endif
@@ -0,0 +1,636 @@
+/*
+ * File:
+ *  yuvrgb.c
+ *
+ * Description:
+ *  SIMD (SSE2, AVX2, NEON) row converters from planar YUV with horizontally
+ *  subsampled chroma to planar RGB, used by video_decoder.c
+ *  The integer math gives exactly the same results of the lookup tables:
+ *  every term k * c / 256 is truncated towards zero as in C, computing it as
+ *  sign(c) * ((k >> 8) * |c| + (((k & 255) * |c|) >> 8)), which fits in 16 bits
+ *  The same file has the converters from planar RGB to yuv420p of the encoder
+ */
+
+#include <stdint.h>
+#include <math.h>
+#include "yuvrgb.h"
+
+/* Same values of the TB_ lookup tables in yuvlut.c */
+#define TB_Y(y)    (((y) - 16) * 298 / 256)
+#define TB_YUR(v)  (459 * ((v) - 128) / 256)
+#define TB_YUB(u)  (541 * ((u) - 128) / 256)
+#define TB_YUGU(u) (-137 * ((u) - 128) / 256)
+#define TB_YUGV(v) (-55 * ((v) - 128) / 256)
+
+static inline uint8_t sat(int x)
+{
+	return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+/* Convert the last pixels of the row (from j to w), which don't fill a whole vector */
+static void yuvrow_byte_tail(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	uint8_t *r, uint8_t *g, uint8_t *b, int j, int w)
+{
+	int YUR, YUG, YUB, Y;
+
+	for(; j < w; j += 2)
+	{
+		YUR = TB_YUR(v[j/2]);
+		YUG = TB_YUGU(u[j/2]) + TB_YUGV(v[j/2]);
+		YUB = TB_YUB(u[j/2]);
+		Y = TB_Y(y[j]);
+		r[j] = sat(Y + YUR);
+		g[j] = sat(Y + YUG);
+		b[j] = sat(Y + YUB);
+		Y = TB_Y(y[j+1]);
+		r[j+1] = sat(Y + YUR);
+		g[j+1] = sat(Y + YUG);
+		b[j+1] = sat(Y + YUB);
+	}
+}
+
+static void yuvrow_float_tail(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	float *r, float *g, float *b, int j, int w)
+{
+	int YUR, YUG, YUB, Y;
+
+	for(; j < w; j += 2)
+	{
+		YUR = TB_YUR(v[j/2]);
+		YUG = TB_YUGU(u[j/2]) + TB_YUGV(v[j/2]);
+		YUB = TB_YUB(u[j/2]);
+		Y = TB_Y(y[j]);
+		r[j] = sat(Y + YUR) * BYTE2FLOAT;
+		g[j] = sat(Y + YUG) * BYTE2FLOAT;
+		b[j] = sat(Y + YUB) * BYTE2FLOAT;
+		Y = TB_Y(y[j+1]);
+		r[j+1] = sat(Y + YUR) * BYTE2FLOAT;
+		g[j+1] = sat(Y + YUG) * BYTE2FLOAT;
+		b[j+1] = sat(Y + YUB) * BYTE2FLOAT;
+	}
+}
+
+/***************************************
+Planar RGB to yuv420p for the encoder
+***************************************/
+
+/* BT.601 limited range, the chroma is computed from the rounded average of the RGB
+ * values of every 2x2 block; all the terms fit in 16 bits */
+#define RGB_Y(r, g, b) (((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define RGB_U(r, g, b) (((-38 * (r) - 74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define RGB_V(r, g, b) (((112 * (r) - 94 * (g) - 18 * (b) + 128) >> 8) + 128)
+
+/* Float in [0, 1] to byte, rounded to nearest even as the SIMD conversion; NaN gives 0 */
+static inline uint8_t float2byte(float x)
+{
+	x *= 255;
+	return x > 0 ? (uint8_t)lrintf(x < 255 ? x : 255) : 0;
+}
+
+/* Convert a 2x2 block, p[c][x] is the channel c (R, G, B of the first row, then of the
+ * second) of the pixel x; if n is 1, only the first column is stored */
+static inline void rgb_block(uint8_t p[6][2], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int n)
+{
+	int x, c[3];
+
+	for(x = 0; x < 3; x++)
+		c[x] = (p[x][0] + p[x][1] + p[x+3][0] + p[x+3][1] + 2) >> 2;
+	for(x = 0; x < n; x++)
+	{
+		y0[x] = RGB_Y(p[0][x], p[1][x], p[2][x]);
+		y1[x] = RGB_Y(p[3][x], p[4][x], p[5][x]);
+	}
+	*u = RGB_U(c[0], c[1], c[2]);
+	*v = RGB_V(c[0], c[1], c[2]);
+}
+
+/* Convert the pixels from j (even) to w of the two rows; the last column is repeated if w is odd */
+static void rgbrow_byte_tail(const uint8_t *const rgb[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int j, int w)
+{
+	uint8_t p[6][2];
+	int k, x1;
+
+	for(; j < w; j += 2)
+	{
+		x1 = j + 1 < w ? j + 1 : j;
+		for(k = 0; k < 6; k++)
+		{
+			p[k][0] = rgb[k][j];
+			p[k][1] = rgb[k][x1];
+		}
+		rgb_block(p, y0 + j, y1 + j, u + j/2, v + j/2, x1 - j + 1);
+	}
+}
+
+static void rgbrow_float_tail(const float *const rgb[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int j, int w)
+{
+	uint8_t p[6][2];
+	int k, x1;
+
+	for(; j < w; j += 2)
+	{
+		x1 = j + 1 < w ? j + 1 : j;
+		for(k = 0; k < 6; k++)
+		{
+			p[k][0] = float2byte(rgb[k][j]);
+			p[k][1] = float2byte(rgb[k][x1]);
+		}
+		rgb_block(p, y0 + j, y1 + j, u + j/2, v + j/2, x1 - j + 1);
+	}
+}
+
+static void rgbrow_byte_c(const uint8_t *const rgb[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int w)
+{
+	rgbrow_byte_tail(rgb, y0, y1, u, v, 0, w);
+}
+
+static void rgbrow_float_c(const float *const rgb[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int w)
+{
+	rgbrow_float_tail(rgb, y0, y1, u, v, 0, w);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+/***************************************
+SSE2, 16 pixels per iteration
+***************************************/
+
+/* k * c / 256 truncated towards zero, for |c| <= 255 and 0 <= k < 512 */
+static inline TARGET_SSE2 __m128i mulk_sse2(__m128i c, int k)
+{
+	__m128i sign = _mm_srai_epi16(c, 15);
+	__m128i a = _mm_sub_epi16(_mm_xor_si128(c, sign), sign);
+	__m128i t = _mm_srli_epi16(_mm_mullo_epi16(a, _mm_set1_epi16(k & 255)), 8);
+
+	if(k >> 8)
+		t = _mm_add_epi16(t, _mm_mullo_epi16(a, _mm_set1_epi16(k >> 8)));
+	return _mm_sub_epi16(_mm_xor_si128(t, sign), sign);
+}
+
+/* Add the chroma term c (one every two pixels) to the luma terms and saturate to bytes */
+static inline TARGET_SSE2 __m128i pack_sse2(__m128i y0, __m128i y1, __m128i c)
+{
+	return _mm_packus_epi16(_mm_add_epi16(y0, _mm_unpacklo_epi16(c, c)),
+		_mm_add_epi16(y1, _mm_unpackhi_epi16(c, c)));
+}
+
+static inline TARGET_SSE2 void yuv16_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	__m128i *r, __m128i *g, __m128i *b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c16 = _mm_set1_epi16(16), c128 = _mm_set1_epi16(128);
+	__m128i yy = _mm_loadu_si128((const __m128i *)y);
+	__m128i uu = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)u), zero), c128);
+	__m128i vv = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)v), zero), c128);
+	__m128i y0 = mulk_sse2(_mm_sub_epi16(_mm_unpacklo_epi8(yy, zero), c16), 298);
+	__m128i y1 = mulk_sse2(_mm_sub_epi16(_mm_unpackhi_epi8(yy, zero), c16), 298);
+
+	*r = pack_sse2(y0, y1, mulk_sse2(vv, 459));
+	*g = pack_sse2(y0, y1, _mm_sub_epi16(_mm_sub_epi16(zero, mulk_sse2(uu, 137)), mulk_sse2(vv, 55)));
+	*b = pack_sse2(y0, y1, mulk_sse2(uu, 541));
+}
+
+static inline TARGET_SSE2 void storefloat_sse2(float *dst, __m128i x)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 k = _mm_set1_ps(BYTE2FLOAT);
+	__m128i lo = _mm_unpacklo_epi8(x, zero);
+	__m128i hi = _mm_unpackhi_epi8(x, zero);
+
+	_mm_storeu_ps(dst, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), k));
+	_mm_storeu_ps(dst + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), k));
+	_mm_storeu_ps(dst + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), k));
+	_mm_storeu_ps(dst + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), k));
+}
+
+static TARGET_SSE2 void yuvrow_byte_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	uint8_t *r, uint8_t *g, uint8_t *b, int w)
+{
+	__m128i R, G, B;
+	int j;
+
+	for(j = 0; j + 16 <= w; j += 16)
+	{
+		yuv16_sse2(y + j, u + j/2, v + j/2, &R, &G, &B);
+		_mm_storeu_si128((__m128i *)(r + j), R);
+		_mm_storeu_si128((__m128i *)(g + j), G);
+		_mm_storeu_si128((__m128i *)(b + j), B);
+	}
+	yuvrow_byte_tail(y, u, v, r, g, b, j, w);
+}
+
+static TARGET_SSE2 void yuvrow_float_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	float *r, float *g, float *b, int w)
+{
+	__m128i R, G, B;
+	int j;
+
+	for(j = 0; j + 16 <= w; j += 16)
+	{
+		yuv16_sse2(y + j, u + j/2, v + j/2, &R, &G, &B);
+		storefloat_sse2(r + j, R);
+		storefloat_sse2(g + j, G);
+		storefloat_sse2(b + j, B);
+	}
+	yuvrow_float_tail(y, u, v, r, g, b, j, w);
+}
+
+/***************************************
+SSE2 planar RGB to yuv420p, 16 pixels per iteration
+***************************************/
+
+/* 66 * r + 129 * g + 25 * b + 128 fits in unsigned 16 bits */
+static inline TARGET_SSE2 __m128i luma8_sse2(__m128i r, __m128i g, __m128i b)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+
+	t = _mm_add_epi16(t, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+	return _mm_add_epi16(_mm_srli_epi16(t, 8), _mm_set1_epi16(16));
+}
+
+static inline TARGET_SSE2 __m128i luma16_sse2(__m128i r, __m128i g, __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	return _mm_packus_epi16(luma8_sse2(_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero), _mm_unpacklo_epi8(b, zero)),
+		luma8_sse2(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero), _mm_unpackhi_epi8(b, zero)));
+}
+
+/* Rounded average of the 2x2 blocks of 16 pixels of two rows, as 8 16-bit values */
+static inline TARGET_SSE2 __m128i avg2x2_sse2(__m128i a, __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1);
+	__m128i lo = _mm_madd_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)), one);
+	__m128i hi = _mm_madd_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)), one);
+
+	return _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(lo, hi), _mm_set1_epi16(2)), 2);
+}
+
+/* ((kr * r + kg * g + kb * b + 128) >> 8) + 128 on signed 16 bits */
+static inline TARGET_SSE2 __m128i chroma8_sse2(__m128i r, __m128i g, __m128i b, int kr, int kg, int kb)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kr)), _mm_mullo_epi16(g, _mm_set1_epi16(kg)));
+
+	t = _mm_add_epi16(t, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(kb)), _mm_set1_epi16(128)));
+	t = _mm_add_epi16(_mm_srai_epi16(t, 8), _mm_set1_epi16(128));
+	return _mm_packus_epi16(t, t);
+}
+
+static inline TARGET_SSE2 void rgb16_sse2(const __m128i p[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+	__m128i r = avg2x2_sse2(p[0], p[3]), g = avg2x2_sse2(p[1], p[4]), b = avg2x2_sse2(p[2], p[5]);
+
+	_mm_storeu_si128((__m128i *)y0, luma16_sse2(p[0], p[1], p[2]));
+	_mm_storeu_si128((__m128i *)y1, luma16_sse2(p[3], p[4], p[5]));
+	_mm_storel_epi64((__m128i *)u, chroma8_sse2(r, g, b, -38, -74, 112));
+	_mm_storel_epi64((__m128i *)v, chroma8_sse2(r, g, b, 112, -94, -18));
+}
+
+/* 16 floats in [0, 1] to bytes, NaN gives 0 as float2byte */
+static inline TARGET_SSE2 __m128i loadfloat_sse2(const float *src)
+{
+	const __m128 zero = _mm_setzero_ps(), k = _mm_set1_ps(255);
+	__m128i x[4];
+	int i;
+
+	for(i = 0; i < 4; i++)
+		x[i] = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + 4*i), k), zero), k));
+	return _mm_packus_epi16(_mm_packs_epi32(x[0], x[1]), _mm_packs_epi32(x[2], x[3]));
+}
+
+static TARGET_SSE2 void rgbrow_byte_sse2(const uint8_t *const rgb[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int w)
+{
+	__m128i p[6];
+	int j, k;
+
+	for(j = 0; j + 16 <= w; j += 16)
+	{
+		for(k = 0; k < 6; k++)
+			p[k] = _mm_loadu_si128((const __m128i *)(rgb[k] + j));
+		rgb16_sse2(p, y0 + j, y1 + j, u + j/2, v + j/2);
+	}
+	rgbrow_byte_tail(rgb, y0, y1, u, v, j, w);
+}
+
+static TARGET_SSE2 void rgbrow_float_sse2(const float *const rgb[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int w)
+{
+	__m128i p[6];
+	int j, k;
+
+	for(j = 0; j + 16 <= w; j += 16)
+	{
+		for(k = 0; k < 6; k++)
+			p[k] = loadfloat_sse2(rgb[k] + j);
+		rgb16_sse2(p, y0 + j, y1 + j, u + j/2, v + j/2);
+	}
+	rgbrow_float_tail(rgb, y0, y1, u, v, j, w);
+}
+
+/***************************************
+AVX2, 32 pixels per iteration
+***************************************/
+
+static inline TARGET_AVX2 __m256i mulk_avx2(__m256i c, int k)
+{
+	__m256i sign = _mm256_srai_epi16(c, 15);
+	__m256i a = _mm256_sub_epi16(_mm256_xor_si256(c, sign), sign);
+	__m256i t = _mm256_srli_epi16(_mm256_mullo_epi16(a, _mm256_set1_epi16(k & 255)), 8);
+
+	if(k >> 8)
+		t = _mm256_add_epi16(t, _mm256_mullo_epi16(a, _mm256_set1_epi16(k >> 8)));
+	return _mm256_sub_epi16(_mm256_xor_si256(t, sign), sign);
+}
+
+static inline TARGET_AVX2 __m256i pack_avx2(__m256i y0, __m256i y1, __m256i c)
+{
+	__m256i lo = _mm256_unpacklo_epi16(c, c);
+	__m256i hi = _mm256_unpackhi_epi16(c, c);
+	// Unpack and pack work inside the 128 bit lanes, so the order has to be fixed
+	__m256i c0 = _mm256_permute2x128_si256(lo, hi, 0x20);	// Chroma for pixels 0-15
+	__m256i c1 = _mm256_permute2x128_si256(lo, hi, 0x31);	// Chroma for pixels 16-31
+
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_add_epi16(y0, c0),
+		_mm256_add_epi16(y1, c1)), 0xd8);
+}
+
+static inline TARGET_AVX2 void yuv32_avx2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	__m256i *r, __m256i *g, __m256i *b)
+{
+	const __m256i c16 = _mm256_set1_epi16(16), c128 = _mm256_set1_epi16(128);
+	__m256i uu = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)u)), c128);
+	__m256i vv = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)v)), c128);
+	__m256i y0 = mulk_avx2(_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)y)), c16), 298);
+	__m256i y1 = mulk_avx2(_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + 16))), c16), 298);
+
+	*r = pack_avx2(y0, y1, mulk_avx2(vv, 459));
+	*g = pack_avx2(y0, y1, _mm256_sub_epi16(_mm256_sub_epi16(_mm256_setzero_si256(), mulk_avx2(uu, 137)), mulk_avx2(vv, 55)));
+	*b = pack_avx2(y0, y1, mulk_avx2(uu, 541));
+}
+
+static inline TARGET_AVX2 void storefloat_avx2(float *dst, __m256i x)
+{
+	const __m256 k = _mm256_set1_ps(BYTE2FLOAT);
+	__m128i lo = _mm256_castsi256_si128(x);
+	__m128i hi = _mm256_extracti128_si256(x, 1);
+
+	_mm256_storeu_ps(dst, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(lo)), k));
+	_mm256_storeu_ps(dst + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8))), k));
+	_mm256_storeu_ps(dst + 16, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(hi)), k));
+	_mm256_storeu_ps(dst + 24, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8))), k));
+}
+
+static TARGET_AVX2 void yuvrow_byte_avx2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	uint8_t *r, uint8_t *g, uint8_t *b, int w)
+{
+	__m256i R, G, B;
+	int j;
+
+	for(j = 0; j + 32 <= w; j += 32)
+	{
+		yuv32_avx2(y + j, u + j/2, v + j/2, &R, &G, &B);
+		_mm256_storeu_si256((__m256i *)(r + j), R);
+		_mm256_storeu_si256((__m256i *)(g + j), G);
+		_mm256_storeu_si256((__m256i *)(b + j), B);
+	}
+	yuvrow_byte_tail(y, u, v, r, g, b, j, w);
+}
+
+static TARGET_AVX2 void yuvrow_float_avx2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	float *r, float *g, float *b, int w)
+{
+	__m256i R, G, B;
+	int j;
+
+	for(j = 0; j + 32 <= w; j += 32)
+	{
+		yuv32_avx2(y + j, u + j/2, v + j/2, &R, &G, &B);
+		storefloat_avx2(r + j, R);
+		storefloat_avx2(g + j, G);
+		storefloat_avx2(b + j, B);
+	}
+	yuvrow_float_tail(y, u, v, r, g, b, j, w);
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+/***************************************
+NEON, 16 pixels per iteration
+***************************************/
+
+static inline int16x8_t mulk_neon(int16x8_t c, int k)
+{
+	uint16x8_t a = vreinterpretq_u16_s16(vabsq_s16(c));
+	uint16x8_t t = vshrq_n_u16(vmulq_n_u16(a, k & 255), 8);
+	int16x8_t s;
+
+	if(k >> 8)
+		t = vmlaq_n_u16(t, a, k >> 8);
+	s = vreinterpretq_s16_u16(t);
+	return vbslq_s16(vcltq_s16(c, vdupq_n_s16(0)), vnegq_s16(s), s);
+}
+
+static inline uint8x16_t pack_neon(int16x8_t y0, int16x8_t y1, int16x8_t c)
+{
+	int16x8x2_t cc = vzipq_s16(c, c);
+
+	return vcombine_u8(vqmovun_s16(vaddq_s16(y0, cc.val[0])), vqmovun_s16(vaddq_s16(y1, cc.val[1])));
+}
+
+static inline void yuv16_neon(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	uint8x16_t *r, uint8x16_t *g, uint8x16_t *b)
+{
+	const int16x8_t c16 = vdupq_n_s16(16), c128 = vdupq_n_s16(128);
+	uint8x16_t yy = vld1q_u8(y);
+	int16x8_t uu = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u))), c128);
+	int16x8_t vv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(v))), c128);
+	int16x8_t y0 = mulk_neon(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(yy))), c16), 298);
+	int16x8_t y1 = mulk_neon(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(yy))), c16), 298);
+
+	*r = pack_neon(y0, y1, mulk_neon(vv, 459));
+	*g = pack_neon(y0, y1, vsubq_s16(vnegq_s16(mulk_neon(uu, 137)), mulk_neon(vv, 55)));
+	*b = pack_neon(y0, y1, mulk_neon(uu, 541));
+}
+
+static inline void storefloat_neon(float *dst, uint8x16_t x)
+{
+	uint16x8_t lo = vmovl_u8(vget_low_u8(x));
+	uint16x8_t hi = vmovl_u8(vget_high_u8(x));
+
+	vst1q_f32(dst, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), BYTE2FLOAT));
+	vst1q_f32(dst + 4, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), BYTE2FLOAT));
+	vst1q_f32(dst + 8, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), BYTE2FLOAT));
+	vst1q_f32(dst + 12, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), BYTE2FLOAT));
+}
+
+static void yuvrow_byte_neon(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	uint8_t *r, uint8_t *g, uint8_t *b, int w)
+{
+	uint8x16_t R, G, B;
+	int j;
+
+	for(j = 0; j + 16 <= w; j += 16)
+	{
+		yuv16_neon(y + j, u + j/2, v + j/2, &R, &G, &B);
+		vst1q_u8(r + j, R);
+		vst1q_u8(g + j, G);
+		vst1q_u8(b + j, B);
+	}
+	yuvrow_byte_tail(y, u, v, r, g, b, j, w);
+}
+
+static void yuvrow_float_neon(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	float *r, float *g, float *b, int w)
+{
+	uint8x16_t R, G, B;
+	int j;
+
+	for(j = 0; j + 16 <= w; j += 16)
+	{
+		yuv16_neon(y + j, u + j/2, v + j/2, &R, &G, &B);
+		storefloat_neon(r + j, R);
+		storefloat_neon(g + j, G);
+		storefloat_neon(b + j, B);
+	}
+	yuvrow_float_tail(y, u, v, r, g, b, j, w);
+}
+
+/***************************************
+NEON planar RGB to yuv420p, 16 pixels per iteration
+***************************************/
+
+static inline uint8x8_t luma8_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+	uint16x8_t t = vmull_u8(r, vdup_n_u8(66));
+
+	t = vmlal_u8(t, g, vdup_n_u8(129));
+	t = vmlal_u8(t, b, vdup_n_u8(25));
+	return vadd_u8(vrshrn_n_u16(t, 8), vdup_n_u8(16));
+}
+
+static inline uint8x8_t chroma8_neon(int16x8_t r, int16x8_t g, int16x8_t b, int kr, int kg, int kb)
+{
+	int16x8_t t = vmlaq_n_s16(vmlaq_n_s16(vmulq_n_s16(r, kr), g, kg), b, kb);
+
+	return vqmovun_s16(vaddq_s16(vrshrq_n_s16(t, 8), vdupq_n_s16(128)));
+}
+
+/* Rounded average of the 2x2 blocks of 16 pixels of two rows */
+static inline int16x8_t avg2x2_neon(uint8x16_t a, uint8x16_t b)
+{
+	return vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(a), b), 2));
+}
+
+static inline void rgb16_neon(const uint8x16_t p[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+	int16x8_t r = avg2x2_neon(p[0], p[3]), g = avg2x2_neon(p[1], p[4]), b = avg2x2_neon(p[2], p[5]);
+
+	vst1q_u8(y0, vcombine_u8(luma8_neon(vget_low_u8(p[0]), vget_low_u8(p[1]), vget_low_u8(p[2])),
+		luma8_neon(vget_high_u8(p[0]), vget_high_u8(p[1]), vget_high_u8(p[2]))));
+	vst1q_u8(y1, vcombine_u8(luma8_neon(vget_low_u8(p[3]), vget_low_u8(p[4]), vget_low_u8(p[5])),
+		luma8_neon(vget_high_u8(p[3]), vget_high_u8(p[4]), vget_high_u8(p[5]))));
+	vst1_u8(u, chroma8_neon(r, g, b, -38, -74, 112));
+	vst1_u8(v, chroma8_neon(r, g, b, 112, -94, -18));
+}
+
+/* 16 floats in [0, 1] to bytes; on 32-bit ARM the halves are rounded up */
+static inline uint8x16_t loadfloat_neon(const float *src)
+{
+	uint16x4_t x[4];
+	int i;
+
+	for(i = 0; i < 4; i++)
+	{
+		float32x4_t f = vminq_f32(vmaxq_f32(vmulq_n_f32(vld1q_f32(src + 4*i), 255), vdupq_n_f32(0)), vdupq_n_f32(255));
+#ifdef __aarch64__
+		x[i] = vmovn_u32(vcvtnq_u32_f32(f));
+#else
+		x[i] = vmovn_u32(vcvtq_u32_f32(vaddq_f32(f, vdupq_n_f32(0.5f))));
+#endif
+	}
+	return vcombine_u8(vmovn_u16(vcombine_u16(x[0], x[1])), vmovn_u16(vcombine_u16(x[2], x[3])));
+}
+
+static void rgbrow_byte_neon(const uint8_t *const rgb[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int w)
+{
+	uint8x16_t p[6];
+	int j, k;
+
+	for(j = 0; j + 16 <= w; j += 16)
+	{
+		for(k = 0; k < 6; k++)
+			p[k] = vld1q_u8(rgb[k] + j);
+		rgb16_neon(p, y0 + j, y1 + j, u + j/2, v + j/2);
+	}
+	rgbrow_byte_tail(rgb, y0, y1, u, v, j, w);
+}
+
+static void rgbrow_float_neon(const float *const rgb[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int w)
+{
+	uint8x16_t p[6];
+	int j, k;
+
+	for(j = 0; j + 16 <= w; j += 16)
+	{
+		for(k = 0; k < 6; k++)
+			p[k] = loadfloat_neon(rgb[k] + j);
+		rgb16_neon(p, y0 + j, y1 + j, u + j/2, v + j/2);
+	}
+	rgbrow_float_tail(rgb, y0, y1, u, v, j, w);
+}
+#endif
+
+const char *yuvrow_select(int simd, YUVROW_BYTE *tobyte, YUVROW_FLOAT *tofloat)
+{
+	*tobyte = 0;
+	*tofloat = 0;
+	if(!simd)
+		return "lut";
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		*tobyte = yuvrow_byte_avx2;
+		*tofloat = yuvrow_float_avx2;
+		return "avx2";
+	}
+	if(__builtin_cpu_supports("sse2"))
+	{
+		*tobyte = yuvrow_byte_sse2;
+		*tofloat = yuvrow_float_sse2;
+		return "sse2";
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	// NEON is mandatory on aarch64 and explicitly enabled by the Makefile on arm
+	*tobyte = yuvrow_byte_neon;
+	*tofloat = yuvrow_float_neon;
+	return "neon";
+#endif
+	return "lut";
+}
+
+const char *rgbrow_select(int simd, RGBROW_BYTE *frombyte, RGBROW_FLOAT *fromfloat)
+{
+	*frombyte = rgbrow_byte_c;
+	*fromfloat = rgbrow_float_c;
+	if(!simd)
+		return "c";
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2"))
+	{
+		*frombyte = rgbrow_byte_sse2;
+		*fromfloat = rgbrow_float_sse2;
+		return "sse2";
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	*frombyte = rgbrow_byte_neon;
+	*fromfloat = rgbrow_float_neon;
+	return "neon";
+#endif
+	return "c";
+}
@@ -0,0 +1,30 @@
+#ifndef _YUVRGB_H_INCLUDED_
+#define _YUVRGB_H_INCLUDED_
+
+#include <stdint.h>
+
+#define BYTE2FLOAT 0.003921568f // 1/255
+
+// Convert one row of planar YUV with horizontally subsampled chroma (4:2:0 or 4:2:2)
+// to planar RGB; w has to be even and the result is exactly the same given by the
+// lookup table conversion in yuvlut.c
+typedef void (*YUVROW_BYTE)(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	uint8_t *r, uint8_t *g, uint8_t *b, int w);
+typedef void (*YUVROW_FLOAT)(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+	float *r, float *g, float *b, int w);
+
+// Select the fastest row converters supported by the CPU and return their name;
+// if simd is 0 or there is no SIMD support, the converters are set to 0 and "lut" is returned
+const char *yuvrow_select(int simd, YUVROW_BYTE *tobyte, YUVROW_FLOAT *tofloat);
+
+// Convert two rows of planar RGB (rgb[0..2] is the first row, rgb[3..5] the second,
+// the same for the last row of an odd height) to the two luma rows y0, y1 and one
+// row of the u, v planes of yuv420p; float values are in [0, 1], w can be odd
+typedef void (*RGBROW_BYTE)(const uint8_t *const rgb[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int w);
+typedef void (*RGBROW_FLOAT)(const float *const rgb[6], uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int w);
+
+// Select the RGB to yuv420p converters as yuvrow_select; without SIMD the plain C
+// converters are set and "c" is returned
+const char *rgbrow_select(int simd, RGBROW_BYTE *frombyte, RGBROW_FLOAT *fromfloat);
+
+#endif